@@ -0,0 +1,133 @@
+#include "arena.h"
+
+#include <stdlib.h>
+
+namespace mevent {
+
+Arena::Arena(size_t block_size, size_t max_retained)
+    : head_(NULL),
+      cur_(NULL),
+      ptr_(NULL),
+      end_(NULL),
+      block_size_(block_size),
+      max_retained_(max_retained) {
+}
+
+Arena::~Arena() {
+    FreeBlocks(head_);
+}
+
+void Arena::FreeBlocks(Block *b) {
+    while (b) {
+        Block *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+void *Arena::Allocate(size_t n, size_t align) {
+    uintptr_t p = (reinterpret_cast<uintptr_t>(ptr_) + align - 1) & ~(uintptr_t)(align - 1);
+    
+    if (!ptr_ || p + n > reinterpret_cast<uintptr_t>(end_)) {
+        if (!NextBlock(n, align)) {
+            throw std::bad_alloc();
+        }
+        p = (reinterpret_cast<uintptr_t>(ptr_) + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    
+    ptr_ = reinterpret_cast<char *>(p + n);
+    
+    return reinterpret_cast<void *>(p);
+}
+
+//Moves on to the next retained block that fits, or appends a new one
+bool Arena::NextBlock(size_t n, size_t align) {
+    size_t need = n + align + sizeof(Block);
+    
+    Block *prev = cur_;
+    Block *b = cur_ ? cur_->next : head_;
+    
+    while (b && b->size < need) {
+        prev = b;
+        b = b->next;
+    }
+    
+    if (!b) {
+        size_t size = need > block_size_ ? need : block_size_;
+        
+        b = static_cast<Block *>(malloc(size));
+        if (!b) {
+            return false;
+        }
+        
+        b->size = size;
+        b->next = NULL;
+        
+        if (prev) {
+            prev->next = b;
+        } else {
+            head_ = b;
+        }
+    }
+    
+    cur_ = b;
+    ptr_ = reinterpret_cast<char *>(b + 1);
+    end_ = reinterpret_cast<char *>(b) + b->size;
+    
+    return true;
+}
+
+void Arena::Reset() {
+    if (!head_) {
+        return;
+    }
+    
+    //Keep the first blocks up to max_retained_, a single oversized request
+    //must not pin its memory for the connection's whole lifetime
+    size_t retained = head_->size;
+    Block *b = head_;
+    
+    while (b->next && retained + b->next->size <= max_retained_) {
+        b = b->next;
+        retained += b->size;
+    }
+    
+    Block *extra = b->next;
+    b->next = NULL;
+    
+    while (extra) {
+        Block *next = extra->next;
+        free(extra);
+        extra = next;
+    }
+    
+    if (head_->size > max_retained_) {
+        free(head_);
+        head_ = NULL;
+        cur_ = NULL;
+        ptr_ = NULL;
+        end_ = NULL;
+        return;
+    }
+    
+    cur_ = head_;
+    ptr_ = reinterpret_cast<char *>(head_ + 1);
+    end_ = reinterpret_cast<char *>(head_) + head_->size;
+}
+
+std::shared_ptr<const void> Arena::Detach() {
+    Block *blocks = head_;
+    
+    head_ = NULL;
+    cur_ = NULL;
+    ptr_ = NULL;
+    end_ = NULL;
+    
+    if (!blocks) {
+        return nullptr;
+    }
+    
+    return std::shared_ptr<const void>(blocks, FreeBlocks);
+}
+
+}//namespace mevent
@@ -0,0 +1,107 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+#include <memory>
+#include <string>
+#include <map>
+#include <vector>
+#include <utility>
+#include <functional>
+
+namespace mevent {
+
+//Bump allocator for per-request state. Memory is only given back as a whole
+//by Reset(), which rewinds to the first block and keeps up to max_retained
+//bytes of blocks for the next request, so a steady stream of requests stops
+//hitting malloc. Not thread safe, it lives under the connection lock.
+class Arena {
+public:
+    Arena(size_t block_size = 4096, size_t max_retained = 16384);
+    ~Arena();
+    
+    void *Allocate(size_t n, size_t align);
+    
+    void Reset();
+    
+    //Hands every block to the returned owner and starts over empty, so what
+    //was allocated so far stays valid for as long as a copy of it is alive
+    std::shared_ptr<const void> Detach();
+    
+private:
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+    
+    struct Block {
+        Block   *next;
+        size_t   size;
+    };
+    
+    bool NextBlock(size_t n, size_t align);
+    
+    static void FreeBlocks(Block *b);
+    
+    Block   *head_;
+    Block   *cur_;
+    char    *ptr_;
+    char    *end_;
+    
+    size_t   block_size_;
+    size_t   max_retained_;
+};
+
+//Allocator for standard containers backed by an Arena; deallocate() is a
+//no-op. A default constructed one has no arena and falls back to new/delete.
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    
+    ArenaAllocator() : arena_(NULL) {}
+    explicit ArenaAllocator(Arena *arena) : arena_(arena) {}
+    
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena_) {}
+    
+    T *allocate(size_t n) {
+        if (arena_) {
+            return static_cast<T *>(arena_->Allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+    
+    void deallocate(T *p, size_t n) {
+        (void)n;//avoid unused parameter warning
+        if (!arena_) {
+            ::operator delete(p);
+        }
+    }
+    
+    template <typename U>
+    struct rebind {
+        typedef ArenaAllocator<U> other;
+    };
+    
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return arena_ == other.arena_; }
+    
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return arena_ != other.arena_; }
+    
+private:
+    template <typename U> friend class ArenaAllocator;
+    
+    Arena *arena_;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+typedef std::map<ArenaString, ArenaString, std::less<ArenaString>,
+                 ArenaAllocator<std::pair<const ArenaString, ArenaString>>> ArenaStringMap;
+
+}//namespace mevent
+
+#endif
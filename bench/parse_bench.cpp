@@ -0,0 +1,65 @@
+//Request::Parse() on a 588 byte browser-like request, see make bench.
+//Parse() is private, the benchmark opens up the class for itself.
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <functional>
+
+#define private public
+#include "../connection.h"
+#undef private
+
+#include "../http_scan.h"
+
+using namespace mevent;
+
+static const char request[] =
+    "GET /api/v1/items?id=12345&sort=desc&page=3 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Cookie: session=abcdef0123456789abcdef0123456789; theme=dark; _ga=GA1.2.1234567890.1234567890\r\n"
+    "Referer: https://www.example.com/some/previous/page\r\n"
+    "Content-Type: application/json\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+int main() {
+    const size_t len = sizeof(request) - 1;
+    const int rounds = 2000000;
+    
+    BufferPool pool;
+    Connection *conn = new Connection();
+    Request &req = conn->req_;
+    
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    
+    for (int i = 0; i < rounds; i++) {
+        req.Reset();
+        req.rbuf_.Reserve(&pool, 0, len);
+        memcpy(req.rbuf_.Data(), request, len);
+        req.rbuf_len_ = len;
+        
+        if (req.Parse() != HTTPParserStatus::FINISHED) {
+            fprintf(stderr, "parse error\n");
+            return 1;
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    double ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / rounds;
+    printf("parse_bench: %zu byte request, %.0f ns per Parse() (%s)\n", len, ns, HTTPScanImpl());
+    
+    return 0;
+}
@@ -0,0 +1,79 @@
+//Looking up all 22 parameters of a query string, once through the
+//std::string getters and once through the StringPiece ones, see make bench.
+//The request state is private, the benchmark opens up the class for itself.
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <functional>
+
+#define private public
+#include "../connection.h"
+#undef private
+
+using namespace mevent;
+
+static double Elapsed(const struct timespec &begin, int rounds) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    return ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / rounds;
+}
+
+int main() {
+    const int params = 22;
+    const int rounds = 200000;
+    
+    //Every fourth value needs decoding
+    std::string query;
+    std::string keys[params];
+    for (int i = 0; i < params; i++) {
+        keys[i] = "param" + std::to_string(i);
+        query += (i ? "&" : "") + keys[i] + "=value" + (i % 4 == 0 ? "%20with+space" : std::to_string(i * 7919));
+    }
+    
+    Connection *conn = new Connection();
+    Request &req = conn->req_;
+    size_t sum = 0;
+    
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    
+    for (int i = 0; i < rounds; i++) {
+        req.Reset();
+        conn->arena_.Reset();
+        req.query_string_ = query;
+        
+        //Required before lookups until they became lazy
+        req.ParseQueryString();
+        
+        for (int k = 0; k < params; k++) {
+            sum += req.QueryStringValue(keys[k]).size();
+        }
+    }
+    
+    printf("query_bench: %d parameters, %.0f ns per request with std::string\n", params, Elapsed(begin, rounds));
+    
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    
+    for (int i = 0; i < rounds; i++) {
+        req.Reset();
+        conn->arena_.Reset();
+        req.query_string_ = query;
+        
+        for (int k = 0; k < params; k++) {
+            StringPiece value;
+            req.QueryStringValue(keys[k], &value);
+            sum += value.Length();
+        }
+    }
+    
+    printf("query_bench: %d parameters, %.0f ns per request with StringPiece\n", params, Elapsed(begin, rounds));
+    
+    //Keeps the lookups from being optimized away
+    return sum == 0;
+}
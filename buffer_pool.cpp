@@ -0,0 +1,140 @@
+#include "buffer_pool.h"
+#include "lock_guard.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <utility>
+
+namespace mevent {
+
+BufferPool::BufferPool(size_t max_free_bytes)
+    : free_bytes_(0),
+      max_free_bytes_(max_free_bytes) {
+    if (pthread_mutex_init(&mtx_, NULL) != 0) {
+        MEVENT_LOG_DEBUG_EXIT(NULL);
+    }
+}
+
+BufferPool::~BufferPool() {
+    for (size_t i = 0; i < sizeof(free_) / sizeof(free_[0]); i++) {
+        for (size_t j = 0; j < free_[i].size(); j++) {
+            free(free_[i][j]);
+        }
+    }
+    
+    pthread_mutex_destroy(&mtx_);
+}
+
+//-1 for sizes that are not pooled
+int BufferPool::SizeClass(size_t size) {
+    int c = 0;
+    
+    for (size_t s = BUFFER_POOL_MIN_SIZE; s <= BUFFER_POOL_MAX_SIZE; s <<= 1, c++) {
+        if (size <= s) {
+            return c;
+        }
+    }
+    
+    return -1;
+}
+
+char *BufferPool::Get(size_t size, size_t *cap) {
+    int c = SizeClass(size);
+    
+    if (c >= 0) {
+        *cap = static_cast<size_t>(BUFFER_POOL_MIN_SIZE) << c;
+        
+        LockGuard lock_guard(mtx_);
+        
+        if (!free_[c].empty()) {
+            char *buf = free_[c].back();
+            free_[c].pop_back();
+            free_bytes_ -= *cap;
+            return buf;
+        }
+    } else {
+        *cap = size;
+    }
+    
+    char *buf = static_cast<char *>(malloc(*cap));
+    if (!buf) {
+        MEVENT_LOG_DEBUG_EXIT(NULL);
+    }
+    
+    return buf;
+}
+
+void BufferPool::Put(char *buf, size_t cap) {
+    int c = SizeClass(cap);
+    
+    if (c >= 0 && (static_cast<size_t>(BUFFER_POOL_MIN_SIZE) << c) == cap) {
+        LockGuard lock_guard(mtx_);
+        
+        if (free_bytes_ + cap <= max_free_bytes_) {
+            free_[c].push_back(buf);
+            free_bytes_ += cap;
+            return;
+        }
+    }
+    
+    free(buf);
+}
+
+//////////////////
+
+ReadBuffer::ReadBuffer()
+    : data_(NULL),
+      cap_(0),
+      pool_(NULL) {
+}
+
+ReadBuffer::~ReadBuffer() {
+    Release();
+}
+
+void ReadBuffer::Reserve(BufferPool *pool, size_t len, size_t n) {
+    if (cap_ - len >= n && data_) {
+        return;
+    }
+    
+    size_t want = len + n;
+    
+    //Past the pooled sizes grow geometrically, e.g. a large WebSocket frame
+    if (want > BUFFER_POOL_MAX_SIZE && want < cap_ * 2) {
+        want = cap_ * 2;
+    }
+    
+    size_t cap;
+    char *data = pool->Get(want, &cap);
+    
+    if (data_) {
+        memcpy(data, data_, len);
+        pool_->Put(data_, cap_);
+    }
+    
+    data_ = data;
+    cap_ = cap;
+    pool_ = pool;
+}
+
+void ReadBuffer::Erase(size_t len, size_t pos, size_t n) {
+    memmove(data_ + pos, data_ + pos + n, len - pos - n);
+}
+
+void ReadBuffer::Release() {
+    if (data_) {
+        pool_->Put(data_, cap_);
+        data_ = NULL;
+        cap_ = 0;
+    }
+}
+
+void ReadBuffer::Swap(ReadBuffer &other) {
+    std::swap(data_, other.data_);
+    std::swap(cap_, other.cap_);
+    std::swap(pool_, other.pool_);
+}
+
+}//namespace mevent
@@ -0,0 +1,76 @@
+#ifndef _BUFFER_POOL_H
+#define _BUFFER_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <vector>
+
+//Smallest and largest pooled buffer, sizes in between are powers of two
+#define BUFFER_POOL_MIN_SIZE 4096
+#define BUFFER_POOL_MAX_SIZE 65536
+
+namespace mevent {
+
+//Per loop free lists of receive buffers. Connections take one when there is
+//something to read and give it back as soon as nothing unprocessed is left,
+//so idle connections hold no memory and busy ones stop hitting malloc.
+//Buffers above BUFFER_POOL_MAX_SIZE are not pooled. Get() runs on the loop
+//thread, Put() also on workers finishing a request.
+class BufferPool {
+public:
+    BufferPool(size_t max_free_bytes = 4 << 20);
+    ~BufferPool();
+    
+    //At least size bytes, the real capacity is stored in cap
+    char *Get(size_t size, size_t *cap);
+    void Put(char *buf, size_t cap);
+
+private:
+    BufferPool(const BufferPool &);
+    BufferPool &operator=(const BufferPool &);
+    
+    static int SizeClass(size_t size);
+    
+    pthread_mutex_t             mtx_;
+    
+    std::vector<char *>         free_[5];
+    size_t                      free_bytes_;
+    size_t                      max_free_bytes_;
+};
+
+//Receive buffer backed by a BufferPool. The length lives with the owner,
+//which passes it in wherever bytes have to be preserved.
+class ReadBuffer {
+public:
+    ReadBuffer();
+    ~ReadBuffer();
+    
+    char *Data() { return data_; }
+    size_t Capacity() { return cap_; }
+    
+    char &operator[](size_t i) { return data_[i]; }
+    
+    //Room for n more bytes behind the first len, moving them to a larger
+    //buffer from pool if needed
+    void Reserve(BufferPool *pool, size_t len, size_t n);
+    
+    //Drops n bytes at pos out of the first len
+    void Erase(size_t len, size_t pos, size_t n);
+    
+    void Release();
+    
+    void Swap(ReadBuffer &other);
+
+private:
+    ReadBuffer(const ReadBuffer &);
+    ReadBuffer &operator=(const ReadBuffer &);
+    
+    char         *data_;
+    size_t        cap_;
+    BufferPool   *pool_;
+};
+
+}//namespace mevent
+
+#endif
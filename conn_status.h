@@ -12,6 +12,18 @@ enum class ConnStatus : uint8_t {
     ERROR,
     CLOSE
 };
+
+//What happens to a WebSocket message that would take a connection's write
+//queue past its high watermark
+enum class WriteOverflowPolicy : uint8_t {
+    //The message is discarded
+    DROP,
+    //The connection is closed
+    DISCONNECT,
+    //Only the most recent such message is kept, and sent once the queue
+    //is back under the low watermark
+    COALESCE_LATEST
+};
     
 }//namespace mevent
 
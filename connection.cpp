@@ -2,35 +2,122 @@
 #include "util.h"
 #include "websocket.h"
 #include "event_loop.h"
+#include "lock_guard.h"
 
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
 #include <openssl/err.h>
 
+#include <algorithm>
+#include <new>
+
+//Read size bounds, ReadInto() doubles the size after a read that filled the
+//buffer and halves it after one that used less than a quarter
+#define READ_SIZE_MIN BUFFER_POOL_MIN_SIZE
+#define READ_SIZE_MAX BUFFER_POOL_MAX_SIZE
+
+//Plaintext bytes per SSL_write(), one full TLS record
+#define SSL_RECORD_SIZE static_cast<std::size_t>(16384)
+
 namespace mevent {
 
-Connection::Connection() : req_(this), resp_(this), ws_(this) {
+Connection::Connection() : req_(this), resp_(this) {
+    //The layout promised in connection.h. offsetof() on a class with virtual
+    //members is conditionally-supported, GCC and clang support it
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+    static_assert(offsetof(Connection, timer_slot_) + sizeof(timer_slot_) <= 2 * CACHE_LINE_SIZE,
+                  "hot fields past the second cache line");
+    static_assert(offsetof(Connection, posted_bytes_) % CACHE_LINE_SIZE == 0
+                  && offsetof(Connection, posted_bytes_) >= offsetof(Connection, timer_slot_) + sizeof(timer_slot_),
+                  "posted_bytes_ shares a cache line with the hot fields");
+    static_assert(offsetof(Connection, mtx_) % CACHE_LINE_SIZE == 0
+                  && offsetof(Connection, mtx_) >= offsetof(Connection, write_policy_) + sizeof(write_policy_),
+                  "mtx_ shares a cache line with the cross-thread fields");
+#pragma GCC diagnostic pop
+    
     fd_ = -1;
+    ws_ = NULL;
     
     active_time_ = 0;
+    requests_ = 0;
+    read_size_ = READ_SIZE_MIN;
     
     free_next_ = NULL;
-    active_next_ = NULL;
-    active_prev_ = NULL;
+    timer_next_ = NULL;
+    timer_prev_ = NULL;
+    timer_slot_ = -1;
     elp_ = NULL;
+    gen_.store(0, std::memory_order_relaxed);
     
     ev_writable_ = false;
+    closing_ = false;
     
     if (pthread_mutex_init(&mtx_, NULL) != 0) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
+    chain_bytes_.store(0, std::memory_order_relaxed);
+    posted_bytes_.store(0, std::memory_order_relaxed);
+    
+    write_low_watermark_ = 0;
+    write_high_watermark_ = 0;
+    write_policy_ = WriteOverflowPolicy::DROP;
+    write_full_.store(false, std::memory_order_relaxed);
+    
+    if (pthread_mutex_init(&write_full_mtx_, NULL) != 0) {
+        MEVENT_LOG_DEBUG_EXIT(NULL);
+    }
+    
     ssl_ = NULL;
+    ktls_send_ = false;
+    ktls_checked_ = false;
+    
+    zerocopy_ = false;
+    zerocopy_seq_ = 0;
+    
+    ring_io_ = false;
+    ring_sending_ = false;
+    ring_data_ = NULL;
+    ring_len_ = 0;
+    ring_eof_ = false;
+    ring_send_ = NULL;
 }
 
 Connection::~Connection() {
     if (pthread_mutex_destroy(&mtx_) != 0) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
+    
+    pthread_mutex_destroy(&write_full_mtx_);
+    
+    delete ws_;
+    delete ring_send_;
+}
+
+void *Connection::operator new(std::size_t size) {
+    void *p;
+    
+    if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0) {
+        throw std::bad_alloc();
+    }
+    
+    return p;
+}
+
+void Connection::operator delete(void *p) {
+    free(p);
 }
 
 ConnStatus Connection::Flush() {
@@ -38,20 +125,25 @@ ConnStatus Connection::Flush() {
         return ConnStatus::CLOSE;
     }
     
-    while (!write_buffer_chain_.empty()) {
-        auto wb = write_buffer_chain_.front();
-
-        ssize_t n = Writen(wb->str.c_str() + wb->write_len, wb->len - wb->write_len);
-        if (n >= 0) {
-            wb->write_len += n;
-            if (wb->write_len == wb->len) {
-                write_buffer_chain_.pop();
-            } else {
-                return ConnStatus::AGAIN;
-            }
-        } else {
-            return ConnStatus::ERROR;
-        }
+    //Continued by EventLoop::OnSent()
+    if (ring_sending_) {
+        return ConnStatus::AGAIN;
+    }
+    
+    if (!zerocopy_pending_.empty()) {
+        ReapZeroCopy();
+    }
+    
+    if (ssl_ && !ktls_checked_) {
+        CheckKtls();
+    }
+    
+    int ret = (ssl_ && !ktls_send_) ? FlushSSL() : FlushPlain();
+    
+    if (ret < 0) {
+        return ConnStatus::ERROR;
+    } else if (ret == 0) {
+        return ConnStatus::AGAIN;
     }
     
     if (req_.status_ == RequestStatus::UPGRADE) {
@@ -64,6 +156,358 @@ ConnStatus Connection::Flush() {
     
     return ConnStatus::AGAIN;
 }
+    
+//Headers and body normally leave in a single sendmsg(). In front of a file
+//segment MSG_MORE lets the headers share a packet with the file's first bytes.
+int Connection::FlushPlain() {
+    struct iovec iov[MAX_WRITE_IOV];
+    
+    while (!write_chain_.empty()) {
+        if (write_chain_.front().file_fd >= 0) {
+            int ret = SendFileSegment(write_chain_.front());
+            if (ret <= 0) {
+                return ret;
+            }
+            continue;
+        }
+        
+        if (ZeroCopySegment(write_chain_.front())) {
+            int ret = SendZeroCopySegment(write_chain_.front());
+            if (ret <= 0) {
+                return ret;
+            }
+            continue;
+        }
+        
+        int cnt = 0;
+        std::size_t total = 0;
+        bool more = false;
+        
+        for (auto it = write_chain_.begin(); it != write_chain_.end() && cnt < MAX_WRITE_IOV; it++, cnt++) {
+            if (it->file_fd >= 0 || ZeroCopySegment(*it)) {
+                more = true;
+                break;
+            }
+            
+            iov[cnt].iov_base = const_cast<char *>(it->Data() + it->offset);
+            iov[cnt].iov_len = it->len - it->offset;
+            total += iov[cnt].iov_len;
+        }
+        
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        
+        int flags = 0;
+#ifdef MSG_MORE
+        if (more) {
+            flags |= MSG_MORE;
+        }
+#endif
+        
+        //Goes out with the loop's next wait, together with the rest of the pass
+        if (ring_io_ && elp_->InLoopThread() && SendRing(iov, cnt, flags) == 0) {
+            return 0;
+        }
+        
+        ssize_t n = sendmsg(fd_, &msg, flags);
+        
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else {
+                return -1;
+            }
+        }
+        
+        ConsumeWriteChain(n);
+        
+        if (static_cast<std::size_t>(n) < total) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+    
+int Connection::SendRing(const struct iovec *iov, int cnt, int flags) {
+    if (!ring_send_) {
+        ring_send_ = new RingSend();
+        ring_send_->conn = this;
+        ring_send_->orphan = false;
+    }
+    
+    memcpy(ring_send_->iov, iov, cnt * sizeof(struct iovec));
+    
+    memset(&ring_send_->msg, 0, sizeof(ring_send_->msg));
+    ring_send_->msg.msg_iov = ring_send_->iov;
+    ring_send_->msg.msg_iovlen = cnt;
+    
+    if (elp_->Send(elp_->evfd_, fd_, &ring_send_->msg, flags, ring_send_) < 0) {
+        return -1;
+    }
+    
+    ring_sending_ = true;
+    
+    return 0;
+}
+    
+//1: segment written, 0: socket full, -1: error
+int Connection::SendFileSegment(WriteSegment &seg) {
+    while (seg.offset < seg.len) {
+        off_t off = seg.file_offset + seg.offset;
+        std::size_t want = seg.len - seg.offset;
+        ssize_t n;
+        
+#ifdef __linux__
+        n = sendfile(fd_, seg.file_fd, &off, want);
+#else
+        char buf[16384];
+        n = pread(seg.file_fd, buf, std::min(want, sizeof(buf)), off);
+        if (n > 0) {
+            n = write(fd_, buf, n);
+        } else if (n == 0) {
+            return -1;
+        }
+#endif
+        
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else {
+                return -1;
+            }
+        } else if (n == 0) {
+            //The file shrank under us, the promised Content-Length can't be kept
+            return -1;
+        }
+        
+        seg.offset += n;
+        chain_bytes_.fetch_sub(n, std::memory_order_relaxed);
+    }
+    
+    write_chain_.pop_front();
+    
+    return 1;
+}
+
+bool Connection::ZeroCopy(std::size_t len) {
+    return zerocopy_ && len >= elp_->zerocopy_threshold_ && req_.status_ != RequestStatus::UPGRADE;
+}
+    
+//Owned strings qualify too, SendZeroCopySegment() moves them behind keep
+bool Connection::ZeroCopySegment(const WriteSegment &seg) {
+    return seg.file_fd < 0 && (seg.keep || !seg.data) && ZeroCopy(seg.len - seg.offset);
+}
+    
+//1: segment written, 0: socket full, -1: error
+int Connection::SendZeroCopySegment(WriteSegment &seg) {
+#ifdef MSG_ZEROCOPY
+    if (!seg.data) {
+        std::shared_ptr<std::string> str = std::make_shared<std::string>(std::move(seg.str));
+        seg.data = str->data();
+        seg.keep = str;
+    }
+    
+    int flags = MSG_ZEROCOPY;
+    
+    while (seg.offset < seg.len) {
+        ssize_t n = send(fd_, seg.data + seg.offset, seg.len - seg.offset, flags);
+        
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == ENOBUFS && flags) {
+                //Out of notification memory (net.core.optmem_max), copy instead
+                flags = 0;
+                continue;
+            } else {
+                return -1;
+            }
+        }
+        
+        if (flags) {
+            zerocopy_pending_.push_back(std::make_pair(zerocopy_seq_++, seg.keep));
+        }
+        
+        seg.offset += n;
+        chain_bytes_.fetch_sub(n, std::memory_order_relaxed);
+    }
+    
+    write_chain_.pop_front();
+    
+    return 1;
+#else
+    (void)seg;//avoid unused parameter warning
+    return -1;
+#endif
+}
+    
+//Every completion covers a range of sends; TCP completes them in order,
+//so everything up to the range's end can be released
+void Connection::ReapZeroCopy() {
+    if (ReapZeroCopy(fd_, zerocopy_pending_)) {
+        zerocopy_ = false;
+    }
+}
+    
+bool Connection::ReapZeroCopy(int fd, ZeroCopyList &pending) {
+    bool copied = false;
+    
+#ifdef MSG_ZEROCOPY
+    while (!pending.empty()) {
+        char control[128];
+        
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            
+            struct sock_extended_err *serr = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cm));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            
+            //The kernel had to copy anyway, e.g. over loopback or a device
+            //without scatter-gather; stop paying for the notifications
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                copied = true;
+            }
+            
+            uint32_t hi = serr->ee_data;
+            
+            while (!pending.empty()
+                   && static_cast<int32_t>(pending.front().first - hi) <= 0) {
+                pending.pop_front();
+            }
+        }
+    }
+#else
+    (void)fd;//avoid unused parameter warning
+    (void)pending;//avoid unused parameter warning
+#endif
+    
+    return copied;
+}
+    
+const std::shared_ptr<const void> &Connection::KeepArena() {
+    if (!arena_keep_) {
+        arena_keep_ = arena_.Detach();
+    }
+    
+    return arena_keep_;
+}
+    
+//Segments are packed into records of up to SSL_RECORD_SIZE, so a response
+//costs one SSL_write() and one TLS record instead of one per segment
+int Connection::FlushSSL() {
+    for (;;) {
+        if (ssl_wbuf_.empty()) {
+            while (!write_chain_.empty() && ssl_wbuf_.length() < SSL_RECORD_SIZE) {
+                WriteSegment &seg = write_chain_.front();
+                
+                std::size_t n = std::min(seg.len - seg.offset, SSL_RECORD_SIZE - ssl_wbuf_.length());
+                
+                if (seg.file_fd >= 0) {
+                    std::size_t old_len = ssl_wbuf_.length();
+                    ssl_wbuf_.resize(old_len + n);
+                    
+                    ssize_t nread = pread(seg.file_fd, &ssl_wbuf_[old_len], n, seg.file_offset + seg.offset);
+                    if (nread <= 0) {
+                        return -1;
+                    }
+                    
+                    ssl_wbuf_.resize(old_len + nread);
+                    n = nread;
+                } else {
+                    ssl_wbuf_.append(seg.Data() + seg.offset, n);
+                }
+                
+                ConsumeWriteChain(n);
+            }
+            
+            if (ssl_wbuf_.empty()) {
+                return 1;
+            }
+        }
+        
+        int n = SSL_write(ssl_, ssl_wbuf_.data(), static_cast<int>(ssl_wbuf_.length()));
+        if (n > 0) {
+            ssl_wbuf_.clear();
+            continue;
+        }
+        
+        int sslerr = SSL_get_error(ssl_, n);
+        switch (sslerr) {
+            case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_WRITE:
+                return 0;
+            case SSL_ERROR_SYSCALL:
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                return -1;
+            default:
+                return -1;
+        }
+    }
+}
+    
+//Pipelining queues several responses before writing, so the segments
+//borrowed from the arena (no keep) are copied before it is rewound
+void Connection::DetachWriteChain() {
+    for (auto it = write_chain_.begin(); it != write_chain_.end(); it++) {
+        if (it->data && !it->keep) {
+            it->str.assign(it->data, it->len);
+            it->data = NULL;
+        }
+    }
+}
+    
+std::size_t Connection::PendingBytes() {
+    return ssl_wbuf_.length() + chain_bytes_.load(std::memory_order_relaxed);
+}
+    
+std::size_t Connection::QueuedBytes() {
+    return chain_bytes_.load(std::memory_order_relaxed) + posted_bytes_.load(std::memory_order_relaxed);
+}
+    
+void Connection::ConsumeWriteChain(std::size_t n) {
+    chain_bytes_.fetch_sub(n, std::memory_order_relaxed);
+    
+    while (n > 0 && !write_chain_.empty()) {
+        WriteSegment &seg = write_chain_.front();
+        std::size_t left = seg.len - seg.offset;
+        
+        if (n < left) {
+            seg.offset += n;
+            return;
+        }
+        
+        n -= left;
+        write_chain_.pop_front();
+    }
+}
 
 ConnStatus Connection::ReadData() {
     if (fd_ < 0) {
@@ -72,10 +516,14 @@ ConnStatus Connection::ReadData() {
     
     active_time_ = time(NULL);
     
+    if (!zerocopy_pending_.empty()) {
+        ReapZeroCopy();
+    }
+    
     ConnStatus status = ConnStatus::AGAIN;
     
     if (req_.status_ == RequestStatus::UPGRADE) {
-        status = ws_.ReadData();
+        status = ws_->ReadData();
     } else {
         status = req_.ReadData();
     }
@@ -83,14 +531,26 @@ ConnStatus Connection::ReadData() {
     return status;
 }
 
+bool Connection::CanKeepAlive() {
+    return req_.KeepAlive() && requests_ + 1 < elp_->max_keepalive_requests_;
+}
+
+//The write chain must not borrow from the arena anymore: it is either
+//empty or went through DetachWriteChain()
 void Connection::Keepalive() {
     if (fd_ < 0) {
         return;
     }
     
-    req_.Keepalive();
+    requests_++;
     
+    active_time_ = time(NULL);
+    
+    req_.Keepalive();
     resp_.Reset();
+    
+    arena_keep_.reset();
+    arena_.Reset();
 }
 
 void Connection::Close() {
@@ -102,6 +562,41 @@ void Connection::Reset() {
         SSL_free(ssl_);
         ssl_ = NULL;
     }
+    ktls_send_ = false;
+    ktls_checked_ = false;
+    
+    //Sends still in flight would report their completion to a closed
+    //socket. The loop takes the socket over, shut down like close(2) would,
+    //and keeps the memory until they did. ResetConnection() already took it
+    //out of the poller, so its events can't reach this Connection's next user
+    if (!zerocopy_pending_.empty()) {
+        ReapZeroCopy();
+    }
+    if (!zerocopy_pending_.empty() && fd_ > 0) {
+        shutdown(fd_, SHUT_WR);
+        elp_->LingerZeroCopy(fd_, zerocopy_pending_);
+        fd_ = -1;
+    }
+    zerocopy_pending_.clear();
+    zerocopy_ = false;
+    zerocopy_seq_ = 0;
+    
+    //A send in flight points into the write chain and the arena, it takes
+    //them along. The loop frees it all once the kernel let go of it
+    if (ring_sending_) {
+        ring_send_->orphan = true;
+        ring_send_->chain.swap(write_chain_);
+        ring_send_->arena[0] = arena_keep_;
+        ring_send_->arena[1] = arena_.Detach();
+        ring_send_ = NULL;
+        ring_sending_ = false;
+    }
+    
+    ring_io_ = false;
+    ring_data_ = NULL;
+    ring_len_ = 0;
+    std::string().swap(ring_spill_);
+    ring_eof_ = false;
     
     if (fd_ > 0) {
         close(fd_);
@@ -109,16 +604,33 @@ void Connection::Reset() {
     }
     
     active_time_ = 0;
+    requests_ = 0;
+    read_size_ = READ_SIZE_MIN;
     
-    elp_ = NULL;
+    gen_.fetch_add(1, std::memory_order_relaxed);
+    
+    //The write chain may borrow arena memory, release it first
+    write_chain_.clear();
+    chain_bytes_.store(0, std::memory_order_relaxed);
+    
+    {
+        LockGuard lock_guard(write_full_mtx_);
+        write_full_.store(false, std::memory_order_relaxed);
+        std::string().swap(coalesced_);
+    }
+    std::string().swap(ssl_wbuf_);
     
     req_.Reset();
     resp_.Reset();
-    ws_.Reset();
+    if (ws_) {
+        ws_->Reset();
+    }
     
-    write_buffer_chain_ = {};
+    arena_keep_.reset();
+    arena_.Reset();
     
     ev_writable_ = false;
+    closing_ = false;
 }
     
 void Connection::ShutdownSocket(int how) {
@@ -136,8 +648,21 @@ void Connection::WriteString(const std::string &str) {
         return;
     }
     
-    std::shared_ptr<WriteBuffer> wb = std::make_shared<WriteBuffer>(str);
-    write_buffer_chain_.push(wb);
+    write_chain_.emplace_back(std::string(str));
+    chain_bytes_.fetch_add(str.length(), std::memory_order_relaxed);
+}
+    
+void Connection::WriteString(std::string &&str) {
+    if (str.empty()) {
+        return;
+    }
+    
+    if (fd_ < 0) {
+        return;
+    }
+    
+    chain_bytes_.fetch_add(str.length(), std::memory_order_relaxed);
+    write_chain_.emplace_back(std::move(str));
 }
     
 void Connection::WriteData(const std::vector<uint8_t> &data) {
@@ -149,58 +674,46 @@ void Connection::WriteData(const std::vector<uint8_t> &data) {
         return;
     }
     
-    std::string str;
-    str.insert(str.end(), data.begin(), data.end());
+    write_chain_.emplace_back(std::string(data.begin(), data.end()));
+    chain_bytes_.fetch_add(data.size(), std::memory_order_relaxed);
+}
     
-    std::shared_ptr<WriteBuffer> wb = std::make_shared<WriteBuffer>(str);
-    write_buffer_chain_.push(wb);
+void Connection::WriteFile(int fd, off_t offset, std::size_t len, const std::shared_ptr<const void> &keep) {
+    if (len == 0) {
+        return;
+    }
+    
+    if (fd_ < 0) {
+        return;
+    }
+    
+    write_chain_.emplace_back(fd, offset, len, keep);
+    chain_bytes_.fetch_add(len, std::memory_order_relaxed);
 }
-
-ssize_t Connection::Writen(const void *buf, size_t len) {
-    ssize_t nwrite, n = 0;
     
-    while (n < (ssize_t)len) {
-        if (ssl_) {
-            nwrite = SSL_write(ssl_, (char *)buf + n, static_cast<int>(len));
-            if (nwrite <= 0) {
-                int sslerr = SSL_get_error(ssl_, static_cast<int>(nwrite));
-                switch (sslerr) {
-                    case SSL_ERROR_WANT_READ:
-                    case SSL_ERROR_WANT_WRITE:
-                    case SSL_ERROR_SSL:
-                        return n;
-                    case SSL_ERROR_SYSCALL:
-                        break;
-                    default:
-                        return -1;
-                }
-            }
-        } else {
-            nwrite = write(fd_, (char *)buf + n, len - n);
-        }
-
-        if (nwrite > 0) {
-            n += nwrite;
-        } else if (nwrite < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return n;
-            } else {
-                return -1;
-            }
-        } else {
-            return -1;
-        }
+void Connection::WriteBorrowed(const char *data, std::size_t len, const std::shared_ptr<const void> &keep) {
+    if (len == 0) {
+        return;
     }
     
-    return n;
+    if (fd_ < 0) {
+        return;
+    }
+    
+    write_chain_.emplace_back(data, len, keep);
+    chain_bytes_.fetch_add(len, std::memory_order_relaxed);
 }
     
 ssize_t Connection::Readn(void *buf, size_t len) {
     ssize_t nread, n = 0;
     
+    if (ring_io_) {
+        return ReadRing(static_cast<char *>(buf), len);
+    }
+    
     while (n < (ssize_t)len) {
         if (ssl_) {
-            nread = SSL_read(ssl_, (char *)buf + n, static_cast<int>(len));
+            nread = SSL_read(ssl_, (char *)buf + n, static_cast<int>(len - n));
             if (nread <= 0) {
                 int sslerr = SSL_get_error(ssl_, static_cast<int>(nread));
                 switch (sslerr) {
@@ -234,12 +747,222 @@ ssize_t Connection::Readn(void *buf, size_t len) {
     return n;
 }
     
+//Bytes held over from earlier completions come first
+ssize_t Connection::ReadRing(char *buf, size_t len) {
+    size_t n = 0;
+    
+    if (!ring_spill_.empty()) {
+        n = std::min(len, ring_spill_.length());
+        memcpy(buf, ring_spill_.data(), n);
+        ring_spill_.erase(0, n);
+    }
+    
+    if (n < len && ring_len_ > 0) {
+        size_t m = std::min(len - n, ring_len_);
+        memcpy(buf + n, ring_data_, m);
+        ring_data_ += m;
+        ring_len_ -= m;
+        n += m;
+    }
+    
+    if (n == 0 && ring_eof_) {
+        return -1;
+    }
+    
+    return n;
+}
+    
+bool Connection::Buffered() {
+    return (ssl_ && SSL_pending(ssl_) > 0) || ring_len_ > 0 || !ring_spill_.empty() || ring_eof_;
+}
+    
+ssize_t Connection::ReadInto(ReadBuffer &buf, size_t len, bool *drained) {
+    buf.Reserve(&elp_->buffer_pool_, len, read_size_);
+    
+    //Everything the buffer has room for, it is at least read_size_
+    size_t room = buf.Capacity() - len;
+    
+    ssize_t n = Readn(buf.Data() + len, room);
+    
+    if (n == static_cast<ssize_t>(room)) {
+        read_size_ = std::min(read_size_ * 2, static_cast<uint32_t>(READ_SIZE_MAX));
+        *drained = false;
+    } else {
+        if (n >= 0 && n < static_cast<ssize_t>(read_size_ / 4)) {
+            read_size_ = std::max(read_size_ / 2, static_cast<uint32_t>(READ_SIZE_MIN));
+        }
+        *drained = true;
+    }
+    
+    return n;
+}
+    
+ssize_t Connection::SpliceTo(int fd, off_t offset, size_t len) {
+#ifdef __linux__
+    int *pipefd = elp_->SplicePipe();
+    if (!pipefd) {
+        return -1;
+    }
+    
+    ssize_t n;
+    
+    do {
+        n = splice(fd_, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+    
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    } else if (n == 0) {
+        return -1;
+    }
+    
+    loff_t off = offset;
+    
+    for (ssize_t left = n; left > 0; ) {
+        ssize_t m = splice(pipefd[0], NULL, fd, &off, left, SPLICE_F_MOVE);
+        if (m <= 0) {
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            
+            //Whatever is left in the pipe belongs to nobody now
+            MEVENT_LOG_DEBUG(NULL);
+            elp_->CloseSplicePipe();
+            return -1;
+        }
+        
+        left -= m;
+    }
+    
+    return n;
+#else
+    (void)fd;//avoid unused parameter warning
+    (void)offset;//avoid unused parameter warning
+    (void)len;//avoid unused parameter warning
+    return -1;
+#endif
+}
+    
+bool Connection::PostWrite(std::string &&data, bool bounded) {
+    if (!elp_) {
+        return false;
+    }
+    
+    if (bounded && !AdmitWrite(data)) {
+        return false;
+    }
+    
+    posted_bytes_.fetch_add(data.length(), std::memory_order_relaxed);
+    
+    elp_->mailbox_.Post(MailboxItem(this, gen_.load(std::memory_order_relaxed), MailboxCmd::WRITE, std::move(data)));
+    
+    return true;
+}
+    
+//The fast path takes no lock: write_full_ only goes up under the lock here,
+//and a stale read merely sends a message down the locked path
+bool Connection::AdmitWrite(std::string &data) {
+    if (write_high_watermark_ == 0) {
+        return true;
+    }
+    
+    if (!write_full_.load(std::memory_order_acquire)
+        && QueuedBytes() + data.length() <= write_high_watermark_) {
+        return true;
+    }
+    
+    bool crossed = false;
+    
+    {
+        LockGuard lock_guard(write_full_mtx_);
+        
+        if (!write_full_.load(std::memory_order_relaxed)) {
+            if (QueuedBytes() + data.length() <= write_high_watermark_) {
+                return true;
+            }
+            
+            write_full_.store(true, std::memory_order_release);
+            crossed = true;
+        }
+        
+        if (write_policy_ == WriteOverflowPolicy::COALESCE_LATEST) {
+            coalesced_.swap(data);
+        }
+    }
+    
+    if (crossed) {
+        if (write_policy_ == WriteOverflowPolicy::DISCONNECT) {
+            MEVENT_LOG_DEBUG("client:%s write queue full", req_.RemoteAddr().c_str());
+            PostClose();
+        }
+        
+        if (ws_ && ws_->on_write_full_func_) {
+            ws_->on_write_full_func_(ws_);
+        }
+    }
+    
+    return false;
+}
+    
+bool Connection::WriteDrained() {
+    //DISCONNECT stays full until the close command arrives
+    if (!write_full_.load(std::memory_order_acquire) || write_policy_ == WriteOverflowPolicy::DISCONNECT) {
+        return false;
+    }
+    
+    if (QueuedBytes() > write_low_watermark_) {
+        return false;
+    }
+    
+    std::string latest;
+    
+    {
+        LockGuard lock_guard(write_full_mtx_);
+        write_full_.store(false, std::memory_order_release);
+        latest.swap(coalesced_);
+    }
+    
+    WriteString(std::move(latest));
+    
+    if (ws_ && ws_->on_write_drain_func_) {
+        ws_->on_write_drain_func_(ws_);
+    }
+    
+    return !write_chain_.empty();
+}
+    
+void Connection::SetWriteWatermarks(std::size_t low, std::size_t high, WriteOverflowPolicy policy) {
+    write_high_watermark_ = high;
+    write_low_watermark_ = low < high ? low : high / 2;
+    write_policy_ = policy;
+}
+    
+bool Connection::PostClose() {
+    if (!elp_) {
+        return false;
+    }
+    
+    elp_->mailbox_.Post(MailboxItem(this, gen_.load(std::memory_order_relaxed), MailboxCmd::CLOSE, std::string()));
+    
+    return true;
+}
+    
+bool Connection::PostRead() {
+    if (!elp_) {
+        return false;
+    }
+    
+    elp_->mailbox_.Post(MailboxItem(this, gen_.load(std::memory_order_relaxed), MailboxCmd::READ, std::string()));
+    
+    return true;
+}
+    
 void Connection::TaskPush() {
     elp_->TaskPush(this);
 }
     
 void Connection::WebSocketTaskPush(WebSocketOpcodeType opcode, const std::string &msg) {
-    elp_->WebSocketTaskPush(&ws_, opcode, msg);
+    elp_->WebSocketTaskPush(ws_, opcode, msg);
 }
     
 Request *Connection::Req() {
@@ -251,7 +974,11 @@ Response *Connection::Resp() {
 }
     
 WebSocket *Connection::WS() {
-    return &ws_;
+    if (!ws_) {
+        ws_ = new WebSocket(this);
+    }
+    
+    return ws_;
 }
     
 bool Connection::CreateSSL(SSL_CTX *ssl_ctx) {
@@ -271,4 +998,24 @@ bool Connection::CreateSSL(SSL_CTX *ssl_ctx) {
     return true;
 }
     
+//With SSL_OP_ENABLE_KTLS OpenSSL hands the session keys to the kernel once
+//the handshake is done, if the kernel and cipher support it. From then on
+//TLS records are ordinary writes, so responses take FlushPlain() with
+//sendmsg() and sendfile(2) instead of SSL_write(). Otherwise everything
+//keeps going through FlushSSL(). Reads stay on SSL_read(), which passes
+//kernel decrypted data through and still handles non-data records.
+void Connection::CheckKtls() {
+    if (!SSL_is_init_finished(ssl_) || !ssl_wbuf_.empty()) {
+        return;
+    }
+    
+    ktls_checked_ = true;
+    
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl_))) {
+        ktls_send_ = true;
+    }
+#endif
+}
+    
 }//namespace mevent
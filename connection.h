@@ -5,29 +5,76 @@
 #include "response.h"
 #include "websocket.h"
 #include "conn_status.h"
+#include "arena.h"
+#include "buffer_pool.h"
 
 #include <pthread.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <openssl/ssl.h>
 
 #include <vector>
-#include <queue>
+#include <deque>
 #include <string>
 #include <memory>
+#include <atomic>
+
+#define CACHE_LINE_SIZE 64
+
+//Segments handed to one sendmsg() call
+#define MAX_WRITE_IOV 64
 
 namespace mevent {
 
 class EventLoop;
 class ConnectionPool;
+class TimerWheel;
 
-struct WriteBuffer {
-    std::string str;
-    std::size_t len;
-    std::size_t write_len;
+//One piece of pending output. It either owns its bytes (str), borrows data,
+//or refers to a range of an open file (file_fd) that is sent with
+//sendfile(2). Borrowed memory and fds must stay valid until written; keep
+//can hold a reference that guarantees it.
+struct WriteSegment {
+    WriteSegment(std::string &&s)
+    : str(std::move(s)), data(NULL), len(str.length()), offset(0), file_fd(-1), file_offset(0) {}
+    
+    WriteSegment(const char *d, std::size_t l, const std::shared_ptr<const void> &k)
+    : data(d), len(l), offset(0), keep(k), file_fd(-1), file_offset(0) {}
+    
+    WriteSegment(int fd, off_t off, std::size_t l, const std::shared_ptr<const void> &k)
+    : data(NULL), len(l), offset(0), keep(k), file_fd(fd), file_offset(off) {}
+    
+    //str may move around with the deque, so never cache its data pointer
+    const char *Data() const { return data ? data : str.data(); }
     
-    WriteBuffer(const std::string &s) : str(s), len(s.length()), write_len(0) {}
-    ~WriteBuffer() {}
+    std::string                   str;
+    const char                   *data;
+    std::size_t                   len;
+    std::size_t                   offset;
+    std::shared_ptr<const void>   keep;
+    
+    int                           file_fd;
+    off_t                         file_offset;
+};
+
+//Memory referenced by MSG_ZEROCOPY sends, each entry tagged with the
+//send's number on its socket
+typedef std::deque<std::pair<uint32_t, std::shared_ptr<const void>>> ZeroCopyList;
+
+//A sendmsg(2) queued on the loop's io_uring, see Connection::SendRing().
+//Reset() leaves one still in flight to the loop, together with the memory
+//it points to, until the kernel reports it done
+struct RingSend {
+    Connection      *conn;
+    bool             orphan;
+    
+    struct msghdr    msg;
+    struct iovec     iov[MAX_WRITE_IOV];
+    
+    std::deque<WriteSegment>     chain;
+    std::shared_ptr<const void>  arena[2];
 };
 
 class Connection {
@@ -35,6 +82,9 @@ public:
     Connection();
     virtual ~Connection();
     
+    static void *operator new(std::size_t size);
+    static void operator delete(void *p);
+    
     void Close();
     
     Request *Req();
@@ -43,17 +93,94 @@ public:
     
 private:
     friend class ConnectionPool;
+    friend class TimerWheel;
     friend class EventLoop;
     friend class Request;
     friend class Response;
     friend class WebSocket;
     
     void WriteString(const std::string &str);
+    void WriteString(std::string &&str);
     void WriteData(const std::vector<uint8_t> &data);
     
-    ssize_t Writen(const void *buf, size_t len);
+    //Queues data without copying it, see WriteSegment
+    void WriteBorrowed(const char *data, std::size_t len, const std::shared_ptr<const void> &keep = nullptr);
+    void WriteFile(int fd, off_t offset, std::size_t len, const std::shared_ptr<const void> &keep);
+    
+    //Thread safe: hand the command to the owning loop, see Mailbox.
+    //bounded applies the write watermarks, see AdmitWrite()
+    bool PostWrite(std::string &&data, bool bounded = false);
+    bool PostClose();
+    bool PostRead();
+    
     ssize_t Readn(void *buf, size_t len);
     
+    //Readn() of ring_io_ connections: what the loop's io_uring received,
+    //see EventLoop::OnRecv()
+    ssize_t ReadRing(char *buf, size_t len);
+    
+    //Input already taken off the socket that no event will report: records
+    //OpenSSL holds, or bytes the loop's io_uring received
+    bool Buffered();
+    
+    //Reads straight into buf behind its first len bytes, taking memory from
+    //the loop's BufferPool. drained is set once the socket has nothing more.
+    //Same return values as Readn()
+    ssize_t ReadInto(ReadBuffer &buf, size_t len, bool *drained);
+    
+    //Moves up to len bytes from the socket to fd at offset without copying
+    //them through userspace. Loop thread only, plain TCP on Linux, see
+    //EventLoop::SplicePipe(). Same return values as Readn()
+    ssize_t SpliceTo(int fd, off_t offset, size_t len);
+    
+    //1: chain written out, 0: socket full, -1: error
+    int FlushPlain();
+    int FlushSSL();
+    
+    int SendFileSegment(WriteSegment &seg);
+    
+    //Queues iov on the loop's io_uring instead of writing it, loop thread
+    //only. 0 once queued, -1 if the ring did not take it
+    int SendRing(const struct iovec *iov, int cnt, int flags);
+    
+    //MSG_ZEROCOPY (Linux): segments of at least the loop's threshold whose
+    //memory the chain can keep alive are sent without the kernel copying
+    //them. The memory is held until the kernel reports the send complete
+    //on the socket's error queue, see ReapZeroCopy().
+    bool ZeroCopy(std::size_t len);
+    bool ZeroCopySegment(const WriteSegment &seg);
+    int SendZeroCopySegment(WriteSegment &seg);
+    void ReapZeroCopy();
+    
+    //Drops the entries of pending whose sends fd reports complete, true if
+    //the kernel copied the data anyway
+    static bool ReapZeroCopy(int fd, ZeroCopyList &pending);
+    
+    //Detaches the arena so memory handed to the write chain can outlive
+    //the request, see Response::Flush()
+    const std::shared_ptr<const void> &KeepArena();
+    
+    void ConsumeWriteChain(std::size_t n);
+    
+    std::size_t PendingBytes();
+    
+    //Pending bytes plus those still on their way through the mailbox, any thread
+    std::size_t QueuedBytes();
+    
+    //Watermark check for a WebSocket message about to be queued, see
+    //WriteOverflowPolicy. False if data must not be queued; COALESCE_LATEST
+    //may have taken it as the latest message then. Any thread.
+    bool AdmitWrite(std::string &data);
+    
+    //Once a full queue is back under the low watermark: queues the
+    //coalesced message and runs the drain handler. Called with mtx_ held
+    //after a flush, true if there is new output to flush
+    bool WriteDrained();
+    
+    void SetWriteWatermarks(std::size_t low, std::size_t high, WriteOverflowPolicy policy);
+    
+    void DetachWriteChain();
+    
     void TaskPush();
     
     void WebSocketTaskPush(WebSocketOpcodeType opcode, const std::string &msg);
@@ -62,6 +189,9 @@ private:
     
     ConnStatus ReadData();
     
+    //Whether the connection may stay open after the current response
+    bool CanKeepAlive();
+    
     void Keepalive();
     
     void Reset();
@@ -70,28 +200,116 @@ private:
     
     bool CreateSSL(SSL_CTX *ssl_ctx);
     
+    void CheckKtls();
+    
+    //Hot: what the loop touches on every event, within the first two cache
+    //lines (operator new aligns the object to CACHE_LINE_SIZE). Written by
+    //the loop, or by a worker holding mtx_. Checked in Connection()
+    
     int               fd_;
     
-    pthread_mutex_t   mtx_;
+    //Adapts to what the socket returns, see ReadInto()
+    uint32_t          read_size_;
     
-    std::queue<std::shared_ptr<WriteBuffer>> write_buffer_chain_;
+    bool              ev_writable_;
     
-    Request           req_;
-    Response          resp_;
-    WebSocket         ws_;
+    //Closed once the output queued so far is written, see
+    //EventLoop::OnMailbox()
+    bool              closing_;
     
-    Connection       *free_next_;
+    //The kernel encrypts outgoing records, see CheckKtls()
+    bool              ktls_send_;
+    bool              ktls_checked_;
     
-    Connection       *active_next_;
-    Connection       *active_prev_;
+    //SO_ZEROCOPY is on, set on accept
+    bool              zerocopy_;
     
+    //Plain TCP on a completion I/O loop: the io_uring receives, and sends
+    //what the loop thread flushes. Set on accept
+    bool              ring_io_;
+    
+    //ring_send_ is in flight, nothing else may write, see Flush()
+    bool              ring_sending_;
+    
+    uint32_t          zerocopy_seq_;
+    
+    //Set on the first accept and kept across Reset(), pools are per loop
     EventLoop        *elp_;
     
+    SSL              *ssl_;
+    
     time_t            active_time_;
     
-    bool              ev_writable_;
+    //Bumped on every Reset() so that mailbox commands posted for a previous
+    //client are dropped instead of reaching the next one
+    std::atomic<uint32_t>  gen_;
     
-    SSL              *ssl_;
+    //Responses completed on this connection, see CanKeepAlive()
+    int               requests_;
+    
+    //Bytes in write_chain_, readable from any thread
+    std::atomic<std::size_t>  chain_bytes_;
+    
+    //Owned by the event loop thread, see TimerWheel
+    Connection       *timer_next_;
+    Connection       *timer_prev_;
+    int               timer_slot_;
+    
+    //Written by threads posting to the connection, on lines of their own
+    
+    //Bytes in WRITE commands still in the mailbox. Never reset, commands for
+    //a previous client still drain it
+    alignas(CACHE_LINE_SIZE) std::atomic<std::size_t>  posted_bytes_;
+    
+    //Set from crossing the high watermark until the queue drained below the
+    //low one. Changes, and coalesced_, are guarded by write_full_mtx_
+    std::atomic<bool>    write_full_;
+    pthread_mutex_t      write_full_mtx_;
+    std::string          coalesced_;
+    
+    //High watermark 0: unbounded
+    std::size_t          write_low_watermark_;
+    std::size_t          write_high_watermark_;
+    WriteOverflowPolicy  write_policy_;
+    
+    //Cold: taken by workers as well as the loop, or per request and per
+    //protocol
+    
+    alignas(CACHE_LINE_SIZE) pthread_mutex_t  mtx_;
+    
+    std::deque<WriteSegment>  write_chain_;
+    
+    Connection       *free_next_;
+    
+    //Coalesced TLS record; while non-empty a partial SSL_write is pending and
+    //must be retried with exactly this buffer
+    std::string       ssl_wbuf_;
+    
+    ZeroCopyList      zerocopy_pending_;
+    
+    //The completion ReadRing() takes from, and what was received but not
+    //read yet, see EventLoop::OnRecv()
+    const char       *ring_data_;
+    std::size_t       ring_len_;
+    std::string       ring_spill_;
+    
+    //The io_uring reported end of file or an error, ReadRing() fails once
+    //the bytes before it are read
+    bool              ring_eof_;
+    
+    //Allocated by the first SendRing() and reused
+    RingSend         *ring_send_;
+    
+    //Per-request scratch memory, must be declared before req_/resp_
+    Arena             arena_;
+    std::shared_ptr<const void>  arena_keep_;
+    
+    Request           req_;
+    Response          resp_;
+    
+    //Created by the first WS() call and kept across Reset(), so pointers
+    //held by other threads stay valid as long as the connection object
+    WebSocket        *ws_;
 };
 
 }//namespace mevent
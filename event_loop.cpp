@@ -5,14 +5,45 @@
 #include <sys/types.h>
 #include <netinet/tcp.h>
 #include <errno.h>
+#include <time.h>
+#include <stdlib.h>
 
 #include <cstddef>
+#include <algorithm>
+#include <new>
 
 #define set_nonblock(fd) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK)
 
+//Keeps a reconnect storm from starving the connections already being served
+#define MAX_ACCEPTS_PER_POLL 64
+
+//Pipelined responses are queued up to this size before anything is written
+#define PIPELINE_MAX_PENDING 65536
+
+//How often a busy polling loop logs its spin/work split
+#define BUSY_POLL_REPORT_USECS 10000000
+
+//How long a closed connection's MSG_ZEROCOPY sends may take to complete
+//before the connection is reset
+#define ZEROCOPY_LINGER_SECS 30
+
+//How long a connection asked to close may take to drain its output
+#define CLOSE_TIMEOUT_SECS 10
+
+//Received bytes a connection may hold back before its io_uring recv is
+//paused, see OnRecv()
+#define RING_SPILL_MAX 65536
+
+static int64_t MonotonicUsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 namespace mevent {
 
-void HTTPHandler::SetHandleFunc(const std::string &path, HTTPHandleFunc func) {
+void HTTPHandler::SetHandleFunc(const std::string &path, HTTPHandleFunc func, bool run_in_loop,
+                                HTTPBodyFunc body_func) {
     if (path.empty()) {
         return;
     }
@@ -20,11 +51,22 @@ void HTTPHandler::SetHandleFunc(const std::string &path, HTTPHandleFunc func) {
     tst::NodeData data;
     data.str = path;
     data.func = func;
+    data.body_func = body_func;
+    data.run_in_loop = run_in_loop;
+    
+    tst::Node *np = NULL;
+    func_tree_.Insert(&data, &np);
+    
+    if (np && run_in_loop) {
+        loop_handlers_++;
+    }
     
-    func_tree_.Insert(&data, NULL);
+    if (np && body_func) {
+        body_handlers_++;
+    }
 }
 
-HTTPHandleFunc HTTPHandler::GetHandleFunc(const std::string &path) {
+HTTPHandleFunc HTTPHandler::GetHandleFunc(const std::string &path, bool *run_in_loop) {
     HTTPHandleFunc func = nullptr;
     
     if (path.empty()) {
@@ -35,10 +77,30 @@ HTTPHandleFunc HTTPHandler::GetHandleFunc(const std::string &path) {
 
     if (data.func) {
         func = data.func;
+        
+        if (run_in_loop) {
+            *run_in_loop = data.run_in_loop;
+        }
     }
     
     return func;
 }
+    
+HTTPBodyFunc HTTPHandler::GetBodyFunc(const std::string &path) {
+    if (path.empty()) {
+        return nullptr;
+    }
+    
+    return func_tree_.SearchOne(path.c_str()).body_func;
+}
+    
+bool HTTPHandler::HasLoopHandlers() {
+    return loop_handlers_ > 0;
+}
+    
+bool HTTPHandler::HasBodyHandlers() {
+    return body_handlers_ > 0;
+}
 
 
 //////////////////
@@ -47,27 +109,45 @@ EventLoop::EventLoop() {
     worker_threads_ = 1;
     max_worker_connections_ = 1024;
     idle_timeout_ = 30;
+    keepalive_timeout_ = 15;
+    max_keepalive_requests_ = 1000;
     max_post_size_ = 8192;
     max_header_size_ = 2048;
+    max_body_size_ = 1 << 30;
+    run_in_loop_ = false;
+    reuse_port_ = false;
+    accept_pending_ = false;
+    completion_io_ = false;
+    accept_retry_ = 0;
+    loop_running_ = false;
+    busy_poll_ = 0;
+    busy_poll_warned_ = false;
     
-    handler_ = nullptr;
-    ssl_ctx_ = NULL;
+    splice_pipe_[0] = -1;
+    splice_pipe_[1] = -1;
     
-    if (pthread_cond_init(&task_cond_, NULL) != 0) {
-        MEVENT_LOG_DEBUG_EXIT(NULL);
-    }
+    zerocopy_threshold_ = 0;
     
-    if (pthread_mutex_init(&task_cond_mtx_, NULL) != 0) {
-        MEVENT_LOG_DEBUG_EXIT(NULL);
-    }
+    write_low_watermark_ = 0;
+    write_high_watermark_ = 0;
+    write_overflow_policy_ = WriteOverflowPolicy::DROP;
+    zerocopy_lingering_.store(0, std::memory_order_relaxed);
     
-    if (pthread_cond_init(&ws_task_cond_, NULL) != 0) {
+    if (pthread_mutex_init(&zerocopy_linger_mtx_, NULL) != 0) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
-    if (pthread_mutex_init(&ws_task_cond_mtx_, NULL) != 0) {
-        MEVENT_LOG_DEBUG_EXIT(NULL);
-    }
+    handler_ = nullptr;
+    ssl_ctx_ = NULL;
+    
+    conn_pool_ = NULL;
+    timer_wheel_ = NULL;
+    task_que_ = NULL;
+    ws_task_que_ = NULL;
+}
+    
+bool EventLoop::InLoopThread() {
+    return loop_running_ && pthread_equal(pthread_self(), loop_thread_);
 }
     
 void EventLoop::SetHandler(mevent::HTTPHandler *handler) {
@@ -81,8 +161,27 @@ void EventLoop::SetSslCtx(SSL_CTX *ssl_ctx) {
 void EventLoop::Loop(int listen_fd) {
     listen_fd_ = listen_fd;
     
+    //Before any worker thread exists to ask
+    loop_thread_ = pthread_self();
+    loop_running_ = true;
+    
+    //Pin before allocating anything: worker threads created below inherit
+    //the mask, and pages are placed on the node of the thread touching them first
+    if (!cpus_.empty() && !util::SetThreadAffinity(pthread_self(), cpus_)) {
+        MEVENT_LOG_DEBUG("failed to set the event loop's CPU affinity");
+        cpus_.clear();
+    }
+    
     conn_pool_ = new ConnectionPool(max_worker_connections_);
-//    conn_pool_->Reserve(worker_connections_);
+    if (!cpus_.empty()) {
+        conn_pool_->Reserve(max_worker_connections_);
+    }
+    
+    timer_wheel_ = new TimerWheel(std::max(idle_timeout_, keepalive_timeout_) + 2, time(NULL));
+    
+    //A connection has at most one request in flight, so the HTTP ring never fills up
+    task_que_ = new TaskQueue<Connection *>(max_worker_connections_ + 1);
+    ws_task_que_ = new TaskQueue<std::shared_ptr<WebSocketTaskItem>>(max_worker_connections_ * 4);
     
     evfd_ = Create();
     
@@ -90,24 +189,37 @@ void EventLoop::Loop(int listen_fd) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
+    completion_io_ = CompletionIO();
+    
     if (set_nonblock(listen_fd) < 0) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
     listen_c_.fd_ = listen_fd_;
-    if (Add(evfd_, listen_fd, MEVENT_IN, &listen_c_) == -1) {
+    
+    //A listener shared by all loops wakes only one of them per connection
+    int listen_mask = MEVENT_IN;
+    if (!reuse_port_) {
+        listen_mask |= MEVENT_EXCLUSIVE;
+    }
+    if (completion_io_) {
+        listen_mask |= MEVENT_ACCEPT;
+    }
+    
+    if (Add(evfd_, listen_fd, listen_mask, &listen_c_) == -1) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, CheckConnectionTimeout, (void *)this) != 0) {
+    if (!mailbox_.Open()) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
-    if (pthread_detach(tid) != 0) {
+    mailbox_c_.fd_ = mailbox_.Fd();
+    if (Add(evfd_, mailbox_.Fd(), MEVENT_IN, &mailbox_c_) == -1) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
-
+    
+    pthread_t tid;
     
     for (int i = 0; i < worker_threads_; i++) {
         if (pthread_create(&tid, NULL, WorkerThread, (void *)this) != 0) {
@@ -131,18 +243,82 @@ void EventLoop::Loop(int listen_fd) {
     
     int nfds;
     Connection *conn;
+    struct timeval tv;
+    
+    //Connections the io_uring accepted, set up once the whole batch was
+    //dispatched: a pooled connection reset by an earlier event must not be
+    //handed to a new client while later events may still name it
+    std::vector<int> accepted_fds;
+    
+    //Busy poll bookkeeping, only touched when busy_poll_ > 0
+    int64_t last_work = 0;
+    int64_t spin_usecs = 0;
+    int64_t work_usecs = 0;
+    int64_t last_report = busy_poll_ > 0 ? MonotonicUsecs() : 0;
+    int64_t poll_start = 0;
+    int64_t poll_end = 0;
+    bool spin = false;
     
     while (1) {
-        nfds = Poll(evfd_, events_, 512, NULL);
+        //Wake up once a second to drive the timer wheel while it holds connections
+        //or zero-copy memory is lingering
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        
+        if (busy_poll_ > 0) {
+            poll_start = MonotonicUsecs();
+            spin = poll_start - last_work < busy_poll_;
+        }
+        
+        if (accept_pending_ || spin) {
+            tv.tv_sec = 0;
+        }
+        
+        bool timed = accept_pending_ || spin || !timer_wheel_->Empty() || accept_retry_ > 0
+                     || zerocopy_lingering_.load(std::memory_order_relaxed) > 0;
+        
+        nfds = Poll(evfd_, events_, 512, timed ? &tv : NULL);
+        
+        if (busy_poll_ > 0) {
+            poll_end = MonotonicUsecs();
+            
+            if (spin) {
+                spin_usecs += poll_end - poll_start;
+            }
+            
+            if (nfds == 0 && spin && !accept_pending_) {
+                continue;
+            }
+        }
+        
+        bool accepted = false;
         
         for (int n = 0; n < nfds; n++) {
+            if (events_[n].mask & MEVENT_SENT) {
+                OnSent((RingSend *)events_[n].data.ptr, events_[n].res);
+                continue;
+            }
+            
             conn = (Connection *)events_[n].data.ptr;
             
             if (conn->fd_ == listen_fd) {
-                Accept();
+                if (!(events_[n].mask & MEVENT_ACCEPT)) {
+                    Accept();
+                    accepted = true;
+                } else if (events_[n].res >= 0) {
+                    accepted_fds.push_back(events_[n].res);
+                } else {
+                    //Such as EMFILE, retried in a second instead of spinning on it
+                    errno = -events_[n].res;
+                    MEVENT_LOG_DEBUG(NULL);
+                    accept_retry_ = time(NULL) + 1;
+                }
+            } else if (conn == &mailbox_c_) {
+                OnMailbox();
+            } else if (events_[n].mask & MEVENT_RECV) {
+                LockGuard lock_guard(conn->mtx_);
+                OnRecv(conn, events_[n].buf, events_[n].res);
             } else if (events_[n].mask & MEVENT_IN) {
-                conn_pool_->ActiveListUpdate(conn);
-                
                 LockGuard lock_guard(conn->mtx_);
                 OnRead(conn);
             } else if (events_[n].mask & MEVENT_OUT) {
@@ -150,145 +326,390 @@ void EventLoop::Loop(int listen_fd) {
                 OnWrite(conn);
             }
         }
+        
+        if (accept_pending_ && !accepted) {
+            Accept();
+        }
+        
+        for (size_t i = 0; i < accepted_fds.size(); i++) {
+            NewConnection(accepted_fds[i], NULL);
+        }
+        accepted_fds.clear();
+        
+        //One wakeup round per poll batch instead of one signal per request
+        task_que_->Notify();
+        ws_task_que_->Notify();
+        
+        CheckTimeout();
+        
+        if (busy_poll_ > 0 && nfds > 0) {
+            last_work = MonotonicUsecs();
+            work_usecs += last_work - poll_end;
+            
+            if (last_work - last_report >= BUSY_POLL_REPORT_USECS) {
+                MEVENT_LOG_DEBUG("busy poll: spin %lldus, work %lldus in the last %llds",
+                                 (long long)spin_usecs, (long long)work_usecs,
+                                 (long long)((last_work - last_report) / 1000000));
+                spin_usecs = 0;
+                work_usecs = 0;
+                last_report = last_work;
+            }
+        }
     }
 }
 
 void EventLoop::Accept() {
     struct sockaddr_in cliaddr;
-    socklen_t clilen = sizeof(cliaddr);
+    socklen_t clilen;
     
-    for (;;) {
+    accept_pending_ = false;
+    
+    for (int i = 0; i < MAX_ACCEPTS_PER_POLL; i++) {
+        clilen = sizeof(cliaddr);
+        
+#ifdef __linux__
+        //TCP_NODELAY is inherited from the listening socket
+        int clifd = accept4(listen_fd_, (struct sockaddr *)&cliaddr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
         int clifd = accept(listen_fd_, (struct sockaddr *)&cliaddr, &clilen);
+#endif
         
         if (clifd < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                break;
+                return;
+            } else if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                //The backlog is not drained, no new edge comes for it.
+                //Retried in a second, see CheckTimeout()
+                MEVENT_LOG_DEBUG(NULL);
+                accept_retry_ = time(NULL) + 1;
+                return;
             } else {
                 MEVENT_LOG_DEBUG_EXIT(NULL);
                 return;
             }
         }
         
-        Connection *conn = conn_pool_->FreeListPop();
-        
-        if (!conn) {
-            MEVENT_LOG_DEBUG("worker connections reach max limit");
-            close(clifd);
+        //Out of connections, likewise
+        if (!NewConnection(clifd, &cliaddr)) {
+            accept_retry_ = time(NULL) + 1;
             return;
         }
-        
-        
+    }
+    
+    //Hit the cap with connections possibly left in the backlog. The listener is
+    //edge-triggered, so Loop() has to come back here by itself.
+    accept_pending_ = true;
+}
+
+bool EventLoop::NewConnection(int clifd, const struct sockaddr_in *cliaddr) {
+    if (busy_poll_ > 0) {
+        SetBusyPollSockopt(clifd);
+    }
+    
+#ifndef __linux__
+    if (set_nonblock(clifd) < 0) {
+        MEVENT_LOG_DEBUG(NULL);
+        close(clifd);
+        return true;
+    }
+    
+    int enable = 1;
+    if (setsockopt(clifd, IPPROTO_TCP, TCP_NODELAY, (void*)&enable, sizeof(enable)) < 0) {
+        MEVENT_LOG_DEBUG(NULL);
+        close(clifd);
+        return true;
+    }
+#endif
+    
+    Connection *conn = conn_pool_->FreeListPop();
+    
+    if (!conn) {
+        MEVENT_LOG_DEBUG("worker connections reach max limit");
+        close(clifd);
+        return false;
+    }
+    
+    time_t now = time(NULL);
+    
+    timer_wheel_->Add(conn, now + std::min(idle_timeout_, keepalive_timeout_));
+    
+    bool status = true;
+    int mask = MEVENT_IN;
+    
+    {
         LockGuard lock_guard(conn->mtx_);
         
-        conn->active_time_ = time(NULL);
+        conn->active_time_ = now;
         conn->fd_ = clifd;
         conn->elp_ = this;
         
-        Request *req = conn->Req();
-        req->addr_ = cliaddr.sin_addr;
-        
-        bool status = true;
+        //Otherwise looked up by Request::RemoteAddr() when asked for
+        if (cliaddr) {
+            conn->Req()->addr_ = cliaddr->sin_addr;
+        }
         
-        do {
-            if (set_nonblock(clifd) < 0) {
-                MEVENT_LOG_DEBUG(NULL);
-                status = false;
-                break;
+        if (ssl_ctx_) {
+            status = conn->CreateSSL(ssl_ctx_);
+        } else {
+            if (zerocopy_threshold_ > 0) {
+                conn->zerocopy_ = SetZeroCopySockopt(clifd);
             }
             
-            int enable = 1;
-            if (setsockopt(clifd, IPPROTO_TCP, TCP_NODELAY, (void*)&enable, sizeof(enable)) < 0) {
-                MEVENT_LOG_DEBUG(NULL);
-                status = false;
-                break;
+            //OpenSSL reads the socket by itself, TLS stays readiness based
+            if (completion_io_) {
+                conn->ring_io_ = true;
+                mask |= MEVENT_RECV;
             }
-            
-            if (Add(evfd_, clifd, MEVENT_IN, conn) == -1) {
-                MEVENT_LOG_DEBUG(NULL);
-                status = false;
-                break;
+        }
+        
+        conn->SetWriteWatermarks(write_low_watermark_, write_high_watermark_, write_overflow_policy_);
+    }
+    
+    //Events for conn are only dispatched on this thread, so it can be
+    //registered outside the lock
+    if (status && Add(evfd_, clifd, mask, conn) == -1) {
+        MEVENT_LOG_DEBUG(NULL);
+        status = false;
+    }
+
+    if (!status) {
+        LockGuard lock_guard(conn->mtx_);
+        conn->Reset();
+        conn_pool_->FreeListPush(conn);
+        return true;
+    }
+    
+    OnAccept(conn);
+    
+    return true;
+}
+
+void EventLoop::OnMailbox() {
+    mailbox_.Drain(mailbox_items_);
+    
+    for (size_t i = 0; i < mailbox_items_.size(); i++) {
+        MailboxItem &item = mailbox_items_[i];
+        Connection *conn = item.conn;
+        
+        LockGuard lock_guard(conn->mtx_);
+        
+        //Counted by PostWrite() whether or not the command still applies
+        if (item.cmd == MailboxCmd::WRITE) {
+            conn->posted_bytes_.fetch_sub(item.data.length(), std::memory_order_relaxed);
+        }
+        
+        if (conn->fd_ < 0 || conn->gen_.load(std::memory_order_relaxed) != item.gen || conn->closing_) {
+            continue;
+        }
+        
+        if (item.cmd == MailboxCmd::CLOSE) {
+            //What was queued before, such as a close frame, goes out first and
+            //FlushDone() resets the connection once it is written. A queue
+            //over its high watermark is not waited for.
+            if (conn->write_full_.load(std::memory_order_relaxed)) {
+                ResetConnection(conn);
+                continue;
             }
             
-            if (ssl_ctx_) {
-                if (!conn->CreateSSL(ssl_ctx_)) {
-                    status = false;
-                    break;
-                }
+            conn->closing_ = true;
+            conn->active_time_ = time(NULL);
+            timer_wheel_->Add(conn, conn->active_time_ + CLOSE_TIMEOUT_SECS);
+            
+            //Input is of no interest anymore
+            conn->ev_writable_ = true;
+            Modify(evfd_, conn->fd_, MEVENT_OUT, conn);
+            
+            FlushDone(conn, conn->Flush());
+            continue;
+        } else if (item.cmd == MailboxCmd::READ) {
+            //Either a pipelined request is already complete, or OpenSSL holds
+            //bytes the poller can't see
+            if (conn->Req()->status_ == RequestStatus::BODY_RECEIVED) {
+                TaskPush(conn);
+            } else {
+                OnRead(conn);
             }
-        } while (0);
-
-        if (!status) {
-            conn->Reset();
-            conn_pool_->FreeListPush(conn);
             continue;
         }
         
-        conn_pool_->ActiveListPush(conn);
+        conn->WriteString(std::move(item.data));
         
-        OnAccept(conn);
+        //Broadcasts queue many frames per connection, write them out in one go
+        if (i + 1 < mailbox_items_.size() && mailbox_items_[i + 1].conn == conn) {
+            continue;
+        }
+        
+        FlushDone(conn, conn->Flush());
     }
+    
+    mailbox_items_.clear();
 }
 
-void *EventLoop::CheckConnectionTimeout(void *arg) {
-    EventLoop *elp = (EventLoop *)arg;
+//Best effort: raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN,
+//the loop still spins in userspace without it
+void EventLoop::SetBusyPollSockopt(int fd) {
+#ifdef SO_BUSY_POLL
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_, sizeof(busy_poll_)) < 0 && !busy_poll_warned_) {
+        busy_poll_warned_ = true;
+        MEVENT_LOG_DEBUG(NULL);
+    }
     
-    for (;;) {
-        int64_t now = time(NULL);
-        
-        elp->conn_pool_->ActiveListTimeoutCheck();
+#ifdef SO_PREFER_BUSY_POLL
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable));
+#endif
+#else
+    (void)fd;//avoid unused parameter warning
+#endif
+}
+
+//Plain TCP only: TLS records are built in userspace or, with kTLS, by the
+//kernel, neither of which takes MSG_ZEROCOPY
+bool EventLoop::SetZeroCopySockopt(int fd) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    int enable = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+#else
+    (void)fd;//avoid unused parameter warning
+    return false;
+#endif
+}
+
+//The kernel sends what is queued after shutdown(2), normally within moments
+void EventLoop::LingerZeroCopy(int fd, ZeroCopyList &pending) {
+    LockGuard lock_guard(zerocopy_linger_mtx_);
+    
+    zerocopy_linger_.push_back(ZeroCopyLinger());
+    
+    ZeroCopyLinger &entry = zerocopy_linger_.back();
+    entry.fd = fd;
+    entry.expire = time(NULL) + ZEROCOPY_LINGER_SECS;
+    entry.pending.swap(pending);
+    
+    zerocopy_lingering_.store(zerocopy_linger_.size(), std::memory_order_relaxed);
+}
+
+int *EventLoop::SplicePipe() {
+#ifdef __linux__
+    if (splice_pipe_[0] < 0 && pipe2(splice_pipe_, O_CLOEXEC) < 0) {
+        MEVENT_LOG_DEBUG(NULL);
+        splice_pipe_[0] = splice_pipe_[1] = -1;
+        return NULL;
+    }
+    
+    return splice_pipe_;
+#else
+    return NULL;
+#endif
+}
+    
+void EventLoop::CloseSplicePipe() {
+    if (splice_pipe_[0] >= 0) {
+        close(splice_pipe_[0]);
+        close(splice_pipe_[1]);
+        splice_pipe_[0] = splice_pipe_[1] = -1;
+    }
+}
+
+//Connections are never unlinked eagerly: reads only bump active_time_, and
+//closed or recycled connections are dropped (or re-added by Accept) here.
+//A connection may go idle between requests at any time, on a worker thread
+//that can't touch the wheel, so none is left in it for longer than
+//keepalive_timeout_.
+void EventLoop::CheckTimeout() {
+    time_t now = time(NULL);
+    
+    //The multishot accept is armed again. An edge-triggered (and possibly
+    //exclusive, which EPOLL_CTL_MOD refuses) listener is simply read again
+    if (accept_retry_ > 0 && accept_retry_ <= now) {
+        accept_retry_ = 0;
         
-        Connection *conn = elp->conn_pool_->ActiveListCheckNext();
+        if (completion_io_) {
+            Modify(evfd_, listen_fd_, MEVENT_IN, &listen_c_);
+        } else {
+            Accept();
+        }
+    }
+    
+    if (zerocopy_lingering_.load(std::memory_order_relaxed) > 0) {
+        LockGuard lock_guard(zerocopy_linger_mtx_);
         
-        if (conn) {
-            time_t active_time = 0;
-            {
-                LockGuard lock_guard(conn->mtx_);
-                active_time = conn->active_time_;
-            }
-            if (active_time > 0 && now - active_time < elp->idle_timeout_) {
-                sleep(static_cast<int>(elp->idle_timeout_ - (now - active_time)));
+        for (size_t i = 0; i < zerocopy_linger_.size();) {
+            ZeroCopyLinger &entry = zerocopy_linger_[i];
+            
+            Connection::ReapZeroCopy(entry.fd, entry.pending);
+            
+            if (!entry.pending.empty() && entry.expire > now) {
+                i++;
                 continue;
             }
-        } else {
-            if (elp->conn_pool_->ActiveListEmpty()) {
-                sleep(elp->idle_timeout_);
+            
+            //The peer stopped taking data. A reset drops the send queue, and
+            //with it the kernel's references to the memory.
+            if (!entry.pending.empty()) {
+                struct linger lg;
+                lg.l_onoff = 1;
+                lg.l_linger = 0;
+                setsockopt(entry.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
             }
-            continue;
+            
+            close(entry.fd);
+            
+            std::swap(entry, zerocopy_linger_.back());
+            zerocopy_linger_.pop_back();
         }
         
-        while (conn) {
-            {
-                LockGuard lock_guard(conn->mtx_);
-
-                if (conn->active_time_ > 0) {
-                    if ((now - conn->active_time_) >= elp->idle_timeout_) {
-                        if (conn->Req()->status_ == RequestStatus::UPGRADE) {
-                            MEVENT_LOG_DEBUG("client(websocket):%s timeout", conn->Req()->RemoteAddr().c_str());
-                        } else {
-                            MEVENT_LOG_DEBUG("client:%s timeout", conn->Req()->RemoteAddr().c_str());
-                        }
-                        elp->ResetConnection(conn);
+        zerocopy_lingering_.store(zerocopy_linger_.size(), std::memory_order_relaxed);
+    }
+    
+    Connection *conn = timer_wheel_->Expire(now);
+    
+    while (conn) {
+        Connection *next = conn->timer_next_;
+        
+        {
+            LockGuard lock_guard(conn->mtx_);
+            
+            if (conn->fd_ >= 0 && conn->active_time_ > 0) {
+                Request *req = conn->Req();
+                
+                bool idle = conn->requests_ > 0
+                            && req->status_ == RequestStatus::HEADER_RECEIVING
+                            && req->rbuf_len_ == 0;
+                
+                time_t expire = conn->active_time_ + (idle ? keepalive_timeout_ : idle_timeout_);
+                if (conn->closing_) {
+                    expire = conn->active_time_ + CLOSE_TIMEOUT_SECS;
+                }
+                
+                if (expire <= now) {
+                    if (conn->Req()->status_ == RequestStatus::UPGRADE) {
+                        MEVENT_LOG_DEBUG("client(websocket):%s timeout", conn->Req()->RemoteAddr().c_str());
                     } else {
-                        break;
+                        MEVENT_LOG_DEBUG("client:%s timeout", conn->Req()->RemoteAddr().c_str());
                     }
+                    ResetConnection(conn);
+                } else {
+                    timer_wheel_->Add(conn, std::min(expire, now + keepalive_timeout_));
                 }
             }
-            
-            conn = elp->conn_pool_->ActiveListCheckNext();
         }
+        
+        conn = next;
     }
-    
-    return (void *)0;
 }
 
 void EventLoop::ResetConnection(Connection *conn) {
     if (conn->fd_ > 0) {
         OnClose(conn);
         
+        Delete(evfd_, conn->fd_);
+        
         conn->Reset();
         
         conn_pool_->FreeListPush(conn);
-        conn_pool_->ActiveListErase(conn);
     }
 }
 
@@ -300,6 +721,23 @@ void EventLoop::SetIdleTimeout(int secs) {
     idle_timeout_ = secs;
 }
 
+void EventLoop::SetKeepaliveTimeout(int secs) {
+    if (secs < 1) {
+        return;
+    }
+    
+    keepalive_timeout_ = secs;
+}
+
+//0 turns keep-alive off
+void EventLoop::SetMaxKeepaliveRequests(int num) {
+    if (num < 0) {
+        return;
+    }
+    
+    max_keepalive_requests_ = num;
+}
+
 void EventLoop::SetMaxWorkerConnections(int num) {
     if (num < 1) {
         return;
@@ -315,6 +753,41 @@ void EventLoop::SetMaxPostSize(size_t size) {
 void EventLoop::SetMaxHeaderSize(size_t size) {
     max_header_size_ = size;
 }
+    
+void EventLoop::SetMaxBodySize(size_t size) {
+    max_body_size_ = size;
+}
+    
+void EventLoop::SetBodyTempDir(const std::string &dir) {
+    body_temp_dir_ = dir;
+}
+    
+void EventLoop::SetRunInLoop(bool enable) {
+    run_in_loop_ = enable;
+}
+
+void EventLoop::SetReusePort(bool enable) {
+    reuse_port_ = enable;
+}
+
+void EventLoop::SetBusyPoll(int usecs) {
+    busy_poll_ = usecs < 0 ? 0 : usecs;
+}
+
+void EventLoop::SetWriteWatermarks(size_t low, size_t high, WriteOverflowPolicy policy) {
+    write_low_watermark_ = low;
+    write_high_watermark_ = high;
+    write_overflow_policy_ = policy;
+}
+
+//Bytes a single write segment needs to be sent with MSG_ZEROCOPY, 0 turns it off
+void EventLoop::SetZeroCopyThreshold(size_t size) {
+    zerocopy_threshold_ = size;
+}
+
+void EventLoop::SetCpuSet(const std::vector<int> &cpus) {
+    cpus_ = cpus;
+}
 
 void EventLoop::OnAccept(Connection *conn) {
     (void)conn;//avoid unused parameter warning
@@ -322,13 +795,19 @@ void EventLoop::OnAccept(Connection *conn) {
 }
 
 void EventLoop::OnRead(Connection *conn) {
+    //Left over from before OnMailbox() dropped MEVENT_IN
+    if (conn->closing_) {
+        OnWrite(conn);
+        return;
+    }
+    
     ConnStatus status = conn->ReadData();
     
-    if (status == ConnStatus::ERROR) {
-        if (conn->Req()->error_code_ != 0) {
-            conn->Resp()->WriteErrorMessage(conn->Req()->error_code_);
-            status = conn->Flush();
-        }
+    //The error page says Connection: close, FlushDone() closes once it is out
+    if (status == ConnStatus::ERROR && conn->Req()->error_code_ != 0) {
+        conn->Resp()->WriteErrorMessage(conn->Req()->error_code_);
+        FlushDone(conn, conn->Flush());
+        return;
     }
     
     if (status != ConnStatus::AGAIN) {
@@ -337,10 +816,61 @@ void EventLoop::OnRead(Connection *conn) {
 }
 
 void EventLoop::OnWrite(Connection *conn) {
-    ConnStatus status = conn->Flush();
-    if (status != ConnStatus::AGAIN) {
-        ResetConnection(conn);
+    FlushDone(conn, conn->Flush());
+}
+
+//Whatever OnRead() leaves of the completion, e.g. the next request while a
+//handler still runs, is kept for KeepAlive() to pick up
+void EventLoop::OnRecv(Connection *conn, const char *data, int res) {
+    //Reset by an earlier event of the same batch
+    if (conn->fd_ < 0) {
+        return;
+    }
+    
+    if (res > 0) {
+        conn->ring_data_ = data;
+        conn->ring_len_ = res;
+    } else {
+        conn->ring_eof_ = true;
+    }
+    
+    OnRead(conn);
+    
+    if (conn->fd_ >= 0 && conn->ring_len_ > 0) {
+        conn->ring_spill_.append(conn->ring_data_, conn->ring_len_);
+        
+        //Until KeepAlive() re-arms it. Like a socket nobody reads, the
+        //peer's window closes
+        if (conn->ring_spill_.length() > RING_SPILL_MAX) {
+            Modify(evfd_, conn->fd_, conn->ev_writable_ ? MEVENT_OUT : 0, conn);
+        }
+    }
+    
+    conn->ring_data_ = NULL;
+    conn->ring_len_ = 0;
+}
+
+void EventLoop::OnSent(RingSend *rs, int res) {
+    //The connection was reset meanwhile
+    if (rs->orphan) {
+        delete rs;
+        return;
     }
+    
+    Connection *conn = rs->conn;
+    
+    LockGuard lock_guard(conn->mtx_);
+    
+    conn->ring_sending_ = false;
+    
+    if (res < 0) {
+        FlushDone(conn, ConnStatus::ERROR);
+        return;
+    }
+    
+    conn->ConsumeWriteChain(res);
+    
+    FlushDone(conn, conn->Flush());
 }
 
 void EventLoop::OnClose(Connection *conn) {
@@ -355,17 +885,7 @@ void *EventLoop::WorkerThread(void *arg) {
     for (;;) {
         Connection *conn;
         
-        {
-            LockGuard lock_guard(elp->task_cond_mtx_);
-            
-            if (elp->task_que_.empty()) {
-                pthread_cond_wait(&elp->task_cond_, &elp->task_cond_mtx_);
-                continue;
-            }
-            
-            conn = elp->task_que_.front();
-            elp->task_que_.pop();
-        }
+        elp->task_que_->Pop(conn);
         
         {
             LockGuard lock_guard(conn->mtx_);
@@ -374,53 +894,150 @@ void *EventLoop::WorkerThread(void *arg) {
                 continue;
             }
             
-            Request *req = conn->Req();
-            Response *resp = conn->Resp();
-            
-            HTTPHandleFunc func;
-            if ((func = elp->handler_->GetHandleFunc(req->path_))) {
-                func(conn);
-            } else {
-                resp->WriteErrorMessage(404);
-            }
-            
-            if (req->status_ != RequestStatus::UPGRADE) {
-                resp->Flush();
-            }
-            
-            ConnStatus status = conn->Flush();
-
-            if (status == ConnStatus::AGAIN) {
-                if (!conn->ev_writable_) {
-                    elp->Modify(elp->evfd_, conn->fd_, MEVENT_IN | MEVENT_OUT, conn);
-                    conn->ev_writable_ = true;
-                }
-            } else if (status != ConnStatus::UPGRADE) {
-                elp->ResetConnection(conn);
-            }
+            elp->HandleRequest(conn, elp->handler_->GetHandleFunc(conn->Req()->path_), false);
         }
     }
     
     return (void *)0;
 }
     
+//Called with conn->mtx_ held, either on a worker thread or inline on the
+//loop thread (in_loop). Requests of one connection are handled one at a
+//time, so responses always leave in request order.
+void EventLoop::HandleRequest(Connection *conn, HTTPHandleFunc func, bool in_loop) {
+    Request *req = conn->Req();
+    Response *resp = conn->Resp();
+    
+    for (;;) {
+        if (func) {
+            func(conn);
+        } else {
+            resp->WriteErrorMessage(404);
+        }
+        
+        if (req->status_ == RequestStatus::UPGRADE) {
+            break;
+        }
+        
+        resp->Flush();
+        
+        //Handlers that must not run on the loop thread go through the task
+        //queue, see KeepAlive()
+        if ((in_loop && !run_in_loop_) || !Pipeline(conn)) {
+            break;
+        }
+        
+        func = handler_->GetHandleFunc(req->path_);
+    }
+    
+    FlushDone(conn, conn->Flush());
+}
+    
+//Pipelining: requests already read behind the current one are answered
+//before anything is written, so their responses share a single writev
+bool EventLoop::Pipeline(Connection *conn) {
+    Request *req = conn->Req();
+    Response *resp = conn->Resp();
+    
+    if (!resp->keep_alive_ || !req->Pipelined() || conn->PendingBytes() > PIPELINE_MAX_PENDING) {
+        return false;
+    }
+    
+    conn->DetachWriteChain();
+    conn->Keepalive();
+    
+    //Re-armed by FlushDone(), reading on once the rest of the next request arrives
+    conn->ev_writable_ = false;
+    
+    if (req->Advance() == ConnStatus::ERROR) {
+        resp->WriteErrorMessage(req->error_code_);
+        return false;
+    }
+    
+    if (req->status_ != RequestStatus::BODY_RECEIVED) {
+        //The rest may already have been read off the socket, see KeepAlive()
+        if (conn->Buffered()) {
+            conn->PostRead();
+        }
+        return false;
+    }
+    
+    return true;
+}
+
+void EventLoop::FlushDone(Connection *conn, ConnStatus status) {
+    //Only the output left is written, see OnMailbox()
+    if (conn->closing_) {
+        if (status != ConnStatus::AGAIN) {
+            ResetConnection(conn);
+        }
+        return;
+    }
+    
+    if ((status == ConnStatus::AGAIN || status == ConnStatus::UPGRADE) && conn->WriteDrained()) {
+        status = conn->Flush();
+    }
+    
+    if (status == ConnStatus::AGAIN) {
+        //A send on the io_uring reports back by itself, see OnSent()
+        if (!conn->ev_writable_ && !conn->ring_sending_) {
+            Modify(evfd_, conn->fd_, MEVENT_IN | MEVENT_OUT, conn);
+            conn->ev_writable_ = true;
+        }
+    } else if (status == ConnStatus::END && KeepAlive(conn)) {
+        return;
+    } else if (status == ConnStatus::UPGRADE) {
+        //A WebSocket that caught up with its output
+        if (conn->ev_writable_) {
+            Modify(evfd_, conn->fd_, MEVENT_IN, conn);
+            conn->ev_writable_ = false;
+        }
+    } else {
+        ResetConnection(conn);
+    }
+}
+    
+bool EventLoop::KeepAlive(Connection *conn) {
+    if (!conn->Resp()->keep_alive_) {
+        return false;
+    }
+    
+    conn->Keepalive();
+    
+    //Also drops MEVENT_OUT. Like EPOLL_CTL_MOD, re-arming reports the fd at
+    //once if the next request already arrived while this one was handled.
+    conn->ev_writable_ = false;
+    if (Modify(evfd_, conn->fd_, MEVENT_IN, conn) == -1) {
+        MEVENT_LOG_DEBUG(NULL);
+        return false;
+    }
+    
+    Request *req = conn->Req();
+    
+    //Closed by FlushDone() once the error page is out
+    if (req->Advance() == ConnStatus::ERROR) {
+        conn->Resp()->WriteErrorMessage(req->error_code_);
+        FlushDone(conn, conn->Flush());
+        return true;
+    }
+    
+    //A complete pipelined request is dispatched from the loop thread. Bytes
+    //OpenSSL or the io_uring already read from the socket never make it
+    //readable again.
+    if (req->status_ == RequestStatus::BODY_RECEIVED || conn->Buffered()) {
+        conn->PostRead();
+    }
+    
+    return true;
+}
+    
 void *EventLoop::WebSocketWorkerThread(void *arg) {
     EventLoop *elp = (EventLoop *)arg;
     
     for (;;) {
         std::shared_ptr<WebSocketTaskItem> item;
         
-        {
-            LockGuard lock_guard(elp->ws_task_cond_mtx_);
-            
-            if (elp->ws_task_que_.empty()) {
-                pthread_cond_wait(&elp->ws_task_cond_, &elp->ws_task_cond_mtx_);
-                continue;
-            }
-            
-            item = elp->ws_task_que_.front();
-            elp->ws_task_que_.pop();
-        }
+        elp->ws_task_que_->Pop(item);
         
         {
             LockGuard lock_guard(item->ws->Conn()->mtx_);
@@ -449,16 +1066,7 @@ void *EventLoop::WebSocketWorkerThread(void *arg) {
                 }
             }
             
-            ConnStatus status = item->ws->Conn()->Flush();
-
-            if (status == ConnStatus::AGAIN) {
-                if (!item->ws->Conn()->ev_writable_) {
-                    elp->Modify(elp->evfd_, item->ws->Conn()->fd_, MEVENT_IN | MEVENT_OUT, item->ws->Conn());
-                    item->ws->Conn()->ev_writable_ = true;
-                }
-            } else if (status != ConnStatus::UPGRADE) {
-                elp->ResetConnection(item->ws->Conn());
-            }
+            elp->FlushDone(item->ws->Conn(), item->ws->Conn()->Flush());
         }
     }
     
@@ -466,20 +1074,54 @@ void *EventLoop::WebSocketWorkerThread(void *arg) {
 }
 
 void EventLoop::TaskPush(Connection *conn) {
-    LockGuard cond_lock_guard(task_cond_mtx_);
-    task_que_.push(conn);
-    pthread_cond_signal(&task_cond_);
+    //Run-to-completion: short handlers run right here on the loop thread and
+    //the response is flushed in the same poll iteration
+    if (run_in_loop_ || handler_->HasLoopHandlers()) {
+        bool run_in_loop = false;
+        HTTPHandleFunc func = handler_->GetHandleFunc(conn->Req()->path_, &run_in_loop);
+        
+        if (run_in_loop_ || run_in_loop) {
+            HandleRequest(conn, func, true);
+            return;
+        }
+    }
+    
+    //Workers are woken by Loop() once the whole poll batch is queued
+    task_que_->Push(conn);
 }
 
 void EventLoop::WebSocketTaskPush(WebSocket *ws, WebSocketOpcodeType opcode, const std::string &msg) {
-    LockGuard lock_guard(ws_task_cond_mtx_);
     std::shared_ptr<WebSocketTaskItem> item = std::make_shared<WebSocketTaskItem>(ws, opcode, msg);
-    ws_task_que_.push(item);
-    pthread_cond_signal(&ws_task_cond_);
+    ws_task_que_->Push(item);
+}
+    
+void *EventLoop::operator new(std::size_t size) {
+    void *p;
+    
+    if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0) {
+        throw std::bad_alloc();
+    }
+    
+    return p;
+}
+
+void EventLoop::operator delete(void *p) {
+    free(p);
 }
     
 EventLoop::~EventLoop() {
+    CloseSplicePipe();
+    
+    for (size_t i = 0; i < zerocopy_linger_.size(); i++) {
+        close(zerocopy_linger_[i].fd);
+    }
+    
+    pthread_mutex_destroy(&zerocopy_linger_mtx_);
+    
     delete conn_pool_;
+    delete timer_wheel_;
+    delete task_que_;
+    delete ws_task_que_;
 }
 
 }//namespace mevent
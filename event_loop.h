@@ -4,26 +4,40 @@
 #include "connection_pool.h"
 #include "event_loop_base.h"
 #include "ternary_search_tree.h"
+#include "task_queue.h"
+#include "timer_wheel.h"
+#include "mailbox.h"
+#include "buffer_pool.h"
 
+#include <netinet/in.h>
 #include <openssl/ssl.h>
 
 #include <string>
 #include <functional>
-#include <queue>
 #include <memory>
+#include <vector>
+#include <deque>
+#include <atomic>
 
 namespace mevent {
 
 class HTTPHandler {
 public:
-    HTTPHandler() {};
+    HTTPHandler() : loop_handlers_(0), body_handlers_(0) {};
     virtual ~HTTPHandler() {};
     
-    void SetHandleFunc(const std::string &path, HTTPHandleFunc func);
-    HTTPHandleFunc GetHandleFunc(const std::string &path);
+    void SetHandleFunc(const std::string &path, HTTPHandleFunc func, bool run_in_loop = false,
+                       HTTPBodyFunc body_func = nullptr);
+    HTTPHandleFunc GetHandleFunc(const std::string &path, bool *run_in_loop = NULL);
+    HTTPBodyFunc GetBodyFunc(const std::string &path);
+    
+    bool HasLoopHandlers();
+    bool HasBodyHandlers();
     
 private:
     tst::TernarySearchTree   func_tree_;
+    int                      loop_handlers_;
+    int                      body_handlers_;
 };
 
 class EventLoop : public EventLoopBase {
@@ -31,18 +45,35 @@ public:
     EventLoop();
     virtual ~EventLoop();
     
+    //listen_c_ and mailbox_c_ need Connection's cache line alignment
+    static void *operator new(std::size_t size);
+    static void operator delete(void *p);
+    
     void ResetConnection(Connection *conn);
     
     void Loop(int listen_fd);
     
+    //Whether the caller runs on the thread inside Loop()
+    bool InLoopThread();
+    
     void SetHandler(HTTPHandler *handler);
     
     void SetSslCtx(SSL_CTX *ssl_ctx);
     
     void SetMaxWorkerConnections(int num);
     void SetIdleTimeout(int secs);
+    void SetKeepaliveTimeout(int secs);
+    void SetMaxKeepaliveRequests(int num);
     void SetMaxPostSize(size_t size);
     void SetMaxHeaderSize(size_t size);
+    void SetMaxBodySize(size_t size);
+    void SetBodyTempDir(const std::string &dir);
+    void SetRunInLoop(bool enable);
+    void SetReusePort(bool enable);
+    void SetBusyPoll(int usecs);
+    void SetCpuSet(const std::vector<int> &cpus);
+    void SetZeroCopyThreshold(size_t size);
+    void SetWriteWatermarks(size_t low, size_t high, WriteOverflowPolicy policy);
     
     void TaskPush(Connection *conn);
     
@@ -60,20 +91,61 @@ private:
     
     void Accept();
     
-    static void *CheckConnectionTimeout(void *arg);
+    //Sets up a connection for a freshly accepted clifd, cliaddr is NULL when
+    //the peer's address is not known yet. False if clifd was closed because
+    //the pool ran out
+    bool NewConnection(int clifd, const struct sockaddr_in *cliaddr);
+    
+    //Completion I/O, see EventLoopBase::CompletionIO(): bytes the io_uring
+    //received for conn (0 at end of file, or -errno), and a finished send
+    void OnRecv(Connection *conn, const char *data, int res);
+    void OnSent(RingSend *rs, int res);
+    
+    void OnMailbox();
+    
+    //Re-arms for writing or closes conn depending on what Flush() returned
+    void FlushDone(Connection *conn, ConnStatus status);
+    
+    //Readies conn for the next request once a response is written, false
+    //if it has to be closed instead. Pipelined requests are picked up here.
+    bool KeepAlive(Connection *conn);
+    
+    void HandleRequest(Connection *conn, HTTPHandleFunc func, bool in_loop);
+    
+    bool Pipeline(Connection *conn);
+    
+    void CheckTimeout();
+    
+    void SetBusyPollSockopt(int fd);
+    
+    bool SetZeroCopySockopt(int fd);
+    
+    //Takes over fd, a closed connection's socket with MSG_ZEROCOPY sends
+    //still in flight, and pending, their memory. CheckTimeout() closes it
+    //once the sends completed
+    void LingerZeroCopy(int fd, ZeroCopyList &pending);
+    
+    //Shared by every splice(2) on this loop, NULL when not available
+    int *SplicePipe();
+    void CloseSplicePipe();
     
     static void *WorkerThread(void *arg);
     static void *WebSocketWorkerThread(void *arg);
 
     int                 evfd_;
     int                 listen_fd_;
+    
+    pthread_t           loop_thread_;
+    bool                loop_running_;
     Connection          listen_c_;
     
+    Mailbox             mailbox_;
+    Connection          mailbox_c_;
+    std::vector<MailboxItem>  mailbox_items_;
+    
     SSL_CTX            *ssl_ctx_;
     
-    pthread_mutex_t     task_cond_mtx_;
-    pthread_cond_t      task_cond_;
-    std::queue<Connection *> task_que_;
+    TaskQueue<Connection *>  *task_que_;
     
     HTTPHandler        *handler_;
     
@@ -82,14 +154,52 @@ private:
     int                 worker_threads_;
     int                 max_worker_connections_;
     int                 idle_timeout_;
+    int                 keepalive_timeout_;
+    int                 max_keepalive_requests_;
     size_t              max_post_size_;
     size_t              max_header_size_;
+    size_t              max_body_size_;
+    std::string         body_temp_dir_;
+    bool                run_in_loop_;
+    bool                reuse_port_;
+    bool                accept_pending_;
+    
+    //Sockets are accepted, read and written by the backend
+    bool                completion_io_;
+    
+    //When to re-arm an accept that failed, 0 if it is armed
+    time_t              accept_retry_;
+    int                 busy_poll_;
+    bool                busy_poll_warned_;
+    std::vector<int>    cpus_;
+    
+    int                 splice_pipe_[2];
+    
+    //0: MSG_ZEROCOPY off
+    size_t              zerocopy_threshold_;
+    
+    //Defaults for accepted connections, see Connection::AdmitWrite()
+    size_t              write_low_watermark_;
+    size_t              write_high_watermark_;
+    WriteOverflowPolicy write_overflow_policy_;
+    
+    struct ZeroCopyLinger {
+        int           fd;
+        time_t        expire;
+        ZeroCopyList  pending;
+    };
+    
+    pthread_mutex_t     zerocopy_linger_mtx_;
+    std::vector<ZeroCopyLinger>  zerocopy_linger_;
+    std::atomic<size_t> zerocopy_lingering_;
+    
+    //Receive buffers of this loop's connections
+    BufferPool          buffer_pool_;
     
     ConnectionPool     *conn_pool_;
+    TimerWheel         *timer_wheel_;
     
-    pthread_mutex_t     ws_task_cond_mtx_;
-    pthread_cond_t      ws_task_cond_;
-    std::queue<std::shared_ptr<WebSocketTaskItem>> ws_task_que_;
+    TaskQueue<std::shared_ptr<WebSocketTaskItem>>  *ws_task_que_;
 };
 
 }//namespace mevent
@@ -1,5 +1,7 @@
 #if defined(__APPLE__) || defined(__FreeBSD__)
 #include "event_loop_base_kqueue.cpp"
+#elif defined(__linux__) && defined(MEVENT_USE_IO_URING)
+#include "event_loop_base_io_uring.cpp"
 #elif defined(__linux__)
 #include "event_loop_base_epoll.cpp"
 #endif
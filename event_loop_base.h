@@ -2,6 +2,7 @@
 #define _EVENT_LOOP_BASE_H
 
 #include <sys/time.h>
+#include <sys/socket.h>
 
 namespace mevent {
 
@@ -9,6 +10,24 @@ namespace mevent {
 #define MEVENT_OUT   2
 #define MEVENT_ERR   4
 
+//Add() only: wake a single poller for fds shared between loops (epoll)
+#define MEVENT_EXCLUSIVE   8
+
+//Completion I/O, see CompletionIO(). Add(): the backend accepts on the
+//listening fd, Poll() reports each new fd as MEVENT_IN | MEVENT_ACCEPT
+#define MEVENT_ACCEPT      16
+
+//Add(): MEVENT_IN receives into the backend's buffers, Poll() reports the
+//bytes as MEVENT_IN | MEVENT_RECV. Kept across Modify()
+#define MEVENT_RECV        32
+
+//Poll() only: a Send() finished
+#define MEVENT_SENT        64
+
+#ifdef MEVENT_USE_IO_URING
+struct IOUring;
+#endif
+
 class EventLoopBase {
 protected:
     struct Event {
@@ -17,13 +36,37 @@ protected:
             int    fd;
             void  *ptr;
         } data;
+        
+        //MEVENT_ACCEPT: the new fd, MEVENT_RECV: bytes received, 0 at end of
+        //file, MEVENT_SENT: bytes sent. Otherwise -errno
+        int          res;
+        
+        //MEVENT_RECV: the bytes, valid until the next Poll()
+        const char  *buf;
     };
 
     int Create();
     int Add(int evfd, int fd, int mask, void *data);
     int Modify(int evfd, int fd, int mask, void *data);
     
+    //Must be called before fd is closed
+    int Delete(int evfd, int fd);
+    
     int Poll(int evfd, Event *events, int size, struct timeval *tv);
+    
+    //Whether the backend does socket I/O itself and reports completions:
+    //MEVENT_ACCEPT, MEVENT_RECV and Send(). Valid after Create()
+    bool CompletionIO();
+    
+    //Queues sendmsg(2) on fd, Poll() reports MEVENT_SENT with data once it
+    //finished. msg and the memory it points to must stay valid until then.
+    //Loop thread only, Delete() cancels it
+    int Send(int evfd, int fd, const struct msghdr *msg, int flags, void *data);
+    
+#ifdef MEVENT_USE_IO_URING
+private:
+    IOUring  *uring_;
+#endif
 };
 
 }//namespace mevent
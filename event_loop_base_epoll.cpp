@@ -2,6 +2,8 @@
 
 #include <sys/epoll.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <pthread.h>
 
 namespace mevent {
@@ -24,6 +26,12 @@ int EventLoopBase::Add(int evfd, int fd, int mask, void *data) {
     
     ev.events |= EPOLLET;
     
+#ifdef EPOLLEXCLUSIVE
+    if (mask & MEVENT_EXCLUSIVE) {
+        ev.events |= EPOLLEXCLUSIVE;
+    }
+#endif
+    
     ev.data.ptr = data;
     
     return epoll_ctl(evfd, EPOLL_CTL_ADD, fd, &ev);
@@ -48,6 +56,15 @@ int EventLoopBase::Modify(int evfd, int fd, int mask, void *data) {
     return epoll_ctl(evfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
+//close() would drop the registration too, but a socket lingering for its
+//zero-copy completions stays open, see EventLoop::LingerZeroCopy()
+int EventLoopBase::Delete(int evfd, int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    
+    return epoll_ctl(evfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
 int EventLoopBase::Poll(int evfd, EventLoopBase::Event *events, int size, struct timeval *tv) {
     struct epoll_event evs[size];
     int nfds;
@@ -85,4 +102,19 @@ int EventLoopBase::Poll(int evfd, EventLoopBase::Event *events, int size, struct
     return nfds;
 }
 
+bool EventLoopBase::CompletionIO() {
+    return false;
+}
+
+int EventLoopBase::Send(int evfd, int fd, const struct msghdr *msg, int flags, void *data) {
+    (void)evfd;//avoid unused parameter warning
+    (void)fd;//avoid unused parameter warning
+    (void)msg;//avoid unused parameter warning
+    (void)flags;//avoid unused parameter warning
+    (void)data;//avoid unused parameter warning
+    
+    errno = ENOTSUP;
+    return -1;
+}
+
 }//namespace mevent
\ No newline at end of file
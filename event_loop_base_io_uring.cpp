@@ -0,0 +1,820 @@
+#include "event_loop_base.h"
+#include "util.h"
+#include "lock_guard.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <vector>
+
+//io_uring backend (make IO_URING=1), needs Linux 5.13+.
+//
+//On Linux 6.0+ sockets added with MEVENT_ACCEPT or MEVENT_RECV are served by
+//completion I/O: a multishot IORING_OP_ACCEPT on the listener, and for each
+//connection a multishot IORING_OP_RECV that fills buffers shared by the
+//loop, provided through a buffer ring or, where that does not work, with
+//IORING_OP_PROVIDE_BUFFERS. Send() queues an IORING_OP_SENDMSG. Everything
+//else, and MEVENT_OUT of those sockets, gets a multishot IORING_OP_POLL_ADD that
+//keeps reporting readiness like an edge-triggered epoll entry. On older
+//kernels that is all there is and CompletionIO() is false.
+//
+//Requests made on the loop thread are only queued and go to the kernel
+//together with the next wait in Poll(), so a loop pass costs a single
+//io_uring_enter however many sockets it accepted, read and wrote. Other
+//threads submit at once.
+//
+//user_data is (kind << 62 | generation << 32 | fd), or for sends the
+//caller's pointer tagged with URING_SEND. Completions left over from an fd
+//number that has since been closed and reused are recognised by the
+//generation and dropped.
+
+namespace mevent {
+
+#define URING_ENTRIES     1024
+
+//Receive buffers shared by the loop's connections, lent out by one Poll()
+//and given back by the next
+#define URING_RECV_BUFS      512
+#define URING_RECV_BUF_SIZE  8192
+#define URING_BUF_GROUP      0
+
+#define URING_POLL   0ULL
+#define URING_IN     1ULL
+#define URING_SEND   2ULL
+
+#define URING_GEN_MASK   0x3fffffffU
+
+struct IOUring {
+    //Each fd has at most one poll and one accept or recv request. What is
+    //wanted changes by cancelling the request, the replacement goes out
+    //once its last completion arrived
+    enum class Req : uint8_t {
+        IDLE,
+        ARMED,
+        CANCELLING
+    };
+
+    struct FdEntry {
+        FdEntry() : data(NULL), mask(0), gen(0), accept(false), recv(false),
+                    poll(Req::IDLE), in(Req::IDLE), send(0) {}
+
+        void      *data;
+        uint32_t   mask;
+        uint32_t   gen;
+
+        //MEVENT_IN is served by the in request instead of the poll
+        bool       accept;
+        bool       recv;
+
+        Req        poll;
+        Req        in;
+
+        //user_data of the last Send(), Delete() cancels it
+        uint64_t   send;
+    };
+
+    int                  ring_fd;
+    pthread_t            owner;
+
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_entries;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    unsigned             to_submit;
+
+    //Provided buffers for MEVENT_RECV, bufs is NULL without completion I/O
+    //and buf_ring is NULL if they are not given back through a ring
+    struct io_uring_buf_ring *buf_ring;
+    char                *bufs;
+    uint16_t             buf_tail;
+
+    //Buffers handed out by the last Poll(), loop thread only
+    std::vector<uint16_t> lent;
+
+    //Guards the SQ tail, to_submit and the fd table, worker threads call Modify()
+    pthread_mutex_t      mtx;
+    std::vector<FdEntry> fds;
+};
+
+static int IOUringSetup(unsigned entries, struct io_uring_params *p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int IOUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+static int IOUringRegister(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+static inline uint64_t UserData(int fd, uint32_t gen, uint64_t kind) {
+    return (kind << 62) | (static_cast<uint64_t>(gen & URING_GEN_MASK) << 32) | static_cast<uint32_t>(fd);
+}
+
+//Never 0, which marks completions nobody waits for
+static inline uint32_t NextGen(uint32_t gen) {
+    gen = (gen + 1) & URING_GEN_MASK;
+    return gen ? gen : 1;
+}
+
+//Multishot recv came with Linux 6.0, as did IORING_OP_SEND_ZC which a probe can see
+static bool HasMultishotRecv(int ring_fd) {
+    std::vector<char> buf(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buf.data());
+
+    if (IOUringRegister(ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        return false;
+    }
+
+    return probe->last_op >= IORING_OP_SEND_ZC && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+}
+
+//Called with ring->mtx held
+static struct io_uring_sqe *GetSqe(IOUring *ring);
+
+//Called with ring->mtx held. Without a buffer ring the buffer goes back
+//through an IORING_OP_PROVIDE_BUFFERS that leaves with the next submit
+static int PutBuffer(IOUring *ring, uint16_t bid) {
+    char *addr = ring->bufs + static_cast<size_t>(bid) * URING_RECV_BUF_SIZE;
+
+    if (!ring->buf_ring) {
+        struct io_uring_sqe *sqe = GetSqe(ring);
+        if (!sqe) {
+            return -1;
+        }
+
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;
+        sqe->addr = reinterpret_cast<uint64_t>(addr);
+        sqe->len = URING_RECV_BUF_SIZE;
+        sqe->off = bid;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->user_data = 0;
+
+        return 0;
+    }
+
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_RECV_BUFS - 1)];
+    buf->addr = reinterpret_cast<uint64_t>(addr);
+    buf->len = URING_RECV_BUF_SIZE;
+    buf->bid = bid;
+
+    ring->buf_tail++;
+
+    return 0;
+}
+
+//Some kernels take the buffer ring but never hand a buffer out of it, so
+//one byte is received through it before it is trusted
+static bool ProbeBufRing(IOUring *ring) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        return false;
+    }
+
+    bool ok = false;
+
+    struct io_uring_sqe *sqe = GetSqe(ring);
+    if (sqe && write(sv[1], "", 1) == 1) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sv[0];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->user_data = 0;
+
+        if (IOUringEnter(ring->ring_fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0) {
+            unsigned head = *ring->cq_head;
+            if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER);
+
+                if (ok) {
+                    PutBuffer(ring, static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+                    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+                }
+
+                __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    ring->to_submit = 0;
+
+    close(sv[0]);
+    close(sv[1]);
+
+    return ok;
+}
+
+static bool SetupBufs(IOUring *ring) {
+    size_t ring_size = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    size_t bufs_size = static_cast<size_t>(URING_RECV_BUFS) * URING_RECV_BUF_SIZE;
+
+    void *p = mmap(NULL, ring_size + bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    ring->bufs = static_cast<char *>(p) + ring_size;
+    ring->buf_tail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(p);
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = URING_BUF_GROUP;
+
+    if (IOUringRegister(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0) {
+        ring->buf_ring = static_cast<struct io_uring_buf_ring *>(p);
+
+        for (uint16_t bid = 0; bid < URING_RECV_BUFS; bid++) {
+            PutBuffer(ring, bid);
+        }
+        __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+
+        if (ProbeBufRing(ring)) {
+            return true;
+        }
+
+        IOUringRegister(ring->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        ring->buf_ring = NULL;
+    }
+
+    //Linux 5.7 style provided buffers, one entry hands over all of them
+    struct io_uring_sqe *sqe = GetSqe(ring);
+    if (!sqe) {
+        munmap(p, ring_size + bufs_size);
+        ring->bufs = NULL;
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_RECV_BUFS;
+    sqe->addr = reinterpret_cast<uint64_t>(ring->bufs);
+    sqe->len = URING_RECV_BUF_SIZE;
+    sqe->off = 0;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = 0;
+
+    return true;
+}
+
+//Called with ring->mtx held
+static struct io_uring_sqe *GetSqe(IOUring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+
+    if (tail - head >= *ring->sq_entries) {
+        //SQ is full, hand what we have to the kernel first
+        if (IOUringEnter(ring->ring_fd, ring->to_submit, 0, 0, NULL, 0) < 0) {
+            return NULL;
+        }
+        ring->to_submit = 0;
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= *ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+//Called with ring->mtx held
+static int PrepCancel(IOUring *ring, uint64_t user_data) {
+    struct io_uring_sqe *sqe = GetSqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;
+
+    return 0;
+}
+
+//Called with ring->mtx held. What the poll watches: everything MEVENT_IN
+//is not served by the in request
+static uint32_t PollMask(const IOUring::FdEntry &entry) {
+    if (entry.accept || entry.recv) {
+        return entry.mask & MEVENT_OUT;
+    }
+
+    return entry.mask & (MEVENT_IN | MEVENT_OUT);
+}
+
+//Called with ring->mtx held
+static int ArmPoll(IOUring *ring, int fd) {
+    IOUring::FdEntry &entry = ring->fds[fd];
+
+    uint32_t mask = PollMask(entry);
+    if (entry.poll != IOUring::Req::IDLE || !mask) {
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = GetSqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    uint32_t events = EPOLLET;
+    if (mask & MEVENT_IN) {
+        events |= EPOLLIN;
+    }
+    if (mask & MEVENT_OUT) {
+        events |= EPOLLOUT;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = UserData(fd, entry.gen, URING_POLL);
+
+    entry.poll = IOUring::Req::ARMED;
+
+    return 0;
+}
+
+//Called with ring->mtx held. Like EPOLL_CTL_MOD, the new poll reports the
+//fd at once if it is already ready
+static int RearmPoll(IOUring *ring, int fd) {
+    IOUring::FdEntry &entry = ring->fds[fd];
+
+    if (entry.poll == IOUring::Req::ARMED) {
+        if (PrepCancel(ring, UserData(fd, entry.gen, URING_POLL)) < 0) {
+            return -1;
+        }
+        entry.poll = IOUring::Req::CANCELLING;
+        return 0;
+    }
+
+    return ArmPoll(ring, fd);
+}
+
+//Called with ring->mtx held. Arms or cancels the multishot accept or recv
+//to match entry.mask
+static int SyncIn(IOUring *ring, int fd) {
+    IOUring::FdEntry &entry = ring->fds[fd];
+
+    if (!entry.accept && !entry.recv) {
+        return 0;
+    }
+
+    bool want = entry.mask & MEVENT_IN;
+
+    if (!want && entry.in == IOUring::Req::ARMED) {
+        if (PrepCancel(ring, UserData(fd, entry.gen, URING_IN)) < 0) {
+            return -1;
+        }
+        entry.in = IOUring::Req::CANCELLING;
+    } else if (want && entry.in == IOUring::Req::IDLE) {
+        struct io_uring_sqe *sqe = GetSqe(ring);
+        if (!sqe) {
+            return -1;
+        }
+
+        if (entry.accept) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUF_GROUP;
+        }
+
+        sqe->fd = fd;
+        sqe->user_data = UserData(fd, entry.gen, URING_IN);
+
+        entry.in = IOUring::Req::ARMED;
+    }
+
+    return 0;
+}
+
+//Called with ring->mtx held
+static int SubmitIfForeign(IOUring *ring) {
+    if (pthread_equal(pthread_self(), ring->owner)) {
+        return 0;
+    }
+
+    //The loop may be asleep in Poll(), it would not see our entries until it wakes
+    int ret = IOUringEnter(ring->ring_fd, ring->to_submit, 0, 0, NULL, 0);
+    if (ret < 0) {
+        return -1;
+    }
+    ring->to_submit = 0;
+
+    return 0;
+}
+
+int EventLoopBase::Create() {
+    IOUring *ring = new IOUring();
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 8;
+
+    ring->ring_fd = IOUringSetup(URING_ENTRIES, &params);
+    if (ring->ring_fd < 0) {
+        delete ring;
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        MEVENT_LOG_DEBUG("io_uring: kernel lacks IORING_FEAT_EXT_ARG");
+        close(ring->ring_fd);
+        delete ring;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) {
+            sq_size = cq_size;
+        }
+        cq_size = sq_size;
+    }
+
+    char *sq_ptr = static_cast<char *>(mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING));
+    if (sq_ptr == MAP_FAILED) {
+        close(ring->ring_fd);
+        delete ring;
+        return -1;
+    }
+
+    char *cq_ptr = sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ptr = static_cast<char *>(mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING));
+        if (cq_ptr == MAP_FAILED) {
+            close(ring->ring_fd);
+            delete ring;
+            return -1;
+        }
+    }
+
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        close(ring->ring_fd);
+        delete ring;
+        return -1;
+    }
+
+    ring->sq_head = reinterpret_cast<unsigned *>(sq_ptr + params.sq_off.head);
+    ring->sq_tail = reinterpret_cast<unsigned *>(sq_ptr + params.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned *>(sq_ptr + params.sq_off.ring_mask);
+    ring->sq_entries = reinterpret_cast<unsigned *>(sq_ptr + params.sq_off.ring_entries);
+    ring->sq_array = reinterpret_cast<unsigned *>(sq_ptr + params.sq_off.array);
+    ring->sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+    ring->cq_head = reinterpret_cast<unsigned *>(cq_ptr + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned *>(cq_ptr + params.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned *>(cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<struct io_uring_cqe *>(cq_ptr + params.cq_off.cqes);
+
+    ring->to_submit = 0;
+    ring->owner = pthread_self();
+
+    ring->buf_ring = NULL;
+    ring->bufs = NULL;
+    ring->buf_tail = 0;
+
+    if (!HasMultishotRecv(ring->ring_fd) || !SetupBufs(ring)) {
+        MEVENT_LOG_DEBUG("io_uring: no multishot recv, falling back to readiness");
+    }
+
+    if (pthread_mutex_init(&ring->mtx, NULL) != 0) {
+        MEVENT_LOG_DEBUG_EXIT(NULL);
+    }
+
+    uring_ = ring;
+
+    return ring->ring_fd;
+}
+
+bool EventLoopBase::CompletionIO() {
+    return uring_->bufs != NULL;
+}
+
+int EventLoopBase::Add(int evfd, int fd, int mask, void *data) {
+    (void)evfd;//avoid unused parameter warning
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    IOUring *ring = uring_;
+    LockGuard lock_guard(ring->mtx);
+
+    if (static_cast<size_t>(fd) >= ring->fds.size()) {
+        ring->fds.resize(fd + 1024);
+    }
+
+    IOUring::FdEntry &entry = ring->fds[fd];
+    entry.data = data;
+    entry.mask = mask & (MEVENT_IN | MEVENT_OUT);
+    entry.gen = NextGen(entry.gen);
+    entry.accept = ring->bufs && (mask & MEVENT_ACCEPT);
+    entry.recv = ring->bufs && (mask & MEVENT_RECV);
+    entry.poll = IOUring::Req::IDLE;
+    entry.in = IOUring::Req::IDLE;
+    entry.send = 0;
+
+    if (SyncIn(ring, fd) < 0 || ArmPoll(ring, fd) < 0) {
+        return -1;
+    }
+
+    return SubmitIfForeign(ring);
+}
+
+int EventLoopBase::Modify(int evfd, int fd, int mask, void *data) {
+    (void)evfd;//avoid unused parameter warning
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    IOUring *ring = uring_;
+    LockGuard lock_guard(ring->mtx);
+
+    if (static_cast<size_t>(fd) >= ring->fds.size() || !ring->fds[fd].data) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    IOUring::FdEntry &entry = ring->fds[fd];
+    entry.data = data;
+    entry.mask = mask & (MEVENT_IN | MEVENT_OUT);
+
+    if (SyncIn(ring, fd) < 0 || RearmPoll(ring, fd) < 0) {
+        return -1;
+    }
+
+    return SubmitIfForeign(ring);
+}
+
+int EventLoopBase::Delete(int evfd, int fd) {
+    (void)evfd;//avoid unused parameter warning
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    IOUring *ring = uring_;
+    LockGuard lock_guard(ring->mtx);
+
+    if (static_cast<size_t>(fd) >= ring->fds.size() || !ring->fds[fd].data) {
+        return 0;
+    }
+
+    //Requests pin the file, the socket is only released once they are gone.
+    //Cancelled by user_data, which still works after close()
+    IOUring::FdEntry &entry = ring->fds[fd];
+
+    if (entry.poll == IOUring::Req::ARMED && PrepCancel(ring, UserData(fd, entry.gen, URING_POLL)) < 0) {
+        return -1;
+    }
+    if (entry.in == IOUring::Req::ARMED && PrepCancel(ring, UserData(fd, entry.gen, URING_IN)) < 0) {
+        return -1;
+    }
+    if (entry.send && PrepCancel(ring, entry.send) < 0) {
+        return -1;
+    }
+
+    entry.data = NULL;
+    entry.mask = 0;
+    entry.gen = NextGen(entry.gen);
+    entry.poll = IOUring::Req::IDLE;
+    entry.in = IOUring::Req::IDLE;
+    entry.send = 0;
+
+    return SubmitIfForeign(ring);
+}
+
+int EventLoopBase::Send(int evfd, int fd, const struct msghdr *msg, int flags, void *data) {
+    (void)evfd;//avoid unused parameter warning
+
+    IOUring *ring = uring_;
+    LockGuard lock_guard(ring->mtx);
+
+    if (fd < 0 || static_cast<size_t>(fd) >= ring->fds.size() || !ring->fds[fd].data) {
+        errno = EBADF;
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = GetSqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = (URING_SEND << 62) | reinterpret_cast<uint64_t>(data);
+
+    ring->fds[fd].send = sqe->user_data;
+
+    return SubmitIfForeign(ring);
+}
+
+int EventLoopBase::Poll(int evfd, EventLoopBase::Event *events, int size, struct timeval *tv) {
+    IOUring *ring = uring_;
+
+    unsigned to_submit;
+    {
+        LockGuard lock_guard(ring->mtx);
+
+        //The caller is done with what the last call received
+        if (!ring->lent.empty()) {
+            for (size_t i = 0; i < ring->lent.size(); i++) {
+                PutBuffer(ring, ring->lent[i]);
+            }
+            if (ring->buf_ring) {
+                __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+            }
+            ring->lent.clear();
+        }
+
+        to_submit = ring->to_submit;
+        ring->to_submit = 0;
+    }
+
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        unsigned min_complete = 1;
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        void *argp = NULL;
+        size_t argsz = 0;
+
+        if (tv) {
+            if (tv->tv_sec == 0 && tv->tv_usec == 0) {
+                min_complete = 0;
+            } else {
+                ts.tv_sec = tv->tv_sec;
+                ts.tv_nsec = tv->tv_usec * 1000;
+
+                memset(&arg, 0, sizeof(arg));
+                arg.sigmask_sz = _NSIG / 8;
+                arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+                flags |= IORING_ENTER_EXT_ARG;
+                argp = &arg;
+                argsz = sizeof(arg);
+            }
+        }
+
+        if (IOUringEnter(evfd, to_submit, min_complete, flags, argp, argsz) < 0) {
+            if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+                return -1;
+            }
+        }
+    } else if (to_submit > 0) {
+        if (IOUringEnter(evfd, to_submit, 0, 0, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+
+    int nfds = 0;
+
+    LockGuard lock_guard(ring->mtx);
+
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && nfds < size) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        head++;
+
+        if (cqe->user_data == 0) {
+            continue;
+        }
+
+        uint64_t kind = cqe->user_data >> 62;
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+
+        //Reported even after Delete(), the caller owns what the send points to
+        if (kind == URING_SEND) {
+            events[nfds].data.ptr = reinterpret_cast<void *>(cqe->user_data & ~(3ULL << 62));
+            events[nfds].mask = MEVENT_SENT;
+            events[nfds].res = cqe->res;
+            nfds++;
+            continue;
+        }
+
+        const char *buf = NULL;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            ring->lent.push_back(bid);
+            buf = ring->bufs + static_cast<size_t>(bid) * URING_RECV_BUF_SIZE;
+        }
+
+        int fd = static_cast<int>(cqe->user_data & 0xffffffff);
+        uint32_t gen = static_cast<uint32_t>(cqe->user_data >> 32) & URING_GEN_MASK;
+
+        if (static_cast<size_t>(fd) >= ring->fds.size()) {
+            continue;
+        }
+
+        IOUring::FdEntry &entry = ring->fds[fd];
+        if (entry.gen != gen || !entry.data) {
+            continue;
+        }
+
+        events[nfds].data.ptr = entry.data;
+        events[nfds].res = cqe->res;
+        events[nfds].buf = buf;
+
+        if (kind == URING_IN) {
+            //Cancelled, out of buffers or out of CQ space: go on with what is
+            //wanted now. End of file and errors are reported instead, and
+            //not retried before the next Modify()
+            if (!more) {
+                entry.in = IOUring::Req::IDLE;
+
+                bool done = cqe->res < 0 ? cqe->res != -ECANCELED && cqe->res != -ENOBUFS
+                                         : entry.recv && cqe->res == 0;
+                if (!done) {
+                    SyncIn(ring, fd);
+                }
+            }
+
+            if (cqe->res == -ECANCELED || cqe->res == -ENOBUFS) {
+                continue;
+            }
+
+            events[nfds].mask = MEVENT_IN | (entry.accept ? MEVENT_ACCEPT : MEVENT_RECV);
+            nfds++;
+            continue;
+        }
+
+        if (!more) {
+            //Cancelled by Modify() or terminated (error or CQ overflow), arm
+            //a new one for what is wanted now
+            entry.poll = IOUring::Req::IDLE;
+            ArmPoll(ring, fd);
+        }
+
+        if (cqe->res == -ECANCELED) {
+            continue;
+        }
+
+        events[nfds].mask = 0;
+
+        if (cqe->res < 0) {
+            events[nfds].mask |= MEVENT_OUT;
+        } else {
+            if (cqe->res & EPOLLIN) {
+                events[nfds].mask |= MEVENT_IN;
+            }
+
+            if (cqe->res & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                events[nfds].mask |= MEVENT_OUT;
+            }
+        }
+
+        nfds++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return nfds;
+}
+
+}//namespace mevent
@@ -2,6 +2,7 @@
 
 #include <sys/event.h>
 #include <stdlib.h>
+#include <errno.h>
 
 namespace mevent {
 
@@ -26,7 +27,26 @@ int EventLoopBase::Add(int evfd, int fd, int mask, void *data) {
 }
 
 int EventLoopBase::Modify(int evfd, int fd, int mask, void *data) {
-    return Add(evfd, fd, mask, data);
+    struct kevent ev;
+    
+    //Filters stay registered until deleted, a level-triggered EVFILT_WRITE
+    //left on an idle socket would fire on every kevent() call. Deleting one
+    //that is not registered only fails with ENOENT.
+    EV_SET(&ev, fd, EVFILT_READ, (mask & MEVENT_IN) ? EV_ADD : EV_DELETE, 0, 0, data);
+    kevent(evfd, &ev, 1, NULL, 0, NULL);
+    
+    EV_SET(&ev, fd, EVFILT_WRITE, (mask & MEVENT_OUT) ? EV_ADD : EV_DELETE, 0, 0, data);
+    kevent(evfd, &ev, 1, NULL, 0, NULL);
+    
+    return 0;
+}
+
+int EventLoopBase::Delete(int evfd, int fd) {
+    (void)evfd;//avoid unused parameter warning
+    (void)fd;//avoid unused parameter warning
+    
+    //close() drops the registration
+    return 0;
 }
     
 int EventLoopBase::Poll(int evfd, EventLoopBase::Event *events, int size, struct timeval *tv) {
@@ -61,4 +81,19 @@ int EventLoopBase::Poll(int evfd, EventLoopBase::Event *events, int size, struct
     return nfds;
 }
 
+bool EventLoopBase::CompletionIO() {
+    return false;
+}
+
+int EventLoopBase::Send(int evfd, int fd, const struct msghdr *msg, int flags, void *data) {
+    (void)evfd;//avoid unused parameter warning
+    (void)fd;//avoid unused parameter warning
+    (void)msg;//avoid unused parameter warning
+    (void)flags;//avoid unused parameter warning
+    (void)data;//avoid unused parameter warning
+    
+    errno = ENOTSUP;
+    return -1;
+}
+
 }//namespace mevent
\ No newline at end of file
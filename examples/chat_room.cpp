@@ -1,5 +1,6 @@
 #include <set>
 #include <map>
+#include <queue>
 
 #include "../http_server.h"
 #include "../util.h"
@@ -322,6 +323,9 @@ int main() {
     server->SetIdleTimeout(60);
     server->SetMaxWorkerConnections(8192);
     
+    //A subscriber that stops reading loses messages instead of growing its queue without bound
+    server->SetWriteWatermarks(256 << 10, 1 << 20);
+    
     server->ListenAndServe("0.0.0.0", 80);
     
     //HTTPS WSS
@@ -57,7 +57,6 @@ public:
         str += "Content-Length:" + std::to_string(req->ContentLength()) + "\n";
         str += "RemoteAddr:" + req->RemoteAddr() + "\n";
         
-        req->ParseHeader();
         str += "Content-Type:" + req->HeaderValue("Content-Type") + "\n";
         
         resp->SetHeader("Content-Type", "text/plain");
@@ -0,0 +1,213 @@
+#include "http_scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MEVENT_SCAN_X86
+#include <immintrin.h>
+#endif
+
+namespace mevent {
+
+//Everything signed-less than lt (control characters, and bytes >= 0x80 as
+//they are negative) plus up to four more, unused ones repeat DEL
+struct StopSet {
+    char lt;
+    char c[4];
+};
+
+//Indexed by HTTPScanStop
+static const StopSet stop_sets[] = {
+    {0x20, {0x7f, '\\', 0x7f, 0x7f}},
+    {0x20, {0x7f, '\\', ':',  ':' }},
+    {0x21, {0x7f, '\\', 0x7f, 0x7f}},
+    {0x21, {0x7f, '\\', '?',  '#' }}
+};
+
+typedef size_t (*ScanFunc)(const char *p, size_t len, const StopSet &s);
+typedef size_t (*FindFunc)(const char *p, size_t len, const char *needle, size_t needle_len);
+
+static size_t ScanScalar(const char *p, size_t len, const StopSet &s) {
+    for (size_t i = 0; i < len; i++) {
+        char c = p[i];
+        if (static_cast<signed char>(c) < s.lt
+            || c == s.c[0] || c == s.c[1] || c == s.c[2] || c == s.c[3]) {
+            return i;
+        }
+    }
+    
+    return len;
+}
+
+static size_t FindScalar(const char *p, size_t len, const char *needle, size_t needle_len) {
+    for (size_t i = 0; i + needle_len <= len; i++) {
+        const char *c = static_cast<const char *>(memchr(p + i, needle[0], len - needle_len + 1 - i));
+        if (!c) {
+            break;
+        }
+        
+        i = c - p;
+        if (memcmp(c + 1, needle + 1, needle_len - 1) == 0) {
+            return i;
+        }
+    }
+    
+    return len;
+}
+
+#ifdef MEVENT_SCAN_X86
+
+//Candidates are the positions where both the first and the last byte of
+//needle match, only those are compared in full
+static size_t FindSSE2(const char *p, size_t len, const char *needle, size_t needle_len) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    
+    size_t i = 0;
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + needle_len - 1));
+        
+        unsigned int mask = static_cast<unsigned int>(
+            _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))));
+        
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(p + pos + 1, needle + 1, needle_len - 2) == 0) {
+                return pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    
+    size_t n = FindScalar(p + i, len - i, needle, needle_len);
+    return n == len - i ? len : i + n;
+}
+
+__attribute__((target("avx2")))
+static size_t FindAVX2(const char *p, size_t len, const char *needle, size_t needle_len) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    
+    size_t i = 0;
+    for (; i + needle_len - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i + needle_len - 1));
+        
+        unsigned int mask = static_cast<unsigned int>(
+            _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))));
+        
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(p + pos + 1, needle + 1, needle_len - 2) == 0) {
+                _mm256_zeroupper();
+                return pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    
+    _mm256_zeroupper();
+    
+    size_t n = FindSSE2(p + i, len - i, needle, needle_len);
+    return n == len - i ? len : i + n;
+}
+
+static size_t ScanSSE2(const char *p, size_t len, const StopSet &s) {
+    const __m128i lt = _mm_set1_epi8(s.lt);
+    const __m128i c0 = _mm_set1_epi8(s.c[0]);
+    const __m128i c1 = _mm_set1_epi8(s.c[1]);
+    const __m128i c2 = _mm_set1_epi8(s.c[2]);
+    const __m128i c3 = _mm_set1_epi8(s.c[3]);
+    
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(v, lt), _mm_cmpeq_epi8(v, c0)),
+                                 _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c1), _mm_cmpeq_epi8(v, c2)),
+                                              _mm_cmpeq_epi8(v, c3)));
+        
+        unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(m));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    
+    return i + ScanScalar(p + i, len - i, s);
+}
+
+__attribute__((target("avx2")))
+static size_t ScanAVX2(const char *p, size_t len, const StopSet &s) {
+    const __m256i lt = _mm256_set1_epi8(s.lt);
+    const __m256i c0 = _mm256_set1_epi8(s.c[0]);
+    const __m256i c1 = _mm256_set1_epi8(s.c[1]);
+    const __m256i c2 = _mm256_set1_epi8(s.c[2]);
+    const __m256i c3 = _mm256_set1_epi8(s.c[3]);
+    
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi8(lt, v), _mm256_cmpeq_epi8(v, c0)),
+                                    _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c1), _mm256_cmpeq_epi8(v, c2)),
+                                                    _mm256_cmpeq_epi8(v, c3)));
+        
+        unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(m));
+        if (mask) {
+            _mm256_zeroupper();
+            return i + __builtin_ctz(mask);
+        }
+    }
+    
+    //Not emitted by the compiler for a single target("avx2") function, and
+    //legacy SSE code would stall on the dirty upper halves otherwise
+    _mm256_zeroupper();
+    
+    //The tail may still fill a 16 byte block
+    return i + ScanSSE2(p + i, len - i, s);
+}
+
+#endif
+
+struct ScanImpl {
+    const char *name;
+    ScanFunc    scan;
+    FindFunc    find;
+};
+
+static ScanImpl PickImpl() {
+#ifdef MEVENT_SCAN_X86
+    //May run before the CPU model is set up by its own constructor
+    __builtin_cpu_init();
+    
+    if (__builtin_cpu_supports("avx2")) {
+        return ScanImpl{"avx2", ScanAVX2, FindAVX2};
+    }
+    
+    //Part of x86-64 itself
+    return ScanImpl{"sse2", ScanSSE2, FindSSE2};
+#else
+    return ScanImpl{"scalar", ScanScalar, FindScalar};
+#endif
+}
+
+static const ScanImpl impl = PickImpl();
+
+size_t HTTPScan(const char *p, size_t len, HTTPScanStop stop) {
+    return impl.scan(p, len, stop_sets[static_cast<int>(stop)]);
+}
+
+size_t HTTPFind(const char *p, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len < 2 || needle_len > len) {
+        return needle_len == 1 && len > 0 ? FindScalar(p, len, needle, needle_len) : len;
+    }
+    
+    return impl.find(p, len, needle, needle_len);
+}
+
+const char *HTTPScanImpl() {
+    return impl.name;
+}
+    
+}//namespace mevent
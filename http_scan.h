@@ -0,0 +1,34 @@
+#ifndef _HTTP_SCAN_H
+#define _HTTP_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mevent {
+
+//Bytes a scan stops at. Each set includes every byte the request parser
+//rejects (control characters, '\\', DEL and bytes >= 0x80) as well as CR and
+//LF, so whatever a scan skips needs no further checking.
+enum class HTTPScanStop : uint8_t {
+    LINE,   //nothing else, e.g. the rest of a header line
+    FIELD,  //':'
+    WORD,   //' '
+    URL     //' ', '?' and '#'
+};
+
+//Length of the leading run of p that holds none of the stop bytes, len if
+//there is none. Works 32 bytes at a time with AVX2 or 16 with SSE2, picked
+//once at startup from what the CPU supports, byte by byte elsewhere.
+size_t HTTPScan(const char *p, size_t len, HTTPScanStop stop);
+
+//Offset of the first occurrence of needle in p, len if there is none. Only
+//positions where the first and last byte of needle match are compared in
+//full, found a vector at a time like HTTPScan().
+size_t HTTPFind(const char *p, size_t len, const char *needle, size_t needle_len);
+
+//"avx2", "sse2" or "scalar"
+const char *HTTPScanImpl();
+
+}//namespace mevent
+
+#endif
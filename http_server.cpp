@@ -5,14 +5,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <curl/curl.h>
 #include <assert.h>
 
 #include <openssl/conf.h>
 #include <openssl/err.h>
 
+#include <vector>
+
 #ifdef __APPLE__
 #include <sys/syslimits.h>
 #endif
@@ -26,41 +30,84 @@ HTTPServer::HTTPServer() {
     worker_threads_ = 1;
     max_worker_connections_ = 1024;
     idle_timeout_ = 30;
+    keepalive_timeout_ = 15;
+    max_keepalive_requests_ = 1000;
     max_header_size_ = 2048;
     max_post_size_ = 8192;
+    max_body_size_ = 1 << 30;
+    reuse_port_ = false;
+    run_in_loop_ = false;
+    busy_poll_ = 0;
+    cpu_affinity_ = false;
+    ktls_ = false;
+    zerocopy_threshold_ = 0;
+    write_low_watermark_ = 0;
+    write_high_watermark_ = 0;
+    write_overflow_policy_ = WriteOverflowPolicy::DROP;
     ssl_ctx_ = NULL;
 }
 
+HTTPServer::~HTTPServer() {
+    for (size_t i = 0; i < file_handlers_.size(); i++) {
+        delete file_handlers_[i];
+    }
+}
+
 void *HTTPServer::EventLoopThread(void *arg) {
-    HTTPServer *server = (HTTPServer *)arg;
+    EventLoopThreadArg *loop_arg = (EventLoopThreadArg *)arg;
+    HTTPServer *server = loop_arg->server;
+    int listen_fd = loop_arg->listen_fd;
+    std::vector<int> cpus = loop_arg->cpus;
+    delete loop_arg;
     
     EventLoop *elp = new EventLoop();
+    elp->SetCpuSet(cpus);
     elp->SetHandler(&server->handler_);
     elp->SetSslCtx(server->ssl_ctx_);
     elp->SetMaxWorkerConnections(server->max_worker_connections_);
     elp->SetIdleTimeout(server->idle_timeout_);
+    elp->SetKeepaliveTimeout(server->keepalive_timeout_);
+    elp->SetMaxKeepaliveRequests(server->max_keepalive_requests_);
     elp->SetMaxHeaderSize(server->max_header_size_);
     elp->SetMaxPostSize(server->max_post_size_);
+    elp->SetMaxBodySize(server->max_body_size_);
+    elp->SetBodyTempDir(server->body_temp_dir_);
+    elp->SetRunInLoop(server->run_in_loop_);
+    elp->SetReusePort(server->reuse_port_);
+    elp->SetBusyPoll(server->busy_poll_);
+    elp->SetZeroCopyThreshold(server->zerocopy_threshold_);
+    elp->SetWriteWatermarks(server->write_low_watermark_, server->write_high_watermark_, server->write_overflow_policy_);
     
-    elp->Loop(server->listen_fd_);
+    elp->Loop(listen_fd);
     
     return (void *)0;
 }
-
-void HTTPServer::ListenAndServe(const std::string &ip, int port) {
-    curl_global_init(CURL_GLOBAL_ALL);
-    
-    signal(SIGPIPE, SIG_IGN);
     
+int HTTPServer::Listen(const std::string &ip, int port, bool reuse_port) {
     struct sockaddr_in servaddr;
     int reuse = 1;
     
-    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd_ < 0) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        MEVENT_LOG_DEBUG_EXIT(NULL);
+    }
+    
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
-    if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    if (reuse_port) {
+        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+            MEVENT_LOG_DEBUG_EXIT(NULL);
+        }
+    }
+#else
+    (void)reuse_port;//avoid unused parameter warning
+#endif
+    
+    //Accepted sockets inherit it on Linux, saving a setsockopt() per connection
+    if (setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &reuse, sizeof(reuse)) < 0) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
@@ -73,14 +120,65 @@ void HTTPServer::ListenAndServe(const std::string &ip, int port) {
         inet_pton(AF_INET, ip.c_str(), &servaddr.sin_addr);
     }
     
-    if (bind(listen_fd_, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+    if (bind(listen_fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
-    if (listen(listen_fd_, LISTENQ) < 0) {
+    if (listen(listen_fd, LISTENQ) < 0) {
         MEVENT_LOG_DEBUG_EXIT(NULL);
     }
     
+    return listen_fd;
+}
+
+//Loop i goes to node i % nodes, the loops sharing a node split its CPUs
+std::vector<std::vector<int>> HTTPServer::LoopCpuSets() {
+    std::vector<std::vector<int>> loop_cpus(worker_threads_);
+    
+    std::vector<std::vector<int>> nodes = util::GetNumaNodeCpus();
+    int nnodes = static_cast<int>(nodes.size());
+    
+    for (int n = 0; n < nnodes; n++) {
+        const std::vector<int> &cpus = nodes[n];
+        int ncpus = static_cast<int>(cpus.size());
+        int nloops = worker_threads_ / nnodes + (n < worker_threads_ % nnodes ? 1 : 0);
+        
+        for (int j = 0; j < nloops; j++) {
+            std::vector<int> &set = loop_cpus[n + j * nnodes];
+            
+            if (nloops > ncpus) {
+                set.push_back(cpus[j % ncpus]);
+            } else {
+                set.assign(cpus.begin() + j * ncpus / nloops, cpus.begin() + (j + 1) * ncpus / nloops);
+            }
+        }
+    }
+    
+    return loop_cpus;
+}
+
+void HTTPServer::ListenAndServe(const std::string &ip, int port) {
+    curl_global_init(CURL_GLOBAL_ALL);
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+#if !defined(__linux__) || !defined(SO_REUSEPORT)
+    if (reuse_port_) {
+        MEVENT_LOG_DEBUG("SO_REUSEPORT load balancing is not supported, using a shared listen socket");
+        reuse_port_ = false;
+    }
+#endif
+    
+    //Bind every socket before dropping privileges
+    std::vector<int> listen_fds;
+    if (reuse_port_) {
+        for (int i = 0; i < worker_threads_; i++) {
+            listen_fds.push_back(Listen(ip, port, true));
+        }
+    } else {
+        listen_fds.push_back(Listen(ip, port, false));
+    }
+    
     rlimit_nofile_ = worker_threads_ * max_worker_connections_;
 
     if (rlimit_nofile_ > 0) {
@@ -110,10 +208,22 @@ void HTTPServer::ListenAndServe(const std::string &ip, int port) {
         }
     }
     
+    std::vector<std::vector<int>> loop_cpus;
+    if (cpu_affinity_) {
+        loop_cpus = LoopCpuSets();
+    }
+    
     pthread_t tid;
     
     for (int i = 0; i < worker_threads_; i++) {
-        if (pthread_create(&tid, NULL, EventLoopThread, (void *)this) != 0) {
+        EventLoopThreadArg *loop_arg = new EventLoopThreadArg();
+        loop_arg->server = this;
+        loop_arg->listen_fd = listen_fds[reuse_port_ ? i : 0];
+        if (cpu_affinity_) {
+            loop_arg->cpus = loop_cpus[i];
+        }
+        
+        if (pthread_create(&tid, NULL, EventLoopThread, (void *)loop_arg) != 0) {
             MEVENT_LOG_DEBUG_EXIT(NULL);
         }
         
@@ -184,6 +294,12 @@ void HTTPServer::ListenAndServeTLS(const std::string &ip, int port, const std::s
     SSL_CTX_set_options(ssl_ctx_, SSL_OP_NO_SSLv3);
     SSL_CTX_set_options(ssl_ctx_, SSL_OP_NO_TLSv1);
     
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ktls_) {
+        SSL_CTX_set_options(ssl_ctx_, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+    
     int nid;
     EC_KEY *ecdh;
     
@@ -212,6 +328,38 @@ void HTTPServer::ListenAndServeTLS(const std::string &ip, int port, const std::s
 void HTTPServer::SetHandler(const std::string &name, HTTPHandleFunc func) {
     handler_.SetHandleFunc(name, func);
 }
+    
+void HTTPServer::SetLoopHandler(const std::string &name, HTTPHandleFunc func) {
+    handler_.SetHandleFunc(name, func, true);
+}
+
+void HTTPServer::SetStreamHandler(const std::string &name, HTTPBodyFunc body_func, HTTPHandleFunc func) {
+    handler_.SetHandleFunc(name, func, false, body_func);
+}
+
+void HTTPServer::SetMultipartHandler(const std::string &name, MultipartFunc part_func, HTTPHandleFunc func) {
+    HTTPBodyFunc body_func = [part_func](Connection *c, const char *data, size_t len) {
+        return c->Req()->FeedMultipart(part_func, data, len);
+    };
+    
+    HTTPHandleFunc done_func = [func](Connection *c) {
+        if (!c->Req()->MultipartFinished()) {
+            c->Resp()->WriteErrorMessage(400);
+            return;
+        }
+        
+        func(c);
+    };
+    
+    handler_.SetHandleFunc(name, done_func, false, body_func);
+}
+
+void HTTPServer::SetFileServer(const std::string &prefix, const std::string &root) {
+    StaticFileHandler *files = new StaticFileHandler(prefix, root);
+    file_handlers_.push_back(files);
+    
+    handler_.SetHandleFunc(prefix, std::bind(&StaticFileHandler::Serve, files, std::placeholders::_1));
+}
 
 void HTTPServer::SetRlimitNofile(int num) {
     rlimit_nofile_ = num;
@@ -244,6 +392,52 @@ void HTTPServer::SetIdleTimeout(int secs) {
     idle_timeout_ = secs;
 }
 
+void HTTPServer::SetKeepaliveTimeout(int secs) {
+    if (secs < 1) {
+        return;
+    }
+    
+    keepalive_timeout_ = secs;
+}
+
+void HTTPServer::SetMaxKeepaliveRequests(int num) {
+    if (num < 0) {
+        return;
+    }
+    
+    max_keepalive_requests_ = num;
+}
+
+void HTTPServer::SetReusePort(bool enable) {
+    reuse_port_ = enable;
+}
+
+void HTTPServer::SetRunInLoop(bool enable) {
+    run_in_loop_ = enable;
+}
+
+void HTTPServer::SetBusyPoll(int usecs) {
+    busy_poll_ = usecs < 0 ? 0 : usecs;
+}
+
+void HTTPServer::SetCpuAffinity(bool enable) {
+    cpu_affinity_ = enable;
+}
+
+void HTTPServer::SetKtls(bool enable) {
+    ktls_ = enable;
+}
+
+void HTTPServer::SetZeroCopyThreshold(size_t size) {
+    zerocopy_threshold_ = size;
+}
+
+void HTTPServer::SetWriteWatermarks(size_t low, size_t high, WriteOverflowPolicy policy) {
+    write_low_watermark_ = low;
+    write_high_watermark_ = high;
+    write_overflow_policy_ = policy;
+}
+
 void HTTPServer::SetMaxHeaderSize(size_t size) {
     max_header_size_ = size;
 }
@@ -252,6 +446,14 @@ void HTTPServer::SetMaxPostSize(size_t size) {
     max_post_size_ = size;
 }
 
+void HTTPServer::SetMaxBodySize(size_t size) {
+    max_body_size_ = size;
+}
+
+void HTTPServer::SetBodyTempDir(const std::string &dir) {
+    body_temp_dir_ = dir;
+}
+
 void HTTPServer::Daemonize(const std::string &working_dir) {
     util::Daemonize(working_dir);
 }
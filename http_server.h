@@ -2,16 +2,19 @@
 #define _HTTP_SERVER_H
 
 #include "event_loop.h"
+#include "static_file.h"
 
 #include <pthread.h>
 #include <openssl/ssl.h>
 
+#include <vector>
+
 namespace mevent {
 
 class HTTPServer {
 public:
     HTTPServer();
-    ~HTTPServer() {};
+    ~HTTPServer();
  
     void ListenAndServe(const std::string &ip, int port);
     
@@ -19,6 +22,26 @@ public:
     
     void SetHandler(const std::string &name, HTTPHandleFunc func);
     
+    //func runs on the event loop thread instead of a worker thread, it must be short and must not block
+    void SetLoopHandler(const std::string &name, HTTPHandleFunc func);
+    
+    //Request bodies are handed to body_func piece by piece as they arrive
+    //instead of being buffered, up to SetMaxBodySize(). body_func runs on the
+    //event loop thread, like a loop handler it must be short. func responds
+    //on a worker thread once the body is complete, Body() is empty then.
+    void SetStreamHandler(const std::string &name, HTTPBodyFunc body_func, HTTPHandleFunc func);
+    
+    //A stream handler for multipart/form-data bodies: part_func gets every
+    //part's body piece by piece with its name, filename and content type,
+    //so file parts can go straight to disk. It runs on the event loop
+    //thread. A malformed body, or part_func returning false, closes the
+    //connection. func responds once the closing boundary has been read, a
+    //body that ends before it gets 400.
+    void SetMultipartHandler(const std::string &name, MultipartFunc part_func, HTTPHandleFunc func);
+    
+    //Serve the files under root for paths starting with prefix, see StaticFileHandler
+    void SetFileServer(const std::string &prefix, const std::string &root);
+    
     //Settings
     void SetRlimitNofile(int num);
     void SetUser(const std::string &user);
@@ -26,31 +49,104 @@ public:
     void SetMaxWorkerConnections(int num);
     void SetIdleTimeout(int secs);
     
+    //HTTP/1.1 persistent connections: how long a connection may wait for its
+    //next request (default 15 seconds) and how many requests it serves
+    //before it is closed (default 1000, 0 turns keep-alive off)
+    void SetKeepaliveTimeout(int secs);
+    void SetMaxKeepaliveRequests(int num);
+    
+    //Give every event loop its own SO_REUSEPORT listening socket (Linux only),
+    //so the kernel spreads new connections across loops
+    void SetReusePort(bool enable);
+    
+    //Run every handler on the event loop thread (see SetLoopHandler)
+    void SetRunInLoop(bool enable);
+    
+    //Latency mode: after activity, event loops keep polling without sleeping
+    //for up to usecs before they block again, and accepted sockets get
+    //SO_BUSY_POLL. Costs a core per loop while busy. Default 0 (off)
+    void SetBusyPoll(int usecs);
+    
+    //Spread event loops over NUMA nodes and pin each loop, with its worker
+    //and WebSocket threads, to a slice of its node's CPUs (Linux only).
+    //Connection pools are then preallocated by the pinned loop thread so
+    //their memory lands on the local node
+    void SetCpuAffinity(bool enable);
+    
+    //Kernel TLS for ListenAndServeTLS (Linux with OpenSSL 3): after the
+    //handshake the kernel encrypts, so responses and static files go out
+    //with plain writes and sendfile(2). Connections whose kernel or cipher
+    //can't do it silently stay on SSL_write(). Default off
+    void SetKtls(bool enable);
+    
+    //Send response bodies and streamed chunks of at least size bytes with
+    //MSG_ZEROCOPY (Linux 4.14+, plain TCP only) instead of having the kernel
+    //copy them. Pays off for multi-MB bodies only, every such send costs a
+    //completion notification. Default 0 (off)
+    void SetZeroCopyThreshold(size_t size);
+    
+    //Bounds each connection's queue of WebSocket output (WriteString() and
+    //the *Safe() writes; control frames always pass). A message that would
+    //take the queue past high is handled by policy until it drained below
+    //low, see WebSocket::SetOnWriteFullHandler(). Default 0 (unbounded)
+    void SetWriteWatermarks(size_t low, size_t high, WriteOverflowPolicy policy = WriteOverflowPolicy::DROP);
+    
     //Default 8192 bytes
     void SetMaxPostSize(size_t size);
     
     //Default 2048 bytes
     void SetMaxHeaderSize(size_t size);
     
+    //Bodies above SetMaxPostSize() are written to an unlinked temporary
+    //file in dir instead of memory, see Request::BodyFd(). Off by default,
+    //such requests are rejected then
+    void SetBodyTempDir(const std::string &dir);
+    
+    //Limit for streamed and spooled bodies, default 1GB
+    void SetMaxBodySize(size_t size);
+    
     void Daemonize(const std::string &working_dir);
     
 private:
+    struct EventLoopThreadArg {
+        HTTPServer        *server;
+        int                listen_fd;
+        std::vector<int>   cpus;
+    };
+    
+    std::vector<std::vector<int>> LoopCpuSets();
+    
+    int Listen(const std::string &ip, int port, bool reuse_port);
+    
     static void *EventLoopThread(void *arg);
     
     static void SSLLockingCb(int mode, int type, const char* file, int line);
     static unsigned long SSLIdCb();
     
-    int          listen_fd_;
-    
     HTTPHandler  handler_;
     
+    std::vector<StaticFileHandler *>  file_handlers_;
+    
     std::string  user_;
     int          rlimit_nofile_;
     int          worker_threads_;
     int          max_worker_connections_;
     int          idle_timeout_;
+    int          keepalive_timeout_;
+    int          max_keepalive_requests_;
     size_t       max_post_size_;
     size_t       max_header_size_;
+    size_t       max_body_size_;
+    std::string  body_temp_dir_;
+    bool         reuse_port_;
+    bool         run_in_loop_;
+    int          busy_poll_;
+    bool         cpu_affinity_;
+    bool         ktls_;
+    size_t       zerocopy_threshold_;
+    size_t       write_low_watermark_;
+    size_t       write_high_watermark_;
+    WriteOverflowPolicy  write_overflow_policy_;
     
     SSL_CTX         *ssl_ctx_;
     static pthread_mutex_t *ssl_mutex_;
@@ -0,0 +1,105 @@
+#include "mailbox.h"
+#include "util.h"
+#include "lock_guard.h"
+
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+namespace mevent {
+
+Mailbox::Mailbox() : rfd_(-1), wfd_(-1) {
+    if (pthread_mutex_init(&mtx_, NULL) != 0) {
+        MEVENT_LOG_DEBUG_EXIT(NULL);
+    }
+}
+
+Mailbox::~Mailbox() {
+    if (wfd_ >= 0 && wfd_ != rfd_) {
+        close(wfd_);
+    }
+    
+    if (rfd_ >= 0) {
+        close(rfd_);
+    }
+    
+    pthread_mutex_destroy(&mtx_);
+}
+
+bool Mailbox::Open() {
+#ifdef __linux__
+    rfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rfd_ < 0) {
+        MEVENT_LOG_DEBUG(NULL);
+        return false;
+    }
+    
+    wfd_ = rfd_;
+#else
+    int fds[2];
+    if (pipe(fds) < 0) {
+        MEVENT_LOG_DEBUG(NULL);
+        return false;
+    }
+    
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    
+    rfd_ = fds[0];
+    wfd_ = fds[1];
+#endif
+    
+    return true;
+}
+
+int Mailbox::Fd() {
+    return rfd_;
+}
+
+void Mailbox::Post(MailboxItem &&item) {
+    bool wakeup;
+    
+    {
+        LockGuard lock_guard(mtx_);
+        
+        wakeup = items_.empty();
+        items_.push_back(std::move(item));
+    }
+    
+    if (wakeup) {
+        Wakeup();
+    }
+}
+
+void Mailbox::Wakeup() {
+    uint64_t one = 1;
+    
+    //EAGAIN means a wakeup is already pending, which is just as good
+#ifdef __linux__
+    ssize_t n = write(wfd_, &one, sizeof(one));
+#else
+    ssize_t n = write(wfd_, &one, 1);
+#endif
+    
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        MEVENT_LOG_DEBUG(NULL);
+    }
+}
+
+void Mailbox::Drain(std::vector<MailboxItem> &items) {
+    //Clear the fd before taking the queue: a post racing with us then leaves
+    //a spurious wakeup behind instead of a lost one
+    uint64_t buf[64];
+    while (read(rfd_, buf, sizeof(buf)) > 0) {
+    }
+    
+    LockGuard lock_guard(mtx_);
+    
+    items.swap(items_);
+}
+
+}//namespace mevent
@@ -0,0 +1,65 @@
+#ifndef _MAILBOX_H
+#define _MAILBOX_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <vector>
+#include <string>
+#include <utility>
+
+namespace mevent {
+
+class Connection;
+
+enum class MailboxCmd : uint8_t {
+    WRITE,
+    CLOSE,
+    READ
+};
+
+struct MailboxItem {
+    MailboxItem(Connection *c, uint32_t g, MailboxCmd t, std::string &&d)
+    : conn(c), gen(g), cmd(t), data(std::move(d)) {};
+    
+    Connection  *conn;
+    uint32_t     gen;
+    MailboxCmd   cmd;
+    std::string  data;
+};
+
+//Commands posted to an event loop by other threads. Post() only takes a
+//short mutex and signals the loop's wakeup fd (eventfd, or a pipe where
+//eventfd is not available) when the queue goes from empty to non-empty, so
+//a burst of posts costs the loop a single wakeup.
+class Mailbox {
+public:
+    Mailbox();
+    ~Mailbox();
+    
+    bool Open();
+    
+    //Registered with the poller by the owning loop
+    int Fd();
+    
+    void Post(MailboxItem &&item);
+    
+    //Loop thread only: clears the wakeup fd and takes every queued command
+    void Drain(std::vector<MailboxItem> &items);
+    
+private:
+    Mailbox(const Mailbox &);
+    Mailbox &operator=(const Mailbox &);
+    
+    void Wakeup();
+    
+    int                       rfd_;
+    int                       wfd_;
+    
+    pthread_mutex_t           mtx_;
+    std::vector<MailboxItem>  items_;
+};
+
+}//namespace mevent
+
+#endif
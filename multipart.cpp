@@ -0,0 +1,347 @@
+#include "multipart.h"
+#include "http_scan.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace mevent {
+
+//RFC 2046 bchars, space only inside
+static bool IsBoundaryChar(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+           || (c != '\0' && strchr("'()+_,-./:=? ", c) != NULL);
+}
+
+static StringPiece Trim(const char *begin, const char *end) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) {
+        begin++;
+    }
+    while (end > begin && (*(end - 1) == ' ' || *(end - 1) == '\t')) {
+        end--;
+    }
+    
+    return StringPiece(begin, end - begin);
+}
+
+//Calls func with the name and the (unquoted) value of each parameter of a
+//header value such as: form-data; name="field"; filename="a.jpg"
+template <typename Func>
+static void ForEachParam(const char *pos, const char *end, Func func) {
+    pos = static_cast<const char *>(memchr(pos, ';', end - pos));
+    
+    while (pos && pos < end) {
+        pos++;
+        
+        const char *eq = pos;
+        while (eq < end && *eq != '=' && *eq != ';') {
+            eq++;
+        }
+        
+        StringPiece name = Trim(pos, eq);
+        std::string value;
+        
+        pos = eq;
+        if (pos < end && *pos == '=') {
+            pos++;
+            while (pos < end && *pos == ' ') {
+                pos++;
+            }
+            
+            if (pos < end && *pos == '"') {
+                for (pos++; pos < end && *pos != '"'; pos++) {
+                    if (*pos == '\\' && pos + 1 < end) {
+                        pos++;
+                    }
+                    value.push_back(*pos);
+                }
+                pos = static_cast<const char *>(memchr(pos, ';', end - pos));
+            } else {
+                const char *semi = static_cast<const char *>(memchr(pos, ';', end - pos));
+                StringPiece v = Trim(pos, semi ? semi : end);
+                value.assign(v.Data(), v.Length());
+                pos = semi;
+            }
+        } else if (pos >= end) {
+            pos = NULL;
+        }
+        
+        if (!name.Empty()) {
+            func(name, value);
+        }
+    }
+}
+
+MultipartParser::MultipartParser() {
+    Reset();
+}
+
+void MultipartParser::Reset() {
+    func_ = nullptr;
+    state_ = State::IDLE;
+    delimiter_.clear();
+    match_ = 0;
+    header_buf_.clear();
+    
+    part_.name.clear();
+    part_.filename.clear();
+    part_.content_type.clear();
+    part_.offset = 0;
+    part_.complete = false;
+}
+
+bool MultipartParser::Begin(const StringPiece &content_type, MultipartDataFunc func) {
+    const char *begin = content_type.Data();
+    const char *end = begin + content_type.Length();
+    
+    static const StringPiece multipart("multipart/");
+    if (content_type.Length() < multipart.Length()
+        || !StringPiece(begin, multipart.Length()).EqualsIgnoreCase(multipart)) {
+        return false;
+    }
+    
+    std::string boundary;
+    ForEachParam(begin, end, [&boundary](const StringPiece &name, const std::string &value) {
+        if (name.EqualsIgnoreCase("boundary")) {
+            boundary = value;
+        }
+    });
+    
+    if (boundary.empty() || boundary.length() > 70 || boundary[boundary.length() - 1] == ' ') {
+        return false;
+    }
+    
+    for (size_t i = 0; i < boundary.length(); i++) {
+        if (!IsBoundaryChar(boundary[i])) {
+            return false;
+        }
+    }
+    
+    Reset();
+    
+    func_ = func;
+    delimiter_ = "\r\n--" + boundary;
+    
+    //The first delimiter may start the body, as if a CRLF came before it
+    state_ = State::PREAMBLE;
+    match_ = 2;
+    
+    return true;
+}
+
+bool MultipartParser::Finished() {
+    return state_ == State::EPILOGUE;
+}
+
+bool MultipartParser::Feed(const char *data, size_t len) {
+    while (len > 0) {
+        size_t n = 1;
+        
+        if (state_ == State::PREAMBLE || state_ == State::BODY) {
+            bool found;
+            n = FeedBody(data, len, &found);
+            if (found && state_ != State::ERROR) {
+                state_ = State::DELIMITER;
+            }
+        } else if (state_ == State::DELIMITER) {
+            if (*data == '-') {
+                state_ = State::CLOSE;
+            } else if (*data == '\r') {
+                state_ = State::DELIMITER_LF;
+            } else if (*data != ' ' && *data != '\t') {
+                state_ = State::ERROR;
+            }
+        } else if (state_ == State::CLOSE) {
+            state_ = *data == '-' ? State::EPILOGUE : State::ERROR;
+        } else if (state_ == State::DELIMITER_LF) {
+            if (*data == '\n') {
+                state_ = State::HEADERS;
+                header_buf_.clear();
+            } else {
+                state_ = State::ERROR;
+            }
+        } else if (state_ == State::HEADERS) {
+            n = FeedHeaders(data, len);
+        } else if (state_ == State::EPILOGUE) {
+            return true;
+        }
+        
+        if (state_ == State::ERROR || state_ == State::IDLE) {
+            return false;
+        }
+        
+        data += n;
+        len -= n;
+    }
+    
+    return true;
+}
+
+size_t MultipartParser::FeedBody(const char *data, size_t len, bool *found) {
+    const char *delim = delimiter_.data();
+    size_t delim_len = delimiter_.length();
+    
+    *found = false;
+    
+    if (match_ > 0) {
+        size_t n = std::min(delim_len - match_, len);
+        if (memcmp(data, delim + match_, n) == 0) {
+            match_ += n;
+            if (match_ == delim_len) {
+                match_ = 0;
+                *found = true;
+                Emit(NULL, 0, true);
+            }
+            return n;
+        }
+        
+        //Not a delimiter after all, what was held back is body
+        size_t held = match_;
+        match_ = 0;
+        if (!Emit(delim, held, false)) {
+            return len;
+        }
+    }
+    
+    size_t pos = HTTPFind(data, len, delim, delim_len);
+    if (pos < len) {
+        *found = true;
+        Emit(data, pos, true);
+        return pos + delim_len;
+    }
+    
+    //Hold back a delimiter that may continue in the next call
+    size_t tail = len >= delim_len ? len - delim_len + 1 : 0;
+    for (const char *cr = static_cast<const char *>(memchr(data + tail, '\r', len - tail)); cr;
+         cr = static_cast<const char *>(memchr(cr + 1, '\r', data + len - cr - 1))) {
+        size_t k = data + len - cr;
+        if (memcmp(cr, delim, k) == 0) {
+            match_ = k;
+            Emit(data, cr - data, false);
+            return len;
+        }
+    }
+    
+    Emit(data, len, false);
+    
+    return len;
+}
+
+size_t MultipartParser::FeedHeaders(const char *data, size_t len) {
+    size_t old = header_buf_.length();
+    
+    //The blank line may straddle the previous call's data
+    header_buf_.append(data, std::min(len, static_cast<size_t>(3)));
+    
+    size_t end = std::string::npos;
+    if (header_buf_.compare(0, 2, "\r\n") == 0) {
+        //No headers at all
+        end = 2;
+    } else {
+        size_t pos = header_buf_.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+        if (pos != std::string::npos) {
+            end = pos + 4;
+        }
+    }
+    
+    size_t used;
+    
+    if (end != std::string::npos) {
+        header_buf_.resize(end);
+        used = end - old;
+    } else {
+        header_buf_.resize(old);
+        
+        size_t pos = HTTPFind(data, len, "\r\n\r\n", 4);
+        used = pos < len ? pos + 4 : len;
+        
+        header_buf_.append(data, used);
+        if (pos < len) {
+            end = header_buf_.length();
+        }
+    }
+    
+    if (header_buf_.length() > MULTIPART_MAX_HEADER_SIZE) {
+        state_ = State::ERROR;
+        return used;
+    }
+    
+    if (end != std::string::npos) {
+        if (ParseHeaders()) {
+            state_ = State::BODY;
+        } else {
+            state_ = State::ERROR;
+        }
+    }
+    
+    return used;
+}
+
+bool MultipartParser::ParseHeaders() {
+    part_.name.clear();
+    part_.filename.clear();
+    part_.content_type.clear();
+    part_.offset = 0;
+    part_.complete = false;
+    
+    bool form_data = false;
+    
+    const char *pos = header_buf_.data();
+    const char *end = pos + header_buf_.length();
+    
+    while (pos < end) {
+        const char *eol = static_cast<const char *>(memchr(pos, '\n', end - pos));
+        if (!eol) {
+            eol = end;
+        }
+        
+        const char *line_end = eol;
+        if (line_end > pos && *(line_end - 1) == '\r') {
+            line_end--;
+        }
+        
+        const char *colon = static_cast<const char *>(memchr(pos, ':', line_end - pos));
+        if (colon) {
+            StringPiece name = Trim(pos, colon);
+            StringPiece value = Trim(colon + 1, line_end);
+            
+            if (name.EqualsIgnoreCase("Content-Disposition")) {
+                const char *semi = static_cast<const char *>(memchr(value.Data(), ';', value.Length()));
+                form_data = Trim(value.Data(), semi ? semi : value.Data() + value.Length()).EqualsIgnoreCase("form-data");
+                
+                ForEachParam(value.Data(), value.Data() + value.Length(), [this](const StringPiece &n, const std::string &v) {
+                    if (n.EqualsIgnoreCase("name")) {
+                        part_.name = v;
+                    } else if (n.EqualsIgnoreCase("filename")) {
+                        part_.filename = v;
+                    }
+                });
+            } else if (name.EqualsIgnoreCase("Content-Type")) {
+                part_.content_type.assign(value.Data(), value.Length());
+            }
+        }
+        
+        pos = eol + 1;
+    }
+    
+    return form_data;
+}
+
+bool MultipartParser::Emit(const char *data, size_t len, bool complete) {
+    if (state_ != State::BODY || (len == 0 && !complete)) {
+        return true;
+    }
+    
+    part_.complete = complete;
+    
+    if (!func_(part_, data, len)) {
+        state_ = State::ERROR;
+        return false;
+    }
+    
+    part_.offset += len;
+    
+    return true;
+}
+
+}//namespace mevent
@@ -0,0 +1,104 @@
+#ifndef _MULTIPART_H
+#define _MULTIPART_H
+
+#include "string_piece.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <functional>
+
+//Longest header block of a single part
+#define MULTIPART_MAX_HEADER_SIZE 8192
+
+namespace mevent {
+
+class Connection;
+
+//One part of a multipart/form-data body
+struct MultipartPart {
+    //From Content-Disposition, filename is empty unless the part is a file
+    std::string name;
+    std::string filename;
+    
+    //Empty if the part has none
+    std::string content_type;
+    
+    //Body bytes of this part handed out before the current call
+    uint64_t    offset;
+    
+    //The current call is the last one for this part
+    bool        complete;
+};
+
+//Called with each piece of a part's body as it arrives, the last call of a
+//part has complete set and may have len 0. Returning false stops parsing.
+typedef std::function<bool(const MultipartPart &part, const char *data, size_t len)> MultipartDataFunc;
+
+//Same, for HTTPServer::SetMultipartHandler()
+typedef std::function<bool(Connection *c, const MultipartPart &part, const char *data, size_t len)> MultipartFunc;
+
+//Incremental multipart/form-data parser (RFC 7578). Body bytes are handed
+//out straight from the buffers given to Feed(), only part headers are
+//copied. A delimiter split between two calls is remembered as the number of
+//its bytes matched so far, which works because '\r' can only be its first
+//byte.
+class MultipartParser {
+public:
+    MultipartParser();
+    
+    //Takes the boundary from a "multipart/form-data; boundary=..."
+    //Content-Type, false if there is none or it is invalid
+    bool Begin(const StringPiece &content_type, MultipartDataFunc func);
+    
+    //false on malformed input or when func returned false
+    bool Feed(const char *data, size_t len);
+    
+    //The closing delimiter has been seen
+    bool Finished();
+    
+    void Reset();
+
+private:
+    enum class State : uint8_t {
+        IDLE,
+        PREAMBLE,
+        //After a delimiter: "--" closes the body, otherwise optional
+        //whitespace and CRLF start the next part
+        DELIMITER,
+        CLOSE,
+        DELIMITER_LF,
+        HEADERS,
+        BODY,
+        EPILOGUE,
+        ERROR
+    };
+    
+    //Body bytes up to the next delimiter, returns how many of data were used
+    size_t FeedBody(const char *data, size_t len, bool *found);
+    
+    size_t FeedHeaders(const char *data, size_t len);
+    
+    bool ParseHeaders();
+    
+    bool Emit(const char *data, size_t len, bool complete);
+    
+    MultipartDataFunc   func_;
+    
+    State               state_;
+    
+    //"\r\n--" boundary
+    std::string         delimiter_;
+    
+    //Delimiter bytes at the end of the previous call's data
+    size_t              match_;
+    
+    std::string         header_buf_;
+    
+    MultipartPart       part_;
+};
+
+}//namespace mevent
+
+#endif
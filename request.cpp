@@ -2,10 +2,14 @@
 #include "connection.h"
 #include "util.h"
 #include "event_loop.h"
+#include "http_scan.h"
 
 #include <arpa/inet.h>
 
 #include <string.h>
+#include <errno.h>
+
+#include <algorithm>
 
 namespace mevent {
     
@@ -86,8 +90,9 @@ static const uint8_t normal_url_char[32] = {
     
 #define CONTENT_LENGTH      "content-length"
 #define UPGRADE             "upgrade"
-#define SEC_WEBSOCKET_KEY   "sec-websocket-key"
 #define CONTENT_TYPE        "content-type"
+#define CONNECTION          "connection"
+#define TRANSFER_ENCODING   "transfer-encoding"
     
 #define METHOD_GET            "get"
 #define METHOD_POST           "post"
@@ -111,92 +116,107 @@ static const uint8_t normal_url_char[32] = {
 #define IS_URL_CHAR(c)      (BIT_AT(normal_url_char, (unsigned char)c))
 
     
-#define READ_BUFFER_SIZE 2048
-
-Request::Request(Connection *conn) : conn_(conn) {
+Request::Request(Connection *conn)
+    : conn_(conn),
+      header_fields_(FieldList::allocator_type(&conn->arena_)),
+      get_fields_(FieldList::allocator_type(&conn->arena_)),
+      post_fields_(FieldList::allocator_type(&conn->arena_)) {
+    body_fd_ = -1;
+    multipart_ = NULL;
+    
     Reset();
 }
     
+Request::~Request() {
+    delete multipart_;
+}
+    
 void Request::ParseHeader() {
-    char *pos = strchr(const_cast<char *>(rbuf_.c_str()), '\n');
-    bool is_field = true;
-
-    std::string field;
-    std::string value;
-    for (; *pos; pos++) {
-        if (*pos == ':' && is_field) {
-            is_field = false;
-            continue;
-        } else if (*pos == '\r') {
-            continue;
-        } else if (*pos == '\n') {
-            if (!field.empty() && !value.empty()) {
-                header_map_[field] = value;
-            }
-            field.clear();
-            value.clear();
-            is_field = true;
-            continue;
-        }
+}
+    
+StringPiece Request::Header(const StringPiece &field) {
+    const char *data = rbuf_.Data();
+    
+    for (size_t i = 0; i < header_fields_.size(); i++) {
+        const FieldSpan &f = header_fields_[i];
         
-        if (is_field) {
-            field.push_back(*pos);
-        } else {
-            if (value.empty() && *pos == ' ') { //trim
-                continue;
-            }
-            value.push_back(*pos);
+        if (f.name_len == field.Length() && field.EqualsIgnoreCase(StringPiece(data + f.name, f.name_len))) {
+            return StringPiece(data + f.value, f.value_len);
         }
     }
+    
+    return StringPiece();
 }
     
 std::string Request::HeaderValue(const std::string &field) {
-    std::string value;
-    
-    auto it = header_map_.find(field);
-    if (it != header_map_.end()) {
-        value = it->second;
-    }
-    
-    return value;
+    return Header(field).ToString();
 }
     
 void Request::ParseQueryString() {
-    if (query_string_.empty()) {
-        return;
+    if (!get_indexed_) {
+        IndexForm(get_fields_, query_string_.data(), query_string_.length());
+        get_indexed_ = true;
     }
+}
     
-    ParseFormUrlencoded(get_form_map_, query_string_);
+void Request::ParsePostForm() {
+    if (!post_indexed_) {
+        const char *data = PostFormData();
+        if (data) {
+            IndexForm(post_fields_, data, content_length_);
+        }
+        post_indexed_ = true;
+    }
 }
     
 std::string Request::QueryStringValue(const std::string &field) {
-    std::string value;
+    ParseQueryString();
+    return DecodeValue(query_string_.data(), FindFormField(get_fields_, query_string_.data(), field, SIZE_MAX));
+}
     
-    auto it = get_form_map_.find(field);
-    if (it != get_form_map_.end()) {
-        value = it->second;
-    }
+std::string Request::PostFormValue(const std::string &field) {
+    ParsePostForm();
+    return DecodeValue(PostFormData(), FindFormField(post_fields_, PostFormData(), field, SIZE_MAX));
+}
     
-    return value;
+bool Request::QueryStringValue(const StringPiece &field, StringPiece *value, size_t nth) {
+    ParseQueryString();
+    return DecodeValue(query_string_.data(), FindFormField(get_fields_, query_string_.data(), field, nth), value);
 }
     
-void Request::ParsePostForm() {
-    if (content_type_ != "application/x-www-form-urlencoded") {
-        return;
-    }
+bool Request::PostFormValue(const StringPiece &field, StringPiece *value, size_t nth) {
+    ParsePostForm();
+    return DecodeValue(PostFormData(), FindFormField(post_fields_, PostFormData(), field, nth), value);
+}
     
-    ParseFormUrlencoded(post_form_map_, rbuf_.substr(header_len_));
+size_t Request::QueryStringCount(const StringPiece &field) {
+    ParseQueryString();
+    return CountFormField(get_fields_, query_string_.data(), field);
 }
     
-std::string Request::PostFormValue(const std::string &field) {
-    std::string value;
+size_t Request::PostFormCount(const StringPiece &field) {
+    ParsePostForm();
+    return CountFormField(post_fields_, PostFormData(), field);
+}
     
-    auto it = post_form_map_.find(field);
-    if (it != post_form_map_.end()) {
-        value = it->second;
+const char *Request::PostFormData() {
+    if (BodyDetached() || content_length_ == 0) {
+        return NULL;
     }
     
-    return value;
+    //Parameters such as "; charset=UTF-8" do not matter
+    StringPiece type = Header(CONTENT_TYPE);
+    const char *end = static_cast<const char *>(memchr(type.Data(), ';', type.Length()));
+    size_t len = end ? end - type.Data() : type.Length();
+    while (len > 0 && type[len - 1] == ' ') {
+        len--;
+    }
+    
+    if (!StringPiece(type.Data(), len).EqualsIgnoreCase("application/x-www-form-urlencoded")) {
+        return NULL;
+    }
+    
+    return rbuf_.Data() + header_len_;
 }
     
 uint32_t Request::ContentLength() {
@@ -204,7 +224,32 @@ uint32_t Request::ContentLength() {
 }
     
 std::string Request::Body() {
-    return rbuf_.substr(header_len_);
+    if (body_fd_ >= 0) {
+        std::string body(content_length_, '\0');
+        
+        size_t n = 0;
+        while (n < body.length()) {
+            ssize_t ret = pread(body_fd_, &body[n], body.length() - n, n);
+            if (ret <= 0) {
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                body.resize(n);
+                break;
+            }
+            n += ret;
+        }
+        
+        return body;
+    } else if (body_func_) {
+        return std::string();
+    }
+    
+    return std::string(rbuf_.Data() + header_len_, content_length_);
+}
+    
+int Request::BodyFd() {
+    return body_fd_;
 }
     
 std::string Request::Path() {
@@ -219,65 +264,162 @@ RequestMethod Request::Method() {
     return method_;
 }
     
+int Request::HTTPMajor() {
+    return http_major_;
+}
+    
+int Request::HTTPMinor() {
+    return http_minor_;
+}
+    
+bool Request::KeepAlive() {
+    if (http_major_ > 1 || (http_major_ == 1 && http_minor_ > 0)) {
+        return !connection_close_;
+    }
+    
+    return connection_keep_alive_;
+}
+    
 std::string Request::RemoteAddr() {
+    //Connections the io_uring accepted come without the address
+    if (addr_.s_addr == INADDR_ANY && conn_->fd_ >= 0) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        
+        if (getpeername(conn_->fd_, (struct sockaddr *)&addr, &len) == 0 && addr.sin_family == AF_INET) {
+            addr_ = addr.sin_addr;
+        }
+    }
+    
     char buf[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &addr_, buf, INET_ADDRSTRLEN);
     return std::string(buf);
 }
     
-void Request::ParseFormUrlencoded(std::map<std::string, std::string> &m, const std::string &str) {
-    bool is_field = true;
+//Only records where each pair is, keys are compared and values decoded on
+//access. A pair without '=' has an empty value.
+void Request::IndexForm(FieldList &fields, const char *str, size_t len) {
+    const char *pos = str;
+    const char *end = str + len;
     
-    std::string field;
-    std::string value;
-    const char *pos = str.c_str();
-    for (; *pos; pos++) {
-        if (*pos == '=') {
-            is_field = false;
-            continue;
-        } else if (*pos == '&') {
-            if (!field.empty() && !value.empty()) {
-                m[field] = util::URLDecode(value);
-            }
-            field.clear();
-            value.clear();
-            is_field = true;
-            continue;
+    fields.reserve(std::count(pos, end, '&') + 1);
+    
+    while (pos < end) {
+        const char *amp = static_cast<const char *>(memchr(pos, '&', end - pos));
+        if (!amp) {
+            amp = end;
         }
         
-        if (is_field) {
-            field.push_back(*pos);
-        } else {
-            value.push_back(*pos);
+        const char *eq = static_cast<const char *>(memchr(pos, '=', amp - pos));
+        if (!eq) {
+            eq = amp;
+        }
+        
+        if (eq > pos) {
+            FieldSpan f;
+            f.name = pos - str;
+            f.name_len = eq - pos;
+            f.value = eq < amp ? eq + 1 - str : amp - str;
+            f.value_len = amp - str - f.value;
+            fields.push_back(f);
+        }
+        
+        pos = amp + 1;
+    }
+}
+    
+const FieldSpan *Request::FindFormField(const FieldList &fields, const char *str, const StringPiece &field, size_t nth) {
+    const FieldSpan *last = NULL;
+    
+    for (size_t i = 0; i < fields.size(); i++) {
+        const FieldSpan &f = fields[i];
+        
+        if (StringPiece(str + f.name, f.name_len) == field) {
+            if (nth == 0) {
+                return &f;
+            } else if (nth != SIZE_MAX) {
+                nth--;
+            }
+            last = &f;
+        }
+    }
+    
+    return nth == SIZE_MAX ? last : NULL;
+}
+    
+size_t Request::CountFormField(const FieldList &fields, const char *str, const StringPiece &field) {
+    size_t n = 0;
+    
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (StringPiece(str + fields[i].name, fields[i].name_len) == field) {
+            n++;
         }
     }
     
-    if (!field.empty() && !value.empty()) {
-        m[field] = util::URLDecode(value);
+    return n;
+}
+    
+bool Request::DecodeValue(const char *str, const FieldSpan *f, StringPiece *value) {
+    if (!f) {
+        return false;
     }
+    
+    const char *raw = str + f->value;
+    
+    if (!memchr(raw, '%', f->value_len) && !memchr(raw, '+', f->value_len)) {
+        *value = StringPiece(raw, f->value_len);
+    } else {
+        char *buf = static_cast<char *>(conn_->arena_.Allocate(f->value_len, 1));
+        *value = StringPiece(buf, util::URLDecode(raw, f->value_len, buf));
+    }
+    
+    return true;
+}
+    
+std::string Request::DecodeValue(const char *str, const FieldSpan *f) {
+    std::string value;
+    
+    if (f) {
+        value.resize(f->value_len);
+        value.resize(util::URLDecode(str + f->value, f->value_len, &value[0]));
+    }
+    
+    return value;
 }
 
+//Keeps string capacity for the next request, the parser bounds every field
+//by max_header_size_. Map nodes and the header index live in the
+//connection's arena, which is rewound right after this by Connection::Reset().
 void Request::Reset() {
     status_ = RequestStatus::HEADER_RECEIVING;
     
     bzero(&addr_, sizeof(addr_));
     
-    rbuf_.clear();
-    std::string().swap(rbuf_);
+    rbuf_.Release();
     rbuf_len_ = 0;
     
     method_ = RequestMethod::UNKNOWN;
     
     path_.clear();
-    std::string().swap(path_);
     query_string_.clear();
-    std::string().swap(query_string_);
+    
+    http_major_ = 0;
+    http_minor_ = 0;
+    
+    connection_close_ = false;
+    connection_keep_alive_ = false;
     
     content_length_ = 0;
+    has_content_length_ = false;
+    transfer_encoding_ = false;
     header_len_ = 0;
     
-    content_type_.clear();
-    std::string().swap(content_type_);
+    body_func_ = nullptr;
+    if (body_fd_ >= 0) {
+        close(body_fd_);
+        body_fd_ = -1;
+    }
+    body_read_ = 0;
     
     parse_status_ = RequestParseStatus::S_START;
     parse_offset_ = 0;
@@ -285,99 +427,257 @@ void Request::Reset() {
     
     error_code_ = 0;
     
-    sec_websocket_key_.clear();
-    std::string().swap(sec_websocket_key_);
+    //Swapped out rather than cleared, the arena is rewound under it
+    FieldList(header_fields_.get_allocator()).swap(header_fields_);
+    field_open_ = false;
     
-    header_map_.clear();
-    std::map<std::string, std::string>().swap(header_map_);
-    get_form_map_.clear();
-    std::map<std::string, std::string>().swap(get_form_map_);
-    post_form_map_.clear();
-    std::map<std::string, std::string>().swap(post_form_map_);
+    FieldList(get_fields_.get_allocator()).swap(get_fields_);
+    FieldList(post_fields_.get_allocator()).swap(post_fields_);
+    get_indexed_ = false;
+    post_indexed_ = false;
+    
+    if (multipart_) {
+        multipart_->Reset();
+    }
 }
     
-void Request::Keepalive()
-{
-    status_ = RequestStatus::HEADER_RECEIVING;
-    rbuf_.clear();
-    rbuf_len_ = 0;
+//Next request on the same connection. Only the peer address and pipelined
+//bytes already read behind this request survive, see Advance().
+void Request::Keepalive() {
+    struct in_addr addr = addr_;
+    
+    uint32_t used = header_len_ + (BodyDetached() ? 0 : content_length_);
+    uint32_t left = rbuf_len_ > used ? rbuf_len_ - used : 0;
+    
+    ReadBuffer rbuf;
+    if (left > 0) {
+        rbuf_.Erase(rbuf_len_, 0, used);
+        rbuf.Swap(rbuf_);
+    }
+    
+    Reset();
+    
+    if (left > 0) {
+        rbuf_.Swap(rbuf);
+        rbuf_len_ = left;
+    }
+    
+    addr_ = addr;
 }
     
 ConnStatus Request::ReadData() {
-    char buf[READ_BUFFER_SIZE];
     ssize_t n = 0;
+    bool drained = false;
+    
+    //The previous request is still being handled. Whatever the client sent
+    //next stays in the socket until EventLoop::KeepAlive() re-arms it.
+    //After an error response nothing is read anymore, the connection closes
+    //once it is written.
+    if (status_ == RequestStatus::BODY_RECEIVED || error_code_ != 0) {
+        return ConnStatus::AGAIN;
+    }
     
     if (status_ != RequestStatus::HEADER_RECEIVING && status_ != RequestStatus::BODY_RECEIVING) {
         return ConnStatus::ERROR;
     }
     
-    if (status_ == RequestStatus::HEADER_RECEIVING) {
-        do {
-            n = conn_->Readn(buf, READ_BUFFER_SIZE);
-            if (n > 0) {
-                rbuf_len_ += n;
-                if (rbuf_len_ > conn_->elp_->max_header_size_) {
-                    error_code_ = 500;
-                    return ConnStatus::ERROR;
-                }
-                
-                rbuf_.append(buf, n);
-                
-                HTTPParserStatus parse_status = Parse();
-                if (parse_status == HTTPParserStatus::FINISHED) {
-                    status_ = RequestStatus::BODY_RECEIVING;
-                    break;
-                } else if (parse_status == HTTPParserStatus::ERROR) {
-                    error_code_ = 400;
-                    return ConnStatus::ERROR;
-                }
-            } else if (n < 0) {
-                return ConnStatus::CLOSE;
-            } else {
+    do {
+        if (body_fd_ >= 0 && rbuf_len_ == header_len_ && !conn_->ssl_ && !conn_->ring_io_ && conn_->elp_->SplicePipe()) {
+            ConnStatus status = SpliceBody();
+            if (status != ConnStatus::AGAIN) {
+                return status;
+            }
+            break;
+        }
+        
+        n = conn_->ReadInto(rbuf_, rbuf_len_, &drained);
+        if (n > 0) {
+            rbuf_len_ += n;
+            
+            ConnStatus status = Advance();
+            if (status != ConnStatus::AGAIN) {
+                return status;
+            }
+            
+            if (status_ == RequestStatus::BODY_RECEIVED) {
                 break;
             }
-        } while (n == READ_BUFFER_SIZE);
+        } else if (n < 0) {
+            return ConnStatus::CLOSE;
+        } else {
+            break;
+        }
+    } while (!drained);
+    
+    //Nothing unprocessed, e.g. the client closed a keep-alive connection
+    if (rbuf_len_ == 0) {
+        rbuf_.Release();
     }
     
-    if (status_ == RequestStatus::BODY_RECEIVING) {
-        if (content_length_ > conn_->elp_->max_post_size_) {
+    if (status_ == RequestStatus::BODY_RECEIVED) {
+        conn_->TaskPush();
+    }
+    
+    return ConnStatus::AGAIN;
+}
+    
+//rbuf_ may hold more than one request: bytes behind header_len_ +
+//content_length_ belong to the next one and are kept by Keepalive()
+ConnStatus Request::Advance() {
+    if (status_ == RequestStatus::HEADER_RECEIVING) {
+        HTTPParserStatus parse_status = Parse();
+        if (parse_status == HTTPParserStatus::ERROR) {
+            error_code_ = 400;
+            return ConnStatus::ERROR;
+        }
+        
+        size_t header_len = parse_status == HTTPParserStatus::FINISHED ? header_len_ : rbuf_len_;
+        if (header_len > conn_->elp_->max_header_size_) {
             error_code_ = 500;
             return ConnStatus::ERROR;
         }
         
+        if (parse_status != HTTPParserStatus::FINISHED) {
+            return ConnStatus::AGAIN;
+        }
+        
+        //Read by its Content-Length, or as having none, a chunked body
+        //would pass for the next request (RFC 7230 3.3.3)
+        if (transfer_encoding_) {
+            error_code_ = has_content_length_ ? 400 : 501;
+            return ConnStatus::ERROR;
+        }
+        
+        status_ = RequestStatus::BODY_RECEIVING;
+        
+        ConnStatus status = BeginBody();
+        if (status != ConnStatus::AGAIN) {
+            return status;
+        }
+    }
+    
+    if (status_ == RequestStatus::BODY_RECEIVING) {
+        if (BodyDetached()) {
+            return ConsumeBody();
+        }
+        
         if (rbuf_len_ - header_len_ >= content_length_) {
             status_ = RequestStatus::BODY_RECEIVED;
+        }
+    }
+    
+    return ConnStatus::AGAIN;
+}
+    
+bool Request::Pipelined() {
+    return rbuf_len_ > header_len_ + (BodyDetached() ? 0 : content_length_);
+}
+    
+bool Request::BodyDetached() {
+    return body_func_ || body_fd_ >= 0;
+}
+    
+ConnStatus Request::BeginBody() {
+    EventLoop *elp = conn_->elp_;
+    
+    if (content_length_ == 0) {
+        return ConnStatus::AGAIN;
+    }
+    
+    if (elp->handler_->HasBodyHandlers()) {
+        body_func_ = elp->handler_->GetBodyFunc(path_);
+    }
+    
+    if (!body_func_ && content_length_ <= elp->max_post_size_) {
+        return ConnStatus::AGAIN;
+    }
+    
+    if (content_length_ > elp->max_body_size_ || (!body_func_ && elp->body_temp_dir_.empty())) {
+        error_code_ = 500;
+        return ConnStatus::ERROR;
+    }
+    
+    if (!body_func_) {
+        body_fd_ = util::OpenTempFile(elp->body_temp_dir_);
+        if (body_fd_ < 0) {
+            MEVENT_LOG_DEBUG(NULL);
+            error_code_ = 500;
+            return ConnStatus::ERROR;
+        }
+    }
+    
+    return ConnStatus::AGAIN;
+}
+    
+//Consumed bytes are cut out of rbuf_, so a large body never piles up there
+ConnStatus Request::ConsumeBody() {
+    uint32_t n = std::min(rbuf_len_ - static_cast<uint32_t>(header_len_), content_length_ - body_read_);
+    
+    if (n > 0) {
+        const char *data = rbuf_.Data() + header_len_;
+        
+        if (body_func_) {
+            if (!body_func_(conn_, data, n)) {
+                return ConnStatus::CLOSE;
+            }
         } else {
-            do {
-                n = conn_->Readn(buf, READ_BUFFER_SIZE);
-                if (n > 0) {
-                    rbuf_len_ += n;
-                    rbuf_.append(buf, n);
-                    
-                    if (rbuf_len_ - header_len_ >= content_length_) {
-                        status_ = RequestStatus::BODY_RECEIVED;
-                        break;
+            for (uint32_t written = 0; written < n; ) {
+                ssize_t ret = pwrite(body_fd_, data + written, n - written, body_read_ + written);
+                if (ret < 0) {
+                    if (errno == EINTR) {
+                        continue;
                     }
-                } else if (n < 0) {
-                    return ConnStatus::CLOSE;
-                } else {
-                    break;
+                    MEVENT_LOG_DEBUG(NULL);
+                    error_code_ = 500;
+                    return ConnStatus::ERROR;
                 }
-            } while (n == READ_BUFFER_SIZE);
+                written += ret;
+            }
         }
+        
+        rbuf_.Erase(rbuf_len_, header_len_, n);
+        rbuf_len_ -= n;
+        body_read_ += n;
     }
     
-    if (status_ == RequestStatus::BODY_RECEIVED) {
-        conn_->TaskPush();
+    if (body_read_ == content_length_) {
+        if (body_fd_ >= 0) {
+            lseek(body_fd_, 0, SEEK_SET);
+        }
+        
+        status_ = RequestStatus::BODY_RECEIVED;
     }
     
     return ConnStatus::AGAIN;
 }
     
+//Plain TCP uploads are spooled with splice(2), the bytes never enter rbuf_
+ConnStatus Request::SpliceBody() {
+    while (body_read_ < content_length_) {
+        ssize_t n = conn_->SpliceTo(body_fd_, body_read_, content_length_ - body_read_);
+        if (n < 0) {
+            return ConnStatus::CLOSE;
+        } else if (n == 0) {
+            return ConnStatus::AGAIN;
+        }
+        
+        body_read_ += n;
+    }
+    
+    return ConsumeBody();
+}
+    
 HTTPParserStatus Request::Parse() {
     HTTPParserStatus status = HTTPParserStatus::CONTINUE;
     
     while (parse_offset_ < rbuf_len_) {
+        //Plain bytes are taken a run at a time, only the byte that ends the
+        //run goes through the state machine below
+        parse_offset_ += ScanRun();
+        if (parse_offset_ == rbuf_len_) {
+            break;
+        }
+        
         char ch = rbuf_[parse_offset_];
         
         char c = TOKEN(ch);
@@ -389,12 +689,18 @@ HTTPParserStatus Request::Parse() {
         if (parse_status_ == RequestParseStatus::S_EOL) {
             if (c == LF) {
                 if (rbuf_[parse_offset_ - 1] == CR) {
+                    EndField(parse_offset_ - 1);
                     parse_status_ = RequestParseStatus::S_HEADER_FIELD;
-                    parse_match_ = parse_offset_;
                 } else {
                     status = HTTPParserStatus::ERROR;
                     break;
                 }
+            } else if (c == CR && parse_offset_ + 1 < rbuf_len_ && rbuf_[parse_offset_ + 1] == LF) {
+                //The usual line end, taken in one step
+                EndField(parse_offset_);
+                parse_status_ = RequestParseStatus::S_HEADER_FIELD;
+                parse_offset_ += 2;
+                continue;
             }
         } else if (parse_status_ == RequestParseStatus::S_START) {
             parse_status_ = RequestParseStatus::S_METHOD;
@@ -491,7 +797,8 @@ HTTPParserStatus Request::Parse() {
                 }
             } else {
                 if (!path_.empty()) {
-                    parse_status_ = RequestParseStatus::S_EOL;
+                    parse_status_ = RequestParseStatus::S_VERSION;
+                    parse_match_ = parse_offset_ + 1;
                 } else {
                     status = HTTPParserStatus::ERROR;
                     break;
@@ -506,42 +813,63 @@ HTTPParserStatus Request::Parse() {
                     break;
                 }
             } else {
+                parse_status_ = RequestParseStatus::S_VERSION;
+                parse_match_ = parse_offset_ + 1;
+            }
+        } else if (parse_status_ == RequestParseStatus::S_VERSION) {
+            if (c == CR) {
+                //"HTTP/x.y"
+                if (parse_offset_ - parse_match_ != 8
+                    || !MatchToken(parse_match_, 5, "http/")
+                    || !IS_NUM(rbuf_[parse_match_ + 5])
+                    || rbuf_[parse_match_ + 6] != '.'
+                    || !IS_NUM(rbuf_[parse_match_ + 7])) {
+                    status = HTTPParserStatus::ERROR;
+                    break;
+                }
+                
+                http_major_ = rbuf_[parse_match_ + 5] - '0';
+                http_minor_ = rbuf_[parse_match_ + 7] - '0';
+                
                 parse_status_ = RequestParseStatus::S_EOL;
             }
         } else if (parse_status_ == RequestParseStatus::S_HEADER_FIELD) {
             if (c == CR) {
                 parse_status_ = RequestParseStatus::S_EOH;
-            } else if (c == 'c') {
-                if (rbuf_len_ - parse_offset_ < 9) {
-                    parse_offset_++;
-                    continue;
+            } else {
+                //The name is compared as a whole, wait until its ':' is in
+                size_t avail = rbuf_len_ - parse_offset_;
+                size_t len = HTTPScan(rbuf_.Data() + parse_offset_, avail, HTTPScanStop::FIELD);
+                if (len == avail) {
+                    break;
                 }
                 
-                if (TOKEN(rbuf_[parse_offset_ + 1]) == 'o'
-                    && TOKEN(rbuf_[parse_offset_ + 2]) == 'n'
-                    && TOKEN(rbuf_[parse_offset_ + 3]) == 't'
-                    && TOKEN(rbuf_[parse_offset_ + 4]) == 'e'
-                    && TOKEN(rbuf_[parse_offset_ + 5]) == 'n'
-                    && TOKEN(rbuf_[parse_offset_ + 6]) == 't'
-                    && TOKEN(rbuf_[parse_offset_ + 7]) == '-') {
+                if (rbuf_[parse_offset_ + len] == ':') {
+                    //No whitespace allowed before the ':' (RFC 7230 3.2.4)
+                    if (len > 0 && rbuf_[parse_offset_ + len - 1] == ' ') {
+                        status = HTTPParserStatus::ERROR;
+                        break;
+                    }
                     
-                    if (TOKEN(rbuf_[parse_offset_ + 8]) == 'l') {
-                        parse_status_ = RequestParseStatus::S_CONTENT_LENGTH;
-                        parse_match_ = parse_offset_;
-                    } else if (TOKEN(rbuf_[parse_offset_ + 8]) == 't') {
-                        parse_status_ = RequestParseStatus::S_CONTENT_TYPE;
-                        parse_match_ = parse_offset_;
-                    } else {
-                        parse_status_ = RequestParseStatus::S_EOL;
+                    FieldSpan field;
+                    field.name = parse_offset_;
+                    field.name_len = len;
+                    field.value = parse_offset_ + len + 1;
+                    field.value_len = 0;
+                    
+                    if (header_fields_.empty()) {
+                        header_fields_.reserve(16);
                     }
+                    header_fields_.push_back(field);
+                    field_open_ = true;
+                    
+                    parse_status_ = FieldStatus(rbuf_.Data() + parse_offset_, len);
+                    parse_offset_ += len + 1;
                 } else {
                     parse_status_ = RequestParseStatus::S_EOL;
+                    parse_offset_ += len;
                 }
-            } else if (c == 's') {
-                parse_status_ = RequestParseStatus::S_SEC_WEBSOCKET_KEY;
-                parse_match_ = parse_offset_;
-            } else {
-                parse_status_ = RequestParseStatus::S_EOL;
+                continue;
             }
         } else if (parse_status_ == RequestParseStatus::S_EOH) {
             if (c == LF) {
@@ -552,65 +880,56 @@ HTTPParserStatus Request::Parse() {
             }
             break;
         } else if (parse_status_ == RequestParseStatus::S_CONTENT_LENGTH) {
-            if (parse_offset_ - parse_match_ > 13) {
-                if (c != ' ' && c != ':') {
-                    parse_status_ = RequestParseStatus::S_CONTNET_LENGTH_V;
-                    parse_match_ = parse_offset_;
-                    continue;
-                }
-            } else {
-                if (CONTENT_LENGTH[parse_offset_ - parse_match_] != c) {
-                    parse_status_ = RequestParseStatus::S_EOL;
-                }
+            //Whitespace after the ':'
+            if (c != ' ') {
+                parse_status_ = RequestParseStatus::S_CONTNET_LENGTH_V;
+                parse_match_ = parse_offset_;
+                continue;
             }
         } else if (parse_status_ == RequestParseStatus::S_CONTNET_LENGTH_V) {
             if (c == ' ' || c == CR) {
-                parse_status_ = RequestParseStatus::S_EOL;
-            } else {
-                if (!IS_NUM(c)) {
+                if (!SetContentLength(parse_match_, parse_offset_)) {
                     status = HTTPParserStatus::ERROR;
                     break;
                 }
                 
-                content_length_ *= 10;
-                content_length_ += c - '0';
-            }
-        } else if (parse_status_ == RequestParseStatus::S_SEC_WEBSOCKET_KEY) {
-            if (parse_offset_ - parse_match_ > 16) {
-                if (c != ' ' && c != ':') {
-                    parse_status_ = RequestParseStatus::S_SEC_WEBSOCKET_KEY_V;
-                    parse_match_ = parse_offset_;
-                    continue;
-                }
-            } else {
-                if (SEC_WEBSOCKET_KEY[parse_offset_ - parse_match_] != c) {
-                    parse_status_ = RequestParseStatus::S_EOL;
-                }
+                parse_status_ = c == CR ? RequestParseStatus::S_EOL : RequestParseStatus::S_CONTENT_LENGTH_OWS;
+            } else if (!IS_NUM(c)) {
+                status = HTTPParserStatus::ERROR;
+                break;
             }
-        } else if (parse_status_ == RequestParseStatus::S_SEC_WEBSOCKET_KEY_V) {
-            if (c == ' ' || c == CR) {
+        } else if (parse_status_ == RequestParseStatus::S_CONTENT_LENGTH_OWS) {
+            //Only whitespace may follow the digits
+            if (c == CR) {
                 parse_status_ = RequestParseStatus::S_EOL;
-            } else {
-                sec_websocket_key_.push_back(ch);
+            } else if (c != ' ') {
+                status = HTTPParserStatus::ERROR;
+                break;
             }
-        } else if (parse_status_ == RequestParseStatus::S_CONTENT_TYPE) {
-            if (parse_offset_ - parse_match_ > 11) {
-                if (c != ' ' && c != ':') {
-                    parse_status_ = RequestParseStatus::S_CONTENT_TYPE_V;
-                    parse_match_ = parse_offset_;
-                    continue;
+        } else if (parse_status_ == RequestParseStatus::S_CONNECTION) {
+            //Whitespace after the ':'
+            if (c != ' ') {
+                parse_status_ = RequestParseStatus::S_CONNECTION_V;
+                parse_match_ = parse_offset_;
+                continue;
+            }
+        } else if (parse_status_ == RequestParseStatus::S_CONNECTION_V) {
+            //Comma separated, e.g. "keep-alive, Upgrade"
+            if (c == ',' || c == ' ' || c == CR) {
+                uint32_t len = parse_offset_ - parse_match_;
+                
+                if (len == 5 && MatchToken(parse_match_, len, "close")) {
+                    connection_close_ = true;
+                } else if (len == 10 && MatchToken(parse_match_, len, "keep-alive")) {
+                    connection_keep_alive_ = true;
                 }
-            } else {
-                if (CONTENT_TYPE[parse_offset_ - parse_match_] != c) {
+                
+                parse_match_ = parse_offset_ + 1;
+                
+                if (c == CR) {
                     parse_status_ = RequestParseStatus::S_EOL;
                 }
             }
-        } else if (parse_status_ == RequestParseStatus::S_CONTENT_TYPE_V) {
-            if (c == ' ' || c == CR) {
-                parse_status_ = RequestParseStatus::S_EOL;
-            } else {
-                content_type_.push_back(ch);
-            }
         }
         
         parse_offset_++;
@@ -619,4 +938,153 @@ HTTPParserStatus Request::Parse() {
     return status;
 }
     
+//Length of the run at parse_offset_ that the current state passes over or
+//copies without looking at the bytes one by one
+uint32_t Request::ScanRun() {
+    const char *p = rbuf_.Data() + parse_offset_;
+    size_t avail = rbuf_len_ - parse_offset_;
+    size_t len = 0;
+    
+    switch (parse_status_) {
+        case RequestParseStatus::S_EOL:
+        case RequestParseStatus::S_VERSION:
+            len = HTTPScan(p, avail, HTTPScanStop::LINE);
+            break;
+        case RequestParseStatus::S_PATH:
+            len = HTTPScan(p, avail, HTTPScanStop::URL);
+            path_.append(p, len);
+            break;
+        case RequestParseStatus::S_QUERY_STRING:
+            len = HTTPScan(p, avail, HTTPScanStop::URL);
+            query_string_.append(p, len);
+            break;
+        default:
+            break;
+    }
+    
+    return static_cast<uint32_t>(len);
+}
+    
+//Compares eight bytes at a time, name is lower case. Scanned field names
+//only hold token characters, where setting bit 5 lowers exactly the letters.
+static bool MatchFieldName(const char *p, size_t len, const char *name, size_t name_len) {
+    static const uint64_t lower = 0x2020202020202020ULL;
+    
+    if (len != name_len || len < 8) {
+        return false;
+    }
+    
+    uint64_t a, b;
+    
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        memcpy(&a, p + i, 8);
+        memcpy(&b, name + i, 8);
+        if ((a | lower) != b) {
+            return false;
+        }
+    }
+    
+    //The last word overlaps the one before it
+    memcpy(&a, p + len - 8, 8);
+    memcpy(&b, name + len - 8, 8);
+    
+    return (a | lower) == b;
+}
+    
+#define MATCH_FIELD(p, len, name) MatchFieldName(p, len, name, sizeof(name) - 1)
+    
+//State for the value of the header field named by p, S_EOL for those the
+//parser does not look at
+RequestParseStatus Request::FieldStatus(const char *p, size_t len) {
+    if (MATCH_FIELD(p, len, CONTENT_LENGTH)) {
+        return RequestParseStatus::S_CONTENT_LENGTH;
+    } else if (MATCH_FIELD(p, len, CONNECTION)) {
+        return RequestParseStatus::S_CONNECTION;
+    } else if (MATCH_FIELD(p, len, TRANSFER_ENCODING)) {
+        transfer_encoding_ = true;
+    }
+    
+    return RequestParseStatus::S_EOL;
+}
+    
+void Request::EndField(uint32_t cr) {
+    if (!field_open_) {
+        return;
+    }
+    
+    FieldSpan &field = header_fields_.back();
+    
+    uint32_t begin = field.value;
+    uint32_t end = cr;
+    
+    while (begin < end && rbuf_[begin] == ' ') {
+        begin++;
+    }
+    while (end > begin && rbuf_[end - 1] == ' ') {
+        end--;
+    }
+    
+    field.value = begin;
+    field.value_len = end - begin;
+    
+    field_open_ = false;
+}
+    
+bool Request::SetContentLength(uint32_t begin, uint32_t end) {
+    if (begin == end) {
+        return false;
+    }
+    
+    uint64_t value = 0;
+    
+    for (uint32_t i = begin; i < end; i++) {
+        value = value * 10 + (rbuf_[i] - '0');
+        if (value > UINT32_MAX) {
+            return false;
+        }
+    }
+    
+    //Repeated, it must agree with the first one (RFC 7230 3.3.2)
+    if (has_content_length_ && value != content_length_) {
+        return false;
+    }
+    
+    content_length_ = static_cast<uint32_t>(value);
+    has_content_length_ = true;
+    
+    return true;
+}
+    
+bool Request::MatchToken(uint32_t offset, uint32_t len, const char *token) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (TOKEN(rbuf_[offset + i]) != token[i]) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+    
+bool Request::FeedMultipart(const MultipartFunc &func, const char *data, size_t len) {
+    if (body_read_ == 0) {
+        if (!multipart_) {
+            multipart_ = new MultipartParser();
+        }
+        
+        Connection *conn = conn_;
+        const MultipartFunc *part_func = &func;
+        if (!multipart_->Begin(Header(CONTENT_TYPE), [conn, part_func](const MultipartPart &part, const char *d, size_t n) {
+            return (*part_func)(conn, part, d, n);
+        })) {
+            return false;
+        }
+    }
+    
+    return multipart_->Feed(data, len);
+}
+    
+bool Request::MultipartFinished() {
+    return multipart_ && multipart_->Finished();
+}
+    
 }//namespace mevent
@@ -2,12 +2,18 @@
 #define _REQUEST_H
 
 #include "conn_status.h"
+#include "arena.h"
+#include "ternary_search_tree.h"
+#include "buffer_pool.h"
+#include "string_piece.h"
+#include "multipart.h"
 
 #include <netinet/in.h>
 #include <stdint.h>
 
 #include <string>
 #include <map>
+#include <vector>
 
 namespace mevent {
     
@@ -37,13 +43,13 @@ enum class RequestParseStatus : uint8_t {
     S_METHOD_P,
     S_PATH,
     S_QUERY_STRING,
+    S_VERSION,
     S_CONTENT_LENGTH,
     S_CONTNET_LENGTH_V,
-    S_CONTENT_TYPE,
-    S_CONTENT_TYPE_V,
-    S_SEC_WEBSOCKET_KEY,
-    S_SEC_WEBSOCKET_KEY_V,
+    S_CONTENT_LENGTH_OWS,
     S_UPGRADE,
+    S_CONNECTION,
+    S_CONNECTION_V,
     S_EOL,
     S_HEADER_FIELD,
     S_EOH
@@ -59,40 +65,99 @@ class Connection;
 class WebSocket;
 class EventLoop;
 
+//A header line, or a key=value pair of a query string or urlencoded form,
+//as offsets into where it was parsed from
+struct FieldSpan {
+    uint32_t name;
+    uint32_t name_len;
+    uint32_t value;
+    uint32_t value_len;
+};
+
+typedef std::vector<FieldSpan, ArenaAllocator<FieldSpan>> FieldList;
+
 class Request {
 public:
     Request(Connection *conn);
-    virtual ~Request() {};
+    virtual ~Request();
     
+    //Nothing left to do, Parse() indexes every header line. Kept for
+    //existing callers
     void ParseHeader();
+    
+    //Case-insensitive, the first one when a field is repeated, empty when
+    //there is none. Points into the receive buffer, so it is only valid
+    //until the handler returns and must not be kept across reads of a
+    //streamed body. No allocation.
+    StringPiece Header(const StringPiece &field);
+    
     std::string HeaderValue(const std::string &field);
     
+    //Optional, both forms are indexed on first access
     void ParseQueryString();
-    std::string QueryStringValue(const std::string &field);
-    
     void ParsePostForm();
+    
+    //Decoded value of field, the last one when it is repeated
+    std::string QueryStringValue(const std::string &field);
     std::string PostFormValue(const std::string &field);
     
+    //The nth value of field (0 is the first), false if there are fewer.
+    //Decoded on access: a value without escapes points into the request
+    //itself, others are decoded into the connection's arena. Either way it
+    //is valid until the handler returns. No allocation from the heap.
+    bool QueryStringValue(const StringPiece &field, StringPiece *value, size_t nth = 0);
+    bool PostFormValue(const StringPiece &field, StringPiece *value, size_t nth = 0);
+    
+    //How many times field is present
+    size_t QueryStringCount(const StringPiece &field);
+    size_t PostFormCount(const StringPiece &field);
+    
 //    void ParseCookie();
 //    void std::string CookieValue(const std::string &field);
     
     uint32_t ContentLength();
     
+    //Reads a spooled body back from its file, empty for streamed bodies
     std::string Body();
     
+    //-1 unless the body was spooled to a temporary file (see
+    //HTTPServer::SetBodyTempDir()), which is then positioned at its start.
+    //Owned by the request
+    int BodyFd();
+    
     std::string Path();
     std::string QueryString();
     
     RequestMethod Method();
     
+    //e.g. 1.1 is major 1, minor 1
+    int HTTPMajor();
+    int HTTPMinor();
+    
+    //HTTP/1.1 unless "Connection: close", HTTP/1.0 only with "Connection: keep-alive"
+    bool KeepAlive();
+    
     std::string RemoteAddr();
     
 private:
     friend class Connection;
     friend class WebSocket;
     friend class EventLoop;
+    friend class HTTPServer;
+    friend class Response;
+    
+    //Where the urlencoded body starts, NULL if there is none in rbuf_
+    const char *PostFormData();
+    
+    void IndexForm(FieldList &fields, const char *str, size_t len);
+    
+    //The nth match of field in fields over str, the last one for nth ==
+    //SIZE_MAX. NULL if there is none.
+    const FieldSpan *FindFormField(const FieldList &fields, const char *str, const StringPiece &field, size_t nth);
+    size_t CountFormField(const FieldList &fields, const char *str, const StringPiece &field);
     
-    void ParseFormUrlencoded(std::map<std::string, std::string> &m, const std::string &str);
+    bool DecodeValue(const char *str, const FieldSpan *f, StringPiece *value);
+    std::string DecodeValue(const char *str, const FieldSpan *f);
     
     void Reset();
     
@@ -100,23 +165,75 @@ private:
     
     ConnStatus ReadData();
     
+    ConnStatus Advance();
+    
+    //Decides where the body goes once the header is complete
+    ConnStatus BeginBody();
+    
+    //Hands the body bytes in rbuf_ to body_func_ or the temporary file
+    ConnStatus ConsumeBody();
+    
+    ConnStatus SpliceBody();
+    
+    //The body is not kept in rbuf_
+    bool BodyDetached();
+    
+    //Bytes of another request follow this one in rbuf_
+    bool Pipelined();
+    
     HTTPParserStatus Parse();
     
+    uint32_t ScanRun();
+    
+    RequestParseStatus FieldStatus(const char *p, size_t len);
+    
+    //The header line that ended with the CR at offset cr gets its value
+    void EndField(uint32_t cr);
+    
+    //Takes the Content-Length digits at [begin, end), false if they
+    //overflow or disagree with an earlier Content-Length
+    bool SetContentLength(uint32_t begin, uint32_t end);
+    
+    bool MatchToken(uint32_t offset, uint32_t len, const char *token);
+    
+    //Body pieces of HTTPServer::SetMultipartHandler(), the parser starts
+    //on the first one
+    bool FeedMultipart(const MultipartFunc &func, const char *data, size_t len);
+    bool MultipartFinished();
+    
     RequestStatus         status_;
     
     struct in_addr        addr_;
     
-    std::string           rbuf_;
+    //Taken from the loop's BufferPool while a request is being read or
+    //handled, see Connection::ReadInto()
+    ReadBuffer            rbuf_;
     uint32_t              rbuf_len_;
     
     RequestMethod         method_;
 
     std::string           path_;
     std::string           query_string_;
+    
+    uint8_t               http_major_;
+    uint8_t               http_minor_;
+    
+    //Tokens seen in the Connection header
+    bool                  connection_close_;
+    bool                  connection_keep_alive_;
 
     uint32_t              content_length_;
+    bool                  has_content_length_;
+    
+    //Bodies are only delimited by Content-Length, see Advance()
+    bool                  transfer_encoding_;
     size_t                header_len_;
     
+    //Streamed or spooled bodies: bytes consumed so far
+    HTTPBodyFunc          body_func_;
+    int                   body_fd_;
+    uint32_t              body_read_;
+    
     RequestParseStatus    parse_status_;
     uint32_t              parse_offset_;
     uint32_t              parse_match_;
@@ -125,14 +242,20 @@ private:
     
     int                   error_code_;
     
-    std::string           content_type_;
-    
-    std::string           sec_websocket_key_;
+    //Every header line in order, in the connection's arena. field_open_:
+    //the last one still waits for the end of its line.
+    FieldList             header_fields_;
+    bool                  field_open_;
     
-    std::map<std::string, std::string> header_map_;
+    //Built on first access, over query_string_ and PostFormData(). Backed
+    //by the connection's arena, see Connection::Reset()
+    FieldList             get_fields_;
+    FieldList             post_fields_;
+    bool                  get_indexed_;
+    bool                  post_indexed_;
     
-    std::map<std::string, std::string> get_form_map_;
-    std::map<std::string, std::string> post_form_map_;
+    //Created by the first multipart request and kept for the next ones
+    MultipartParser      *multipart_;
 };
     
 }
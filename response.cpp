@@ -2,77 +2,351 @@
 #include "mevent.h"
 #include "util.h"
 #include "connection.h"
+#include "event_loop.h"
+
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+
+//Pending bytes at which WriteChunk() asks the producer to wait, and down to
+//which WaitWritable() drains before letting it continue
+#define STREAM_HIGH_WATERMARK 262144
+#define STREAM_LOW_WATERMARK  65536
 
 namespace mevent {
     
 #define HTTP_200_HEAD "HTTP/1.1 200 OK" CRLF
+#define HTTP_204_HEAD "HTTP/1.1 204 No Content" CRLF
+#define HTTP_206_HEAD "HTTP/1.1 206 Partial Content" CRLF
+#define HTTP_301_HEAD "HTTP/1.1 301 Moved Permanently" CRLF
+#define HTTP_302_HEAD "HTTP/1.1 302 Found" CRLF
+#define HTTP_304_HEAD "HTTP/1.1 304 Not Modified" CRLF
 #define HTTP_400_HEAD "HTTP/1.1 400 Bad Request" CRLF
 #define HTTP_403_HEAD "HTTP/1.1 403 Forbidden" CRLF
 #define HTTP_404_HEAD "HTTP/1.1 404 Not Found" CRLF
+#define HTTP_405_HEAD "HTTP/1.1 405 Method Not Allowed" CRLF
+#define HTTP_416_HEAD "HTTP/1.1 416 Range Not Satisfiable" CRLF
 #define HTTP_500_HEAD "HTTP/1.1 500 Internal Server Error" CRLF
+#define HTTP_501_HEAD "HTTP/1.1 501 Not Implemented" CRLF
     
 #define HTTP_400_MSG "<html><head><title>400 Bad Request</title></head><body><h1>400 Bad Request</h1><hr><address>" SERVER "</address></body></html>"
 #define HTTP_403_MSG "<html><head><title>403 Forbidden</title></head><body><h1>403 Forbidden</h1><hr><address>" SERVER "</address></body></html>"
 #define HTTP_404_MSG "<html><head><title>404 Not Found</title></head><body><h1>404 Not Found</h1><hr><address>" SERVER "</address></body></html>"
 #define HTTP_500_MSG "<html><head><title>500 Internal Server Error</title></head><body><h1>500 Internal Server Error</h1><hr><address>" SERVER "</address></body></html>"
+#define HTTP_501_MSG "<html><head><title>501 Not Implemented</title></head><body><h1>501 Not Implemented</h1><hr><address>" SERVER "</address></body></html>"
 
-Response::Response(Connection *conn) : conn_(conn) {
+static const char *StatusLine(int code) {
+    switch (code) {
+        case 204: return HTTP_204_HEAD;
+        case 206: return HTTP_206_HEAD;
+        case 301: return HTTP_301_HEAD;
+        case 302: return HTTP_302_HEAD;
+        case 304: return HTTP_304_HEAD;
+        case 400: return HTTP_400_HEAD;
+        case 403: return HTTP_403_HEAD;
+        case 404: return HTTP_404_HEAD;
+        case 405: return HTTP_405_HEAD;
+        case 416: return HTTP_416_HEAD;
+        case 500: return HTTP_500_HEAD;
+        case 501: return HTTP_501_HEAD;
+        default:  return HTTP_200_HEAD;
+    }
+}
+
+Response::Response(Connection *conn)
+    : conn_(conn),
+      header_list_(HeaderList::allocator_type(&conn->arena_)),
+      hbuf_(ArenaString::allocator_type(&conn->arena_)),
+      wbuf_(ArenaString::allocator_type(&conn->arena_)) {
     Reset();
 }
     
+//Drops every reference into the arena before Connection::Reset() rewinds it
 void Response::Reset() {
-    header_map_.clear();
+    HeaderList(header_list_.get_allocator()).swap(header_list_);
     
-    wbuf_.clear();
-    wbuf_.shrink_to_fit();
+    ArenaString(hbuf_.get_allocator()).swap(hbuf_);
+    ArenaString(wbuf_.get_allocator()).swap(wbuf_);
+    
+    status_code_ = 200;
+    
+    file_fd_ = -1;
+    file_offset_ = 0;
+    file_len_ = 0;
+    file_keep_.reset();
+    
+    streaming_ = false;
+    chunked_ = false;
+    stream_error_ = false;
+    
+    keep_alive_ = false;
     
     finish_ = false;
 }
     
+//Errors that leave the request stream unparseable (a bad request line or
+//header, an unsupported or failed body) close the connection, the others
+//keep it like any response
 void Response::WriteErrorMessage(int code) {
-    std::string str;
+    const char *msg;
+    std::size_t msg_len;
     
     switch (code) {
         case 400:
-            str = HTTP_400_HEAD "Server: " SERVER CRLF "Content-Type: text/html" CRLF "Content-Length: " + std::to_string(sizeof(HTTP_403_MSG) - 1) + CRLF "Date: " + util::GetGMTimeStr() + CRLF "Connection: close" CRLF CRLF HTTP_400_MSG;
+            msg = HTTP_400_MSG;
+            msg_len = sizeof(HTTP_400_MSG) - 1;
             break;
         case 403:
-            str = HTTP_403_HEAD "Server: " SERVER CRLF "Content-Type: text/html" CRLF "Content-Length: " + std::to_string(sizeof(HTTP_403_MSG) - 1) + CRLF "Date: " + util::GetGMTimeStr() + CRLF "Connection: close" CRLF CRLF HTTP_403_MSG;
+            msg = HTTP_403_MSG;
+            msg_len = sizeof(HTTP_403_MSG) - 1;
             break;
         case 404:
-            str = HTTP_404_HEAD "Server: " SERVER CRLF "Content-Type: text/html" CRLF "Content-Length: " + std::to_string(sizeof(HTTP_404_MSG) - 1) + CRLF "Date: " + util::GetGMTimeStr() + CRLF "Connection: close" CRLF CRLF HTTP_404_MSG;
+            msg = HTTP_404_MSG;
+            msg_len = sizeof(HTTP_404_MSG) - 1;
+            break;
+        case 501:
+            msg = HTTP_501_MSG;
+            msg_len = sizeof(HTTP_501_MSG) - 1;
             break;
         default:
-            str = HTTP_500_HEAD "Server: " SERVER CRLF "Content-Type: text/html" CRLF "Content-Length: " + std::to_string(sizeof(HTTP_500_MSG) - 1) + CRLF "Date: " + util::GetGMTimeStr() + CRLF "Connection: close" CRLF CRLF HTTP_500_MSG;
+            code = 500;
+            msg = HTTP_500_MSG;
+            msg_len = sizeof(HTTP_500_MSG) - 1;
             break;
     }
     
-    conn_->WriteString(str);
+    bool keep_alive = conn_->Req()->error_code_ == 0 && code != 400 && code != 501;
     
+    //Whatever the handler set up is replaced by the error page
+    HeaderList(header_list_.get_allocator()).swap(header_list_);
     wbuf_.clear();
+    file_fd_ = -1;
+    file_keep_.reset();
+    
+    status_code_ = code;
+    SetHeader("Content-Type", "text/html");
+    SetHeader("Content-Length", std::to_string(msg_len));
+    
+    MakeHeader(keep_alive);
+    
+    conn_->WriteBorrowed(hbuf_.data(), hbuf_.length());
+    
+    //The page bodies are string literals, no need to copy them
+    if (!HeadRequest()) {
+        conn_->WriteBorrowed(msg, msg_len);
+    }
     
     finish_ = true;
 }
     
 void Response::WriteData(const std::vector<uint8_t> &data) {
-    wbuf_.insert(wbuf_.end(), data.begin(), data.end());
+    wbuf_.append(reinterpret_cast<const char *>(data.data()), data.size());
 }
     
 void Response::WriteString(const std::string &str) {
-    wbuf_.insert(wbuf_.end(), str.begin(), str.end());
+    wbuf_.append(str.data(), str.length());
+}
+    
+void Response::WriteFile(int fd, off_t offset, size_t length, const std::shared_ptr<const void> &keep) {
+    file_fd_ = fd;
+    file_offset_ = offset;
+    file_len_ = length;
+    file_keep_ = keep;
+}
+    
+void Response::SetStatusCode(int code) {
+    status_code_ = code;
 }
     
 void Response::Flush() {
+    if (streaming_) {
+        EndStream();
+        return;
+    }
+    
+    //Already answered, e.g. by WriteErrorMessage()
+    if (finish_) {
+        return;
+    }
+    
     finish_ = true;
     
-    if (wbuf_.empty()) {
+    bool has_body = status_code_ != 204 && status_code_ != 304;
+    
+    //A HEAD response announces the length of the body it leaves out
+    if (has_body) {
+        if (file_fd_ >= 0) {
+            SetHeader("Content-Length", std::to_string(file_len_));
+        } else if (!wbuf_.empty() || !HasHeader("Content-Length")) {
+            //A HEAD handler may announce the length without writing the body
+            SetHeader("Content-Length", std::to_string(wbuf_.length()));
+        }
+    }
+    
+    MakeHeader(true);
+    
+    conn_->WriteBorrowed(hbuf_.data(), hbuf_.length());
+    
+    if (!has_body || HeadRequest()) {
+        return;
+    }
+    
+    if (file_fd_ >= 0) {
+        conn_->WriteFile(file_fd_, file_offset_, file_len_, file_keep_);
+    } else if (conn_->ZeroCopy(wbuf_.length())) {
+        //The arena then stays alive until the kernel is done with the body
+        conn_->WriteBorrowed(wbuf_.data(), wbuf_.length(), conn_->KeepArena());
+    } else {
+        conn_->WriteBorrowed(wbuf_.data(), wbuf_.length());
+    }
+}
+    
+void Response::BeginStream(int64_t content_length) {
+    if (streaming_ || finish_) {
         return;
     }
     
-    header_map_["Content-Length"] = std::vector<std::string>{std::to_string(wbuf_.length())};
+    streaming_ = true;
+    
+    Request *req = conn_->Req();
+    
+    if (content_length >= 0) {
+        SetHeader("Content-Length", std::to_string(content_length));
+    } else if (req->HTTPMajor() > 1 || (req->HTTPMajor() == 1 && req->HTTPMinor() > 0)) {
+        DelHeader("Content-Length");
+        SetHeader("Transfer-Encoding", "chunked");
+        chunked_ = true;
+    } else {
+        //HTTP/1.0 has no chunked coding, closing the connection ends the body
+        DelHeader("Content-Length");
+    }
+    
+    MakeHeader(content_length >= 0 || chunked_);
+    conn_->WriteBorrowed(hbuf_.data(), hbuf_.length());
     
-    conn_->WriteString(MakeHeader());
-    conn_->WriteString(wbuf_);
+    if (!wbuf_.empty() && !HeadRequest()) {
+        std::string data(wbuf_.data(), wbuf_.length());
+        ArenaString(wbuf_.get_allocator()).swap(wbuf_);
+        
+        WriteChunk(std::move(data));
+    } else {
+        FlushStream();
+    }
+}
+    
+bool Response::WriteChunk(const std::string &data) {
+    return WriteChunk(std::string(data));
+}
+    
+//Chunks own their data: unlike the buffered body they must not pile up in
+//the connection's arena for the lifetime of the stream
+bool Response::WriteChunk(std::string &&data) {
+    if (!streaming_ || finish_ || stream_error_) {
+        return false;
+    }
+    
+    if (data.empty() || HeadRequest()) {
+        return conn_->PendingBytes() < STREAM_HIGH_WATERMARK;
+    }
+    
+    if (chunked_) {
+        char size_line[32];
+        snprintf(size_line, sizeof(size_line), "%zx" CRLF, data.length());
+        
+        conn_->WriteString(std::string(size_line));
+        conn_->WriteString(std::move(data));
+        conn_->WriteBorrowed(CRLF, 2);
+    } else {
+        conn_->WriteString(std::move(data));
+    }
+    
+    if (!FlushStream()) {
+        return false;
+    }
+    
+    return conn_->PendingBytes() < STREAM_HIGH_WATERMARK;
+}
+    
+bool Response::WaitWritable(int timeout_ms) {
+    if (!streaming_ || stream_error_) {
+        return false;
+    }
+    
+    //Blocking here would stall every connection of the loop
+    assert(!conn_->elp_->InLoopThread());
+    if (conn_->elp_->InLoopThread()) {
+        return false;
+    }
+    
+    while (conn_->PendingBytes() > STREAM_LOW_WATERMARK) {
+        //Polled right here: the event loop can't help while the handler
+        //holds the connection lock
+        struct pollfd pfd;
+        pfd.fd = conn_->fd_;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        
+        int n = poll(&pfd, 1, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            stream_error_ = true;
+            return false;
+        } else if (n == 0) {
+            return false;
+        }
+        
+        if (!FlushStream()) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+    
+void Response::EndStream() {
+    if (!streaming_ || finish_) {
+        return;
+    }
+    
+    finish_ = true;
+    
+    if (chunked_ && !stream_error_ && !HeadRequest()) {
+        conn_->WriteBorrowed("0" CRLF CRLF, 5);
+    }
+}
+    
+//Writes what the socket takes now, the rest waits for WaitWritable() or
+//for the event loop once the handler returns
+bool Response::FlushStream() {
+    ConnStatus status = conn_->Flush();
+    
+    if (status == ConnStatus::ERROR || status == ConnStatus::CLOSE) {
+        stream_error_ = true;
+        return false;
+    }
+    
+    conn_->active_time_ = time(NULL);
+    
+    return true;
+}
+    
+//The body of a response to HEAD is dropped, the connection stays in sync
+bool Response::HeadRequest() {
+    return conn_->Req()->Method() == RequestMethod::HEAD;
+}
+    
+bool Response::HasHeader(const char *field) {
+    for (auto it = header_list_.begin(); it != header_list_.end(); it++) {
+        if (it->first == field) {
+            return true;
+        }
+    }
+    
+    return false;
 }
     
 void Response::SetHeader(const std::string &field, const std::string &value) {
@@ -80,7 +354,8 @@ void Response::SetHeader(const std::string &field, const std::string &value) {
         return;
     }
     
-    header_map_[field] = std::vector<std::string>{value};
+    DelHeader(field);
+    AddHeader(field, value);
 }
     
 void Response::AddHeader(const std::string &field, const std::string &value ) {
@@ -88,42 +363,67 @@ void Response::AddHeader(const std::string &field, const std::string &value ) {
         return;
     }
     
-    header_map_[field].push_back(value);
+    ArenaString::allocator_type alloc = wbuf_.get_allocator();
+    
+    header_list_.push_back(std::make_pair(ArenaString(field.data(), field.length(), alloc),
+                                          ArenaString(value.data(), value.length(), alloc)));
 }
     
 void Response::DelHeader(const std::string &field) {
-    header_map_.erase(field);
+    for (size_t i = 0; i < header_list_.size(); ) {
+        if (header_list_[i].first.compare(0, ArenaString::npos, field.data(), field.length()) == 0) {
+            header_list_.erase(header_list_.begin() + i);
+        } else {
+            i++;
+        }
+    }
 }
 
-std::string Response::MakeHeader() {
-    std::string str = HTTP_200_HEAD;
+void Response::MakeHeader(bool keep_alive) {
+    keep_alive_ = keep_alive && conn_->CanKeepAlive();
     
-    auto it = header_map_.find("Server");
-    if (it == header_map_.end()) {
-        str += "Server: " SERVER CRLF;
-    }
+    bool has_server = false;
+    bool has_date = false;
+    bool has_content_type = false;
     
-    it = header_map_.find("Date");
-    if (it == header_map_.end()) {
-        str += "Date: " + util::GetGMTimeStr() + CRLF;
-    }
+    hbuf_.assign(StatusLine(status_code_));
     
-    it = header_map_.find("Content-Type");
-    if (it == header_map_.end()) {
-        str += "Content-Type: application/octet-stream" CRLF;
+    for (auto it = header_list_.begin(); it != header_list_.end(); it++) {
+        if (it->first == "Server") {
+            has_server = true;
+        } else if (it->first == "Date") {
+            has_date = true;
+        } else if (it->first == "Content-Type") {
+            has_content_type = true;
+        } else if (it->first == "Connection") {
+            //A handler may still ask for the connection to be closed
+            if (it->second == "close") {
+                keep_alive_ = false;
+            }
+            continue;
+        }
+        
+        hbuf_.append(it->first).append(": ").append(it->second).append(CRLF);
     }
     
-    header_map_["Connection"] = std::vector<std::string>{"close"};
+    if (!has_server) {
+        hbuf_.append("Server: " SERVER CRLF);
+    }
     
-    for (it = header_map_.begin(); it != header_map_.end(); it++) {
-        for (auto vit = it->second.begin(); vit != it->second.end(); vit++) {
-            str += it->first + ": " + *vit + CRLF;
-        }
+    if (!has_date) {
+        std::string date = util::GetGMTimeStr();
+        hbuf_.append("Date: ").append(date.data(), date.length()).append(CRLF);
     }
     
-    str += CRLF;
+    if (!has_content_type) {
+        hbuf_.append("Content-Type: application/octet-stream" CRLF);
+    }
     
-    return str;
+    if (keep_alive_) {
+        hbuf_.append("Connection: keep-alive" CRLF CRLF);
+    } else {
+        hbuf_.append("Connection: close" CRLF CRLF);
+    }
 }
 
 }//namespace mevent
@@ -2,12 +2,14 @@
 #define _RESPONSE_H
 
 #include "conn_status.h"
+#include "arena.h"
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <vector>
 #include <string>
-#include <map>
+#include <memory>
 
 namespace mevent {
     
@@ -25,6 +27,35 @@ public:
     void WriteString(const std::string &str);
     void WriteData(const std::vector<uint8_t> &data);
     
+    //Body taken straight from a file with sendfile(2) instead of the write
+    //buffer. fd must stay open until it is written, keep can guarantee that
+    void WriteFile(int fd, off_t offset, size_t length, const std::shared_ptr<const void> &keep);
+    
+    //Default 200
+    void SetStatusCode(int code);
+    
+    //Streaming: sends the headers now and the body as it is produced.
+    //content_length < 0 uses Transfer-Encoding: chunked. Anything already
+    //written with WriteString()/WriteData() goes out first, for HEAD only
+    //the headers do. Worker thread handlers only, WaitWritable() blocks.
+    void BeginStream(int64_t content_length = -1);
+    
+    //Queues data and writes as much as the socket takes. Returns false once
+    //more than STREAM_HIGH_WATERMARK bytes are pending or the client is gone;
+    //stop producing and call WaitWritable() then.
+    bool WriteChunk(const std::string &data);
+    bool WriteChunk(std::string &&data);
+    
+    //Blocks until pending output drops below STREAM_LOW_WATERMARK. Returns
+    //false on timeout (timeout_ms < 0 waits forever) or when the client is gone.
+    //Worker threads only: it polls the socket on the calling thread, which
+    //for a loop handler (see HTTPServer::SetLoopHandler()) would hold up the
+    //whole loop. Asserted; without assertions it returns false at once there.
+    bool WaitWritable(int timeout_ms = -1);
+    
+    //Terminates the stream, called automatically when the handler returns
+    void EndStream();
+    
     void SetHeader(const std::string &field, const std::string &value);
     void AddHeader(const std::string &field, const std::string &value);
     void DelHeader(const std::string &field);
@@ -33,13 +64,41 @@ private:
     friend class Connection;
     friend class EventLoop;
     
-    std::string MakeHeader();
+    typedef std::vector<std::pair<ArenaString, ArenaString>,
+                        ArenaAllocator<std::pair<ArenaString, ArenaString>>> HeaderList;
+    
+    //keep_alive: the body is delimited, so the connection may be kept open
+    void MakeHeader(bool keep_alive);
     void Flush();
     
+    bool HasHeader(const char *field);
+    bool HeadRequest();
+    
+    bool FlushStream();
+    
     Connection *conn_;
-    std::map<std::string, std::vector<std::string>> header_map_;
     
-    std::string wbuf_;
+    //Header lines in insertion order, AddHeader() may repeat a field
+    HeaderList  header_list_;
+    
+    //Both live in the connection's arena and are handed to the write chain
+    //without copying; the arena is only rewound once the chain is gone
+    ArenaString hbuf_;
+    ArenaString wbuf_;
+    
+    int         status_code_;
+    
+    int         file_fd_;
+    off_t       file_offset_;
+    size_t      file_len_;
+    std::shared_ptr<const void> file_keep_;
+    
+    bool streaming_;
+    bool chunked_;
+    bool stream_error_;
+    
+    //Decided with the header, see EventLoop::KeepAlive()
+    bool keep_alive_;
     
     bool finish_;
 };
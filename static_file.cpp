@@ -0,0 +1,321 @@
+#include "static_file.h"
+#include "connection.h"
+#include "lock_guard.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+//Seconds a cached stat() result is trusted
+#define FILE_CACHE_CHECK_SECS 1
+
+namespace mevent {
+
+FileEntry::~FileEntry() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static const char *ContentType(const std::string &path) {
+    static const struct {
+        const char *ext;
+        const char *type;
+    } types[] = {
+        {"html", "text/html"},
+        {"htm",  "text/html"},
+        {"css",  "text/css"},
+        {"js",   "application/javascript"},
+        {"json", "application/json"},
+        {"txt",  "text/plain"},
+        {"xml",  "application/xml"},
+        {"svg",  "image/svg+xml"},
+        {"png",  "image/png"},
+        {"jpg",  "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif",  "image/gif"},
+        {"ico",  "image/x-icon"},
+        {"webp", "image/webp"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"pdf",  "application/pdf"},
+        {"mp4",  "video/mp4"},
+        {"wasm", "application/wasm"},
+    };
+    
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return "application/octet-stream";
+    }
+    
+    const char *ext = path.c_str() + dot + 1;
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcasecmp(ext, types[i].ext) == 0) {
+            return types[i].type;
+        }
+    }
+    
+    return "application/octet-stream";
+}
+
+static std::string HTTPDate(time_t t) {
+    char buf[64];
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buf);
+}
+
+static time_t ParseHTTPDate(const std::string &str) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    
+    if (!strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+        return -1;
+    }
+    
+    return timegm(&tm);
+}
+
+//Only a single "bytes=" range is honoured, anything else gets the whole file
+//(returns 0). Returns -1 when the range can't be satisfied.
+static int ParseRange(const std::string &str, off_t size, off_t *start, off_t *end) {
+    if (str.compare(0, 6, "bytes=") != 0 || str.find(',') != std::string::npos) {
+        return 0;
+    }
+    
+    const char *p = str.c_str() + 6;
+    char *q;
+    
+    if (*p == '-') {
+        long long suffix = strtoll(p + 1, &q, 10);
+        if (q == p + 1 || *q != '\0') {
+            return 0;
+        } else if (suffix <= 0) {
+            return -1;
+        }
+        
+        *start = suffix >= size ? 0 : size - suffix;
+        *end = size - 1;
+    } else {
+        long long first = strtoll(p, &q, 10);
+        if (q == p || *q != '-' || first < 0) {
+            return 0;
+        }
+        
+        p = q + 1;
+        long long last = size - 1;
+        if (*p) {
+            last = strtoll(p, &q, 10);
+            if (q == p || *q != '\0' || last < first) {
+                return 0;
+            }
+        }
+        
+        if (first >= size) {
+            return -1;
+        }
+        
+        *start = first;
+        *end = last >= size ? size - 1 : last;
+    }
+    
+    return size > 0 ? 1 : -1;
+}
+
+FileCache::FileCache(size_t max_files) : max_files_(max_files < 1 ? 1 : max_files) {
+    if (pthread_mutex_init(&mtx_, NULL) != 0) {
+        MEVENT_LOG_DEBUG_EXIT(NULL);
+    }
+}
+
+FileCache::~FileCache() {
+    pthread_mutex_destroy(&mtx_);
+}
+
+std::shared_ptr<FileEntry> FileCache::Get(const std::string &path) {
+    time_t now = time(NULL);
+    std::shared_ptr<FileEntry> entry;
+    
+    {
+        LockGuard lock_guard(mtx_);
+        
+        auto it = index_.find(path);
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            entry = it->second->second;
+            
+            if (now - entry->checked < FILE_CACHE_CHECK_SECS) {
+                return entry;
+            }
+        }
+    }
+    
+    //stat() outside the lock, other threads keep hitting the cache meanwhile
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        LockGuard lock_guard(mtx_);
+        
+        auto it = index_.find(path);
+        if (it != index_.end()) {
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+        
+        return nullptr;
+    }
+    
+    if (entry && entry->ino == st.st_ino && entry->dev == st.st_dev
+        && entry->size == st.st_size && entry->mtime == st.st_mtime) {
+        LockGuard lock_guard(mtx_);
+        entry->checked = now;
+        return entry;
+    }
+    
+    return Open(path, now);
+}
+
+std::shared_ptr<FileEntry> FileCache::Open(const std::string &path, time_t now) {
+    std::shared_ptr<FileEntry> entry = std::make_shared<FileEntry>();
+    
+    entry->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (entry->fd < 0) {
+        return nullptr;
+    }
+    
+    struct stat st;
+    if (fstat(entry->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return nullptr;
+    }
+    
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->ino = st.st_ino;
+    entry->dev = st.st_dev;
+    entry->last_modified = HTTPDate(st.st_mtime);
+    entry->content_type = ContentType(path);
+    entry->checked = now;
+    
+    LockGuard lock_guard(mtx_);
+    
+    auto it = index_.find(path);
+    if (it != index_.end()) {
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+    
+    lru_.push_front(std::make_pair(path, entry));
+    index_[path] = lru_.begin();
+    
+    while (lru_.size() > max_files_) {
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+    
+    return entry;
+}
+
+StaticFileHandler::StaticFileHandler(const std::string &prefix, const std::string &root, size_t max_cached_files)
+    : prefix_(prefix),
+      root_(root),
+      cache_(max_cached_files) {
+    while (root_.length() > 1 && root_[root_.length() - 1] == '/') {
+        root_.erase(root_.length() - 1);
+    }
+}
+
+void StaticFileHandler::Serve(Connection *conn) {
+    Request *req = conn->Req();
+    Response *resp = conn->Resp();
+    
+    RequestMethod method = req->Method();
+    if (method != RequestMethod::GET && method != RequestMethod::HEAD) {
+        resp->SetStatusCode(405);
+        resp->SetHeader("Allow", "GET, HEAD");
+        return;
+    }
+    
+    std::string path = util::URLDecode(req->Path());
+    if (path.compare(0, prefix_.length(), prefix_) != 0) {
+        resp->WriteErrorMessage(404);
+        return;
+    }
+    
+    std::string rel = path.substr(prefix_.length());
+    
+    //No way out of root: reject NULs and any ".." component
+    if (rel.find('\0') != std::string::npos) {
+        resp->WriteErrorMessage(400);
+        return;
+    }
+    
+    size_t pos = 0;
+    while ((pos = rel.find("..", pos)) != std::string::npos) {
+        bool starts = pos == 0 || rel[pos - 1] == '/';
+        bool ends = pos + 2 == rel.length() || rel[pos + 2] == '/';
+        if (starts && ends) {
+            resp->WriteErrorMessage(403);
+            return;
+        }
+        pos += 2;
+    }
+    
+    if (rel.empty() || rel[rel.length() - 1] == '/') {
+        rel += "index.html";
+    }
+    
+    if (rel[0] != '/') {
+        rel.insert(0, 1, '/');
+    }
+    
+    std::shared_ptr<FileEntry> entry = cache_.Get(root_ + rel);
+    if (!entry) {
+        resp->WriteErrorMessage(404);
+        return;
+    }
+    
+    resp->SetHeader("Content-Type", entry->content_type);
+    resp->SetHeader("Last-Modified", entry->last_modified);
+    resp->SetHeader("Accept-Ranges", "bytes");
+    
+    std::string ims = req->HeaderValue("If-Modified-Since");
+    if (!ims.empty()) {
+        time_t t = ParseHTTPDate(ims);
+        if (t != -1 && entry->mtime <= t) {
+            resp->SetStatusCode(304);
+            return;
+        }
+    }
+    
+    off_t start = 0;
+    off_t end = entry->size - 1;
+    
+    std::string range = req->HeaderValue("Range");
+    if (!range.empty()) {
+        int ret = ParseRange(range, entry->size, &start, &end);
+        if (ret < 0) {
+            resp->SetStatusCode(416);
+            resp->SetHeader("Content-Range", "bytes */" + std::to_string(entry->size));
+            return;
+        } else if (ret > 0) {
+            resp->SetStatusCode(206);
+            resp->SetHeader("Content-Range", "bytes " + std::to_string(start) + "-" + std::to_string(end) + "/" + std::to_string(entry->size));
+        }
+    }
+    
+    size_t length = entry->size > 0 ? static_cast<size_t>(end - start + 1) : 0;
+    
+    if (method == RequestMethod::HEAD || length == 0) {
+        resp->SetHeader("Content-Length", std::to_string(length));
+        return;
+    }
+    
+    resp->WriteFile(entry->fd, start, length, entry);
+}
+
+}//namespace mevent
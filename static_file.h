@@ -0,0 +1,84 @@
+#ifndef _STATIC_FILE_H
+#define _STATIC_FILE_H
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+namespace mevent {
+
+class Connection;
+
+//An open file plus the stat() results a response needs. The fd is closed
+//when the last reference goes away, so a file evicted from the cache stays
+//readable for responses still being sent.
+struct FileEntry {
+    FileEntry() : fd(-1), size(0), mtime(0), ino(0), dev(0), checked(0) {};
+    ~FileEntry();
+    
+    int          fd;
+    off_t        size;
+    time_t       mtime;
+    ino_t        ino;
+    dev_t        dev;
+    
+    std::string  last_modified;
+    std::string  content_type;
+    
+    time_t       checked;
+};
+
+//Bounded LRU cache of open files shared by all threads. Entries are
+//re-validated with stat() at most once a second, a changed file is reopened.
+class FileCache {
+public:
+    FileCache(size_t max_files);
+    ~FileCache();
+    
+    std::shared_ptr<FileEntry> Get(const std::string &path);
+    
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<FileEntry>>> LRUList;
+    
+    FileCache(const FileCache &);
+    FileCache &operator=(const FileCache &);
+    
+    std::shared_ptr<FileEntry> Open(const std::string &path, time_t now);
+    
+    pthread_mutex_t   mtx_;
+    
+    LRUList           lru_;
+    std::unordered_map<std::string, LRUList::iterator> index_;
+    
+    size_t            max_files_;
+};
+
+//Serves files under root for request paths starting with prefix, e.g.
+//
+//  StaticFileHandler *files = new StaticFileHandler("/static/", "/var/www");
+//  server->SetHandler("/static/", std::bind(&StaticFileHandler::Serve, files, std::placeholders::_1));
+//
+//Bodies are sent with sendfile(2). GET and HEAD, single byte ranges and
+//If-Modified-Since are supported; a path ending in '/' serves index.html.
+class StaticFileHandler {
+public:
+    StaticFileHandler(const std::string &prefix, const std::string &root, size_t max_cached_files = 1024);
+    ~StaticFileHandler() {};
+    
+    void Serve(Connection *conn);
+    
+private:
+    std::string  prefix_;
+    std::string  root_;
+    
+    FileCache    cache_;
+};
+
+}//namespace mevent
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _STRING_PIECE_H
+#define _STRING_PIECE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <string>
+
+namespace mevent {
+
+//Bytes owned by someone else, e.g. a header inside the request's receive
+//buffer. Only valid as long as what it points into.
+class StringPiece {
+public:
+    StringPiece() : data_(NULL), len_(0) {}
+    StringPiece(const char *data, size_t len) : data_(data), len_(len) {}
+    StringPiece(const char *str) : data_(str), len_(strlen(str)) {}
+    StringPiece(const std::string &str) : data_(str.data()), len_(str.length()) {}
+    
+    const char *Data() const { return data_; }
+    size_t Length() const { return len_; }
+    bool Empty() const { return len_ == 0; }
+    
+    char operator[](size_t i) const { return data_[i]; }
+    
+    std::string ToString() const { return std::string(data_, len_); }
+    
+    bool operator==(const StringPiece &other) const {
+        return len_ == other.len_ && (len_ == 0 || memcmp(data_, other.data_, len_) == 0);
+    }
+    
+    bool operator!=(const StringPiece &other) const { return !(*this == other); }
+    
+    //ASCII only, as header names and form keys are
+    bool EqualsIgnoreCase(const StringPiece &other) const {
+        if (len_ != other.len_) {
+            return false;
+        }
+        
+        for (size_t i = 0; i < len_; i++) {
+            if (Lower(data_[i]) != Lower(other.data_[i])) {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+private:
+    static char Lower(char c) { return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; }
+    
+    const char   *data_;
+    size_t        len_;
+};
+    
+}//namespace mevent
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef _TASK_QUEUE_H
+#define _TASK_QUEUE_H
+
+#include "lock_guard.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <utility>
+
+namespace mevent {
+
+//Bounded lock-free MPMC queue with batched wakeups.
+//
+//Producers only touch the ring, Notify() wakes sleeping consumers once per
+//batch. The mutex/condvar pair is only used by consumers that found the ring
+//empty and by Notify() when somebody is actually sleeping.
+//
+//Reference: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+template <typename T>
+class TaskQueue {
+public:
+    TaskQueue(size_t size);
+    ~TaskQueue();
+
+    bool TryPush(const T &data);
+
+    //Blocks (wakes consumers and yields) while the ring is full
+    void Push(const T &data);
+
+    bool TryPop(T &data);
+
+    //Blocks until an item is available
+    void Pop(T &data);
+
+    //Wakes up to one sleeping consumer per item pushed since the last call
+    void Notify();
+
+private:
+    TaskQueue(const TaskQueue &);
+    TaskQueue &operator=(const TaskQueue &);
+
+    struct Cell {
+        std::atomic<size_t>  seq;
+        T                    data;
+    };
+
+    Cell                  *buffer_;
+    size_t                 mask_;
+
+    char                   pad0_[64];
+    std::atomic<size_t>    enqueue_pos_;
+    char                   pad1_[64];
+    std::atomic<size_t>    dequeue_pos_;
+    char                   pad2_[64];
+
+    std::atomic<size_t>    pending_;
+    std::atomic<int>       idle_;
+
+    pthread_mutex_t        mtx_;
+    pthread_cond_t         cond_;
+};
+
+template <typename T>
+TaskQueue<T>::TaskQueue(size_t size) {
+    size_t cap = 2;
+    while (cap < size) {
+        cap <<= 1;
+    }
+
+    buffer_ = new Cell[cap];
+    mask_ = cap - 1;
+
+    for (size_t i = 0; i < cap; i++) {
+        buffer_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    enqueue_pos_.store(0, std::memory_order_relaxed);
+    dequeue_pos_.store(0, std::memory_order_relaxed);
+    pending_.store(0, std::memory_order_relaxed);
+    idle_.store(0, std::memory_order_relaxed);
+
+    pthread_mutex_init(&mtx_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+template <typename T>
+TaskQueue<T>::~TaskQueue() {
+    delete [] buffer_;
+
+    pthread_mutex_destroy(&mtx_);
+    pthread_cond_destroy(&cond_);
+}
+
+template <typename T>
+bool TaskQueue<T>::TryPush(const T &data) {
+    Cell *cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+
+    for (;;) {
+        cell = &buffer_[pos & mask_];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+        if (dif == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->data = data;
+    cell->seq.store(pos + 1, std::memory_order_release);
+
+    pending_.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+template <typename T>
+void TaskQueue<T>::Push(const T &data) {
+    while (!TryPush(data)) {
+        Notify();
+        sched_yield();
+    }
+}
+
+template <typename T>
+bool TaskQueue<T>::TryPop(T &data) {
+    Cell *cell;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+
+    for (;;) {
+        cell = &buffer_[pos & mask_];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (dif == 0) {
+            if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = dequeue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    data = std::move(cell->data);
+    cell->data = T();
+    cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+
+    return true;
+}
+
+template <typename T>
+void TaskQueue<T>::Pop(T &data) {
+    while (!TryPop(data)) {
+        LockGuard lock_guard(mtx_);
+
+        //Pairs with the fence in Notify(): either the producer sees us idle
+        //or we see its item, so a wakeup can't get lost
+        idle_.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (TryPop(data)) {
+            idle_.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+
+        pthread_cond_wait(&cond_, &mtx_);
+
+        idle_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+void TaskQueue<T>::Notify() {
+    size_t pending = pending_.exchange(0, std::memory_order_relaxed);
+    if (pending == 0) {
+        return;
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    int idle = idle_.load(std::memory_order_relaxed);
+    if (idle <= 0) {
+        return;
+    }
+
+    LockGuard lock_guard(mtx_);
+
+    if (pending >= static_cast<size_t>(idle)) {
+        pthread_cond_broadcast(&cond_);
+    } else {
+        for (size_t i = 0; i < pending; i++) {
+            pthread_cond_signal(&cond_);
+        }
+    }
+}
+
+}//namespace mevent
+
+#endif
@@ -130,7 +130,9 @@ void TernarySearchTree::Search(Node *np, const char *pos, NodeData *ndp) {
     } else {
         if (np->data) {
             ndp->func = np->data->func;
+            ndp->body_func = np->data->body_func;
             ndp->str = np->data->str;
+            ndp->run_in_loop = np->data->run_in_loop;
         }
         
         if (*(pos + 1)) {
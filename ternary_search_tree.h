@@ -15,11 +15,18 @@ class Connection;
     
 typedef std::function<void(Connection *c)> HTTPHandleFunc;
     
+//Receives a request body piece by piece, returning false drops the connection
+typedef std::function<bool(Connection *c, const char *data, size_t len)> HTTPBodyFunc;
+    
 namespace tst {
 
 struct NodeData {
+    NodeData() : run_in_loop(false) {}
+    
     std::string      str;
     HTTPHandleFunc   func;
+    HTTPBodyFunc     body_func;
+    bool             run_in_loop;
 };
 
 struct Node {
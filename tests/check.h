@@ -0,0 +1,19 @@
+#ifndef _CHECK_H
+#define _CHECK_H
+
+#include <stdio.h>
+
+//Minimal assertions for the programs in tests/: a failed CHECK() is
+//reported and counted, CHECK_RESULT() turns the count into the exit status
+static int check_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        check_failures++; \
+    } \
+} while (0)
+
+#define CHECK_RESULT() (check_failures == 0 ? 0 : (fprintf(stderr, "%d check(s) failed\n", check_failures), 1))
+
+#endif
@@ -0,0 +1,153 @@
+//Every scan and find kernel the CPU supports against a plain reference, on
+//buffers that end right before an unmapped page so that reading past the
+//end faults
+#include "../http_scan.cpp"
+#include "check.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace mevent;
+
+struct Kernel {
+    const char *name;
+    ScanFunc    scan;
+    FindFunc    find;
+};
+
+static std::vector<Kernel> Kernels() {
+    std::vector<Kernel> kernels;
+    
+    kernels.push_back(Kernel{"scalar", ScanScalar, FindScalar});
+#ifdef MEVENT_SCAN_X86
+    kernels.push_back(Kernel{"sse2", ScanSSE2, FindSSE2});
+    
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(Kernel{"avx2", ScanAVX2, FindAVX2});
+    }
+#endif
+    
+    return kernels;
+}
+
+//What http_scan.h promises for each stop set
+static bool IsStop(unsigned char c, HTTPScanStop stop) {
+    if (c < 0x20 || c >= 0x7f || c == '\\') {
+        return true;
+    }
+    
+    switch (stop) {
+        case HTTPScanStop::LINE:  return false;
+        case HTTPScanStop::FIELD: return c == ':';
+        case HTTPScanStop::WORD:  return c == ' ';
+        case HTTPScanStop::URL:   return c == ' ' || c == '?' || c == '#';
+    }
+    
+    return false;
+}
+
+static size_t ScanReference(const char *p, size_t len, HTTPScanStop stop) {
+    for (size_t i = 0; i < len; i++) {
+        if (IsStop(p[i], stop)) {
+            return i;
+        }
+    }
+    
+    return len;
+}
+
+static size_t FindReference(const char *p, size_t len, const char *needle, size_t needle_len) {
+    const char *pos = std::search(p, p + len, needle, needle + needle_len);
+    return pos == p + len ? len : pos - p;
+}
+
+//Plain token characters with one of every density-th byte a stop byte, so
+//that runs cover none to many whole vectors
+static char RandomByte(int density) {
+    static const char plain[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJ0123456789-_./=;,";
+    static const char stops[] = "\r\n\t :?#\\\x7f\x80\xff\x01";
+    
+    if (rand() % density == 0) {
+        return stops[rand() % (sizeof(stops) - 1)];
+    }
+    
+    return plain[rand() % (sizeof(plain) - 1)];
+}
+
+int main() {
+    std::vector<Kernel> kernels = Kernels();
+    
+    const HTTPScanStop stops[] = {HTTPScanStop::LINE, HTTPScanStop::FIELD, HTTPScanStop::WORD, HTTPScanStop::URL};
+    
+    long page = sysconf(_SC_PAGESIZE);
+    char *map = static_cast<char *>(mmap(NULL, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (map == MAP_FAILED || mprotect(map + page, page, PROT_NONE) != 0) {
+        perror("mmap");
+        return 1;
+    }
+    
+    char *end = map + page;
+    
+    srand(1);
+    
+    for (int round = 0; round < 20000; round++) {
+        size_t len = rand() % 300;
+        char *p = end - len;
+        
+        static const int densities[] = {4, 40, 400};
+        int density = densities[round % 3];
+        
+        for (size_t i = 0; i < len; i++) {
+            p[i] = RandomByte(density);
+        }
+        
+        for (size_t s = 0; s < sizeof(stops) / sizeof(stops[0]); s++) {
+            size_t expected = ScanReference(p, len, stops[s]);
+            
+            for (size_t k = 0; k < kernels.size(); k++) {
+                size_t got = kernels[k].scan(p, len, stop_sets[static_cast<int>(stops[s])]);
+                if (got != expected) {
+                    fprintf(stderr, "%s scan, stop set %zu, len %zu: %zu instead of %zu\n",
+                            kernels[k].name, s, len, got, expected);
+                }
+                CHECK(got == expected);
+            }
+        }
+        
+        //A needle taken from the data itself half of the time
+        char needle[8];
+        size_t needle_len = 2 + rand() % (sizeof(needle) - 1);
+        
+        if (len >= needle_len && rand() % 2) {
+            memcpy(needle, p + rand() % (len - needle_len + 1), needle_len);
+        } else {
+            for (size_t i = 0; i < needle_len; i++) {
+                needle[i] = RandomByte(density);
+            }
+        }
+        
+        if (needle_len > len) {
+            continue;
+        }
+        
+        size_t expected = FindReference(p, len, needle, needle_len);
+        
+        for (size_t k = 0; k < kernels.size(); k++) {
+            size_t got = kernels[k].find(p, len, needle, needle_len);
+            if (got != expected) {
+                fprintf(stderr, "%s find, len %zu, needle %zu: %zu instead of %zu\n",
+                        kernels[k].name, len, needle_len, got, expected);
+            }
+            CHECK(got == expected);
+        }
+    }
+    
+    munmap(map, page * 2);
+    
+    return CHECK_RESULT();
+}
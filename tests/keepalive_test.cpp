@@ -0,0 +1,214 @@
+//Pipelined requests on one keep-alive connection, split at every offset so
+//that each request boundary lands inside a read: whatever follows a request
+//in the receive buffer has to be carried over to the next one
+#include "../http_server.h"
+#include "check.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mevent;
+
+static int FreePort() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    
+    close(fd);
+    
+    return ntohs(addr.sin_port);
+}
+
+static int Connect(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    
+    for (int i = 0; i < 100; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            struct timeval tv = {5, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            return fd;
+        }
+        
+        close(fd);
+        usleep(20000);
+    }
+    
+    perror("connect");
+    exit(1);
+}
+
+//Bodies of the next n responses, empty strings once the connection fails
+static std::vector<std::string> ReadBodies(int fd, size_t n) {
+    std::vector<std::string> bodies;
+    std::string buf;
+    char tmp[4096];
+    
+    while (bodies.size() < n) {
+        size_t head_end = buf.find("\r\n\r\n");
+        size_t cl = buf.find("Content-Length: ");
+        
+        if (head_end != std::string::npos && cl != std::string::npos && cl < head_end) {
+            size_t body_len = strtoul(buf.c_str() + cl + 16, NULL, 10);
+            
+            if (buf.length() >= head_end + 4 + body_len) {
+                bodies.push_back(buf.substr(head_end + 4, body_len));
+                buf.erase(0, head_end + 4 + body_len);
+                continue;
+            }
+        }
+        
+        ssize_t r = recv(fd, tmp, sizeof(tmp), 0);
+        if (r <= 0) {
+            bodies.resize(n);
+            break;
+        }
+        
+        buf.append(tmp, r);
+    }
+    
+    return bodies;
+}
+
+//Everything up to and including end, empty once the connection fails
+static std::string ReadUntil(int fd, std::string *buf, const std::string &end) {
+    char tmp[4096];
+    
+    for (;;) {
+        size_t pos = buf->find(end);
+        if (pos != std::string::npos) {
+            std::string s = buf->substr(0, pos + end.length());
+            buf->erase(0, pos + end.length());
+            return s;
+        }
+        
+        ssize_t r = recv(fd, tmp, sizeof(tmp), 0);
+        if (r <= 0) {
+            return std::string();
+        }
+        
+        buf->append(tmp, r);
+    }
+}
+
+int main() {
+    int port = FreePort();
+    
+    HTTPServer *server = new HTTPServer();
+    
+    server->SetHandler("/worker", [](Connection *conn) {
+        conn->Resp()->WriteString("worker");
+    });
+    
+    server->SetHandler("/post", [](Connection *conn) {
+        conn->Resp()->WriteString("post:" + conn->Req()->Body());
+    });
+    
+    server->SetLoopHandler("/loop", [](Connection *conn) {
+        conn->Resp()->WriteString("loop");
+    });
+    
+    server->SetWorkerThreads(2);
+    
+    std::thread([server, port]() {
+        server->ListenAndServe("127.0.0.1", port);
+    }).detach();
+    
+    const std::string stream = "GET /worker HTTP/1.1\r\nHost: t\r\n\r\n"
+                               "POST /post HTTP/1.1\r\nHost: t\r\nContent-Length: 11\r\n\r\nhello world"
+                               "GET /loop HTTP/1.1\r\nHost: t\r\n\r\n"
+                               "POST /post HTTP/1.1\r\nHost: t\r\nContent-Length: 3\r\n\r\nabc"
+                               "GET /worker HTTP/1.1\r\nHost: t\r\n\r\n";
+    
+    const char *expected[] = {"worker", "post:hello world", "loop", "post:abc", "worker"};
+    const size_t n = sizeof(expected) / sizeof(expected[0]);
+    
+    //All at once, then in two pieces split at every offset
+    for (size_t split = 0; split < stream.length(); split++) {
+        int fd = Connect(port);
+        
+        if (split == 0) {
+            send(fd, stream.data(), stream.length(), 0);
+        } else {
+            send(fd, stream.data(), split, 0);
+            usleep(1000);
+            send(fd, stream.data() + split, stream.length() - split, 0);
+        }
+        
+        std::vector<std::string> bodies = ReadBodies(fd, n);
+        
+        for (size_t i = 0; i < n; i++) {
+            if (bodies[i] != expected[i]) {
+                fprintf(stderr, "split at %zu, response %zu: \"%s\"\n", split, i, bodies[i].c_str());
+            }
+            CHECK(bodies[i] == expected[i]);
+        }
+        
+        close(fd);
+    }
+    
+    //A HEAD response carries the length but not the body, the GET behind
+    //it must be the next thing on the wire
+    {
+        int fd = Connect(port);
+        
+        const std::string req = "HEAD /worker HTTP/1.1\r\nHost: t\r\n\r\n"
+                                "GET /worker HTTP/1.1\r\nHost: t\r\n\r\n";
+        send(fd, req.data(), req.length(), 0);
+        
+        std::string buf;
+        std::string head = ReadUntil(fd, &buf, "\r\n\r\n");
+        
+        CHECK(head.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+        CHECK(head.find("Content-Length: 6\r\n") != std::string::npos);
+        CHECK(head.find("Connection: keep-alive\r\n") != std::string::npos);
+        
+        head = ReadUntil(fd, &buf, "\r\n\r\n");
+        
+        CHECK(head.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+        CHECK(ReadUntil(fd, &buf, "worker") == "worker");
+        
+        close(fd);
+    }
+    
+    //A 404 keeps the connection, the request queued behind it is answered
+    {
+        int fd = Connect(port);
+        
+        const std::string req = "GET /missing HTTP/1.1\r\nHost: t\r\n\r\n"
+                                "GET /worker HTTP/1.1\r\nHost: t\r\n\r\n";
+        send(fd, req.data(), req.length(), 0);
+        
+        std::vector<std::string> bodies = ReadBodies(fd, 2);
+        
+        CHECK(bodies[0].find("404 Not Found") != std::string::npos);
+        CHECK(bodies[1] == "worker");
+        
+        close(fd);
+    }
+    
+    //The server threads never return
+    _exit(CHECK_RESULT());
+}
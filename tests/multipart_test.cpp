@@ -0,0 +1,148 @@
+//MultipartParser fed the same body whole, split in two at every offset and
+//cut into random pieces: parts, their bytes and their headers must come out
+//the same every time, including data that looks like the start of a
+//delimiter
+#include "../multipart.h"
+#include "check.h"
+
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+using namespace mevent;
+
+struct Part {
+    std::string name;
+    std::string filename;
+    std::string content_type;
+    std::string data;
+};
+
+//Feeds body in the pieces that cuts splits it into, collects what comes out
+static bool Parse(const std::string &body, const std::vector<size_t> &cuts, std::vector<Part> *parts) {
+    MultipartParser parser;
+    bool ok = true;
+    bool open = false;
+    
+    bool begun = parser.Begin("Multipart/Form-Data; boundary=\"AaB03x-'()+_,./:=?\"",
+                              [&](const MultipartPart &part, const char *data, size_t len) {
+        if (!open) {
+            parts->push_back(Part{part.name, part.filename, part.content_type, std::string()});
+            open = true;
+            
+            ok = ok && part.offset == 0;
+        }
+        
+        ok = ok && part.offset == parts->back().data.length();
+        
+        parts->back().data.append(data, len);
+        open = !part.complete;
+        
+        return true;
+    });
+    
+    if (!begun) {
+        return false;
+    }
+    
+    size_t pos = 0;
+    for (size_t i = 0; i <= cuts.size(); i++) {
+        size_t next = i < cuts.size() ? cuts[i] : body.length();
+        if (!parser.Feed(body.data() + pos, next - pos)) {
+            return false;
+        }
+        pos = next;
+    }
+    
+    return ok && !open && parser.Finished();
+}
+
+static bool Same(const std::vector<Part> &a, const std::vector<Part> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].name != b[i].name || a[i].filename != b[i].filename
+            || a[i].content_type != b[i].content_type || a[i].data != b[i].data) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+int main() {
+    const std::string delim = "\r\n--AaB03x-'()+_,./:=?";
+    
+    //Delimiter prefixes, a delimiter without its leading CRLF and a lone CR
+    //inside the file, plus an empty part
+    const std::string file = "GIF89a\r\n--AaB03x-'()+_,./:=" "\r\r\n--AaB" "\r\n-" "--AaB03x-'()+_,./:=?" "\r" + std::string(300, 'z');
+    
+    std::vector<Part> expected;
+    expected.push_back(Part{"title", "", "", "holiday"});
+    expected.push_back(Part{"photo", "a \"b\".gif", "image/gif", file});
+    expected.push_back(Part{"empty", "", "", ""});
+    
+    std::string body = "preamble" + delim + "\r\n"
+                       "Content-Disposition: form-data; name=\"title\"\r\n\r\n"
+                       "holiday" + delim + "  \r\n"
+                       "Content-Disposition: form-data; name=photo; filename=\"a \\\"b\\\".gif\"\r\n"
+                       "Content-Type: image/gif\r\n\r\n"
+                       + file + delim + "\r\n"
+                       "content-disposition: form-data; name=\"empty\"\r\n\r\n"
+                       + delim + "--\r\nepilogue";
+    
+    std::vector<size_t> cuts;
+    std::vector<Part> parts;
+    
+    CHECK(Parse(body, cuts, &parts));
+    CHECK(Same(parts, expected));
+    
+    for (size_t split = 1; split < body.length(); split++) {
+        cuts.assign(1, split);
+        parts.clear();
+        
+        bool ok = Parse(body, cuts, &parts) && Same(parts, expected);
+        if (!ok) {
+            fprintf(stderr, "split at %zu\n", split);
+        }
+        CHECK(ok);
+    }
+    
+    srand(1);
+    
+    for (int round = 0; round < 2000; round++) {
+        cuts.clear();
+        for (size_t pos = rand() % 8; pos < body.length(); pos += 1 + rand() % 24) {
+            cuts.push_back(pos);
+        }
+        parts.clear();
+        
+        bool ok = Parse(body, cuts, &parts) && Same(parts, expected);
+        if (!ok) {
+            fprintf(stderr, "random pieces, round %d\n", round);
+        }
+        CHECK(ok);
+    }
+    
+    //Malformed bodies are refused, whole or split
+    const char *bad[] = {
+        "--AaB03x-'()+_,./:=?X\r\n",
+        "--AaB03x-'()+_,./:=?\r\nX-No-Disposition: 1\r\n\r\nabc",
+        "--AaB03x-'()+_,./:=?-x"
+    };
+    
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        std::string s = bad[i];
+        
+        for (size_t split = 0; split < s.length(); split++) {
+            cuts.assign(split ? 1 : 0, split);
+            parts.clear();
+            CHECK(!Parse(s, cuts, &parts));
+        }
+    }
+    
+    return CHECK_RESULT();
+}
@@ -0,0 +1,53 @@
+//Built with static_file.cpp included, so its file local functions can be
+//reached, see the Makefile
+#include "../static_file.cpp"
+#include "check.h"
+
+using namespace mevent;
+
+static void CheckRange(const char *range, off_t size, int ret, off_t start = 0, off_t end = 0) {
+    off_t s = -1;
+    off_t e = -1;
+    
+    int r = ParseRange(range, size, &s, &e);
+    if (r != ret || (ret == 1 && (s != start || e != end))) {
+        fprintf(stderr, "ParseRange(\"%s\", %lld): %d [%lld, %lld]\n",
+                range, (long long)size, r, (long long)s, (long long)e);
+    }
+    
+    CHECK(r == ret);
+    if (ret == 1) {
+        CHECK(s == start);
+        CHECK(e == end);
+    }
+}
+
+int main() {
+    //Satisfiable
+    CheckRange("bytes=0-499", 1000, 1, 0, 499);
+    CheckRange("bytes=500-", 1000, 1, 500, 999);
+    CheckRange("bytes=999-999", 1000, 1, 999, 999);
+    CheckRange("bytes=900-5000", 1000, 1, 900, 999);
+    CheckRange("bytes=-200", 1000, 1, 800, 999);
+    CheckRange("bytes=-2000", 1000, 1, 0, 999);
+    
+    //Not satisfiable: 416
+    CheckRange("bytes=1000-", 1000, -1);
+    CheckRange("bytes=1000-2000", 1000, -1);
+    CheckRange("bytes=-0", 1000, -1);
+    CheckRange("bytes=0-", 0, -1);
+    CheckRange("bytes=-5", 0, -1);
+    
+    //Ignored, the whole file is sent
+    CheckRange("items=0-1", 1000, 0);
+    CheckRange("bytes=0-1,5-6", 1000, 0);
+    CheckRange("bytes=", 1000, 0);
+    CheckRange("bytes=abc", 1000, 0);
+    CheckRange("bytes=5-1", 1000, 0);
+    CheckRange("bytes=1-2x", 1000, 0);
+    CheckRange("bytes=-5x", 1000, 0);
+    CheckRange("bytes=-", 1000, 0);
+    CheckRange("bytes=5", 1000, 0);
+    
+    return CHECK_RESULT();
+}
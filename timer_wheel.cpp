@@ -0,0 +1,106 @@
+#include "timer_wheel.h"
+#include "connection.h"
+
+namespace mevent {
+
+TimerWheel::TimerWheel(int slots, time_t now)
+    : slots_(slots < 2 ? 2 : slots, NULL),
+      current_(now),
+      count_(0) {
+}
+
+void TimerWheel::Add(Connection *conn, time_t expire) {
+    if (conn->timer_slot_ >= 0) {
+        Erase(conn);
+    }
+
+    if (expire <= current_) {
+        expire = current_ + 1;
+    } else if (expire - current_ >= static_cast<time_t>(slots_.size())) {
+        expire = current_ + slots_.size() - 1;
+    }
+
+    int slot = static_cast<int>(expire % slots_.size());
+
+    conn->timer_slot_ = slot;
+    conn->timer_prev_ = NULL;
+    conn->timer_next_ = slots_[slot];
+    if (slots_[slot]) {
+        slots_[slot]->timer_prev_ = conn;
+    }
+    slots_[slot] = conn;
+
+    count_++;
+}
+
+void TimerWheel::Erase(Connection *conn) {
+    if (conn->timer_slot_ < 0) {
+        return;
+    }
+
+    if (conn->timer_prev_) {
+        conn->timer_prev_->timer_next_ = conn->timer_next_;
+    } else {
+        slots_[conn->timer_slot_] = conn->timer_next_;
+    }
+
+    if (conn->timer_next_) {
+        conn->timer_next_->timer_prev_ = conn->timer_prev_;
+    }
+
+    conn->timer_slot_ = -1;
+    conn->timer_next_ = NULL;
+    conn->timer_prev_ = NULL;
+
+    count_--;
+}
+
+bool TimerWheel::Empty() {
+    return count_ == 0;
+}
+
+Connection *TimerWheel::Expire(time_t now) {
+    Connection *head = NULL;
+    Connection *tail = NULL;
+
+    if (now <= current_) {
+        return NULL;
+    }
+
+    //After a long stall every slot is due, no need to walk them twice
+    time_t ticks = now - current_;
+    if (ticks > static_cast<time_t>(slots_.size())) {
+        ticks = slots_.size();
+    }
+
+    for (time_t t = now - ticks + 1; t <= now; t++) {
+        int slot = static_cast<int>(t % slots_.size());
+
+        Connection *conn = slots_[slot];
+        slots_[slot] = NULL;
+
+        while (conn) {
+            Connection *next = conn->timer_next_;
+
+            conn->timer_slot_ = -1;
+            conn->timer_prev_ = NULL;
+            conn->timer_next_ = NULL;
+            count_--;
+
+            if (tail) {
+                tail->timer_next_ = conn;
+            } else {
+                head = conn;
+            }
+            tail = conn;
+
+            conn = next;
+        }
+    }
+
+    current_ = now;
+
+    return head;
+}
+
+}//namespace mevent
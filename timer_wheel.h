@@ -0,0 +1,42 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <time.h>
+#include <stddef.h>
+
+#include <vector>
+
+namespace mevent {
+
+class Connection;
+
+//Hashed timing wheel with one second ticks, owned by a single event loop
+//thread, so it needs no locking. Connections are linked in intrusively
+//through Connection::timer_next_/timer_prev_.
+//
+//Deadlines must be less than `slots` seconds away, which keeps every
+//operation O(1). Callers re-arm lazily: an expired connection that has been
+//active in the meantime is simply added back with its new deadline.
+class TimerWheel {
+public:
+    TimerWheel(int slots, time_t now);
+    ~TimerWheel() {};
+
+    void Add(Connection *conn, time_t expire);
+    void Erase(Connection *conn);
+
+    bool Empty();
+
+    //Unlinks every connection whose slot came due up to `now` and returns
+    //them as a list chained through timer_next_
+    Connection *Expire(time_t now);
+
+private:
+    std::vector<Connection *>  slots_;
+    time_t                     current_;
+    size_t                     count_;
+};
+
+}//namespace mevent
+
+#endif
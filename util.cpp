@@ -10,12 +10,16 @@
 #include <pwd.h>
 #include <unistd.h>
 #include <sys/signal.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <sched.h>
 
 #ifdef __APPLE__
 #include <libproc.h>
 #endif
 
 #include <vector>
+#include <map>
 
 namespace mevent {
 namespace util {
@@ -259,28 +263,36 @@ static int Htoi(const char *s) {
 }
 
 std::string URLDecode(const std::string &str) {
-    std::string dest;
+    std::string dest(str.length(), '\0');
     
-    const char *data = str.c_str();
+    if (!str.empty()) {
+        dest.resize(URLDecode(str.data(), str.length(), &dest[0]));
+    }
+    
+    return dest;
+}
+    
+size_t URLDecode(const char *src, size_t len, char *dst) {
+    const char *data = src;
+    char *out = dst;
     
-    std::size_t len = str.length();
     while (len--) {
         if (*data == '+') {
-            dest.push_back(' ');
+            *out++ = ' ';
         } else if (*data == '%'
             && len >= 2
-            && isxdigit(*(data + 1))
-            && isxdigit(*(data + 2))) {
-            dest.push_back(Htoi(data + 1));
+            && isxdigit(static_cast<unsigned char>(*(data + 1)))
+            && isxdigit(static_cast<unsigned char>(*(data + 2)))) {
+            *out++ = Htoi(data + 1);
             data += 2;
             len -= 2;
         } else {
-            dest.push_back(*data);
+            *out++ = *data;
         }
         data++;
     }
     
-    return dest;
+    return out - dst;
 }
     
 std::string URLEncode(const std::string &str) {
@@ -332,5 +344,147 @@ std::string ExecutablePath() {
     return std::string(buf);
 }
     
+//"0-3,8-11\n" -> 0 1 2 3 8 9 10 11
+static void ParseCpuList(const char *str, std::vector<int> &cpus) {
+    const char *p = str;
+    
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        
+        long last = first;
+        p = end;
+        
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            p = end;
+        }
+        
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+        
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+}
+    
+int OpenTempFile(const std::string &dir) {
+    int fd;
+    
+#ifdef O_TMPFILE
+    fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
+    }
+    
+    //Not supported by every filesystem
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+        return -1;
+    }
+#endif
+    
+    std::string path = dir + "/mevent.XXXXXX";
+    
+    fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    unlink(path.c_str());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    
+    return fd;
+}
+    
+std::vector<std::vector<int>> GetNumaNodeCpus() {
+    std::map<int, std::vector<int>> nodes;
+    
+#ifdef __linux__
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            int node;
+            if (sscanf(ent->d_name, "node%d", &node) != 1) {
+                continue;
+            }
+            
+            char path[256];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            
+            FILE *fp = fopen(path, "r");
+            if (!fp) {
+                continue;
+            }
+            
+            char buf[1024] = {0};
+            if (fgets(buf, sizeof(buf), fp)) {
+                std::vector<int> cpus;
+                ParseCpuList(buf, cpus);
+                
+                //Memory-only nodes have no CPUs to run on
+                if (!cpus.empty()) {
+                    nodes[node] = cpus;
+                }
+            }
+            
+            fclose(fp);
+        }
+        
+        closedir(dir);
+    }
+#endif
+    
+    std::vector<std::vector<int>> result;
+    
+    for (auto it = nodes.begin(); it != nodes.end(); it++) {
+        result.push_back(it->second);
+    }
+    
+    if (result.empty()) {
+        std::vector<int> cpus;
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long i = 0; i < n; i++) {
+            cpus.push_back(static_cast<int>(i));
+        }
+        result.push_back(cpus);
+    }
+    
+    return result;
+}
+    
+bool SetThreadAffinity(pthread_t tid, const std::vector<int> &cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    
+    for (size_t i = 0; i < cpus.size(); i++) {
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) {
+            CPU_SET(cpus[i], &set);
+        }
+    }
+    
+    if (CPU_COUNT(&set) == 0) {
+        return false;
+    }
+    
+    return pthread_setaffinity_np(tid, sizeof(set), &set) == 0;
+#else
+    (void)tid;//avoid unused parameter warning
+    (void)cpus;//avoid unused parameter warning
+    return false;
+#endif
+}
+    
 }//namespace util
 }//namespace mevent
@@ -7,7 +7,10 @@
 #include <unistd.h>
 #include <sys/fcntl.h>
 
+#include <pthread.h>
+
 #include <string>
+#include <vector>
 
 #define MEVENT_LOG_DEBUG_EXIT(...) mevent::util::LogDebug(__FILE__, __LINE__, -1, __VA_ARGS__)
 #define MEVENT_LOG_DEBUG(...) mevent::util::LogDebug(__FILE__, __LINE__, 0, __VA_ARGS__)
@@ -29,9 +32,23 @@ namespace util {
     int GetSysGid(const char *name);
     
     std::string URLDecode(const std::string &str);
+    
+    //Decodes len bytes of src into dst, which may be src itself, and returns
+    //the decoded length. Never longer than len.
+    size_t URLDecode(const char *src, size_t len, char *dst);
     std::string URLEncode(const std::string &str);
     
     std::string ExecutablePath();
+    
+    //Unnamed read/write file in dir that is gone once closed, -1 on error
+    int OpenTempFile(const std::string &dir);
+    
+    //CPU ids of each NUMA node from /sys/devices/system/node, or a single
+    //node with every online CPU when the topology is not available
+    std::vector<std::vector<int>> GetNumaNodeCpus();
+    
+    //Linux only, returns false elsewhere
+    bool SetThreadAffinity(pthread_t tid, const std::vector<int> &cpus);
 }//namespace util
 }//namespace mevent
 
@@ -3,7 +3,6 @@
 #include "base64.h"
 #include "util.h"
 #include "connection.h"
-#include "lock_guard.h"
 
 #include <string>
 
@@ -34,11 +33,9 @@ namespace mevent {
     
 //Reference: https://github.com/dhbaird/easywsclient
     
-#define READ_BUFFER_SIZE 2048
-    
 void WebSocket::Reset() {
-    rbuf_.clear();
-    std::vector<uint8_t>().swap(rbuf_);
+    rbuf_.Release();
+    rbuf_len_ = 0;
     
     cache_str_.clear();
     std::string().swap(cache_str_);
@@ -47,6 +44,8 @@ void WebSocket::Reset() {
     ping_func_ = nullptr;
     pong_func_ = nullptr;
     on_message_func_ = nullptr;
+    on_write_full_func_ = nullptr;
+    on_write_drain_func_ = nullptr;
     
     max_buffer_size_ = 8192;
 }
@@ -113,11 +112,10 @@ void WebSocket::Handshake(std::string &data, const std::string &sec_websocket_ke
 
 bool WebSocket::Upgrade()
 {
-    if (conn_->Req()->sec_websocket_key_.empty()) {
+    std::string sec_websocket_key = conn_->Req()->Header("Sec-WebSocket-Key").ToString();
+    if (sec_websocket_key.empty()) {
         return false;
     }
-    
-    std::string sec_websocket_key = conn_->Req()->sec_websocket_key_;
 
 //    conn_->Req()->Reset();
 //    conn_->Resp()->Reset();
@@ -134,13 +132,13 @@ bool WebSocket::Upgrade()
 }
     
 ConnStatus WebSocket::ReadData() {
-    char buf[READ_BUFFER_SIZE];
     ssize_t n = 0;
+    bool drained = false;
     
     do {
-        n = conn_->Readn(buf, READ_BUFFER_SIZE);
+        n = conn_->ReadInto(rbuf_, rbuf_len_, &drained);
         if (n > 0) {
-            rbuf_.insert(rbuf_.end(), buf, buf + n);
+            rbuf_len_ += n;
             if (!Parse()) {
                 return ConnStatus::ERROR;
             }
@@ -149,20 +147,31 @@ ConnStatus WebSocket::ReadData() {
         } else {
             break;
         }
-    } while (n == READ_BUFFER_SIZE);
+    } while (!drained);
+    
+    //Idle WebSocket connections hold no receive buffer
+    if (rbuf_len_ == 0) {
+        rbuf_.Release();
+    }
     
     return ConnStatus::AGAIN;
 }
     
+//Complete frames are consumed from the front of rbuf_ in one go at the end
 bool WebSocket::Parse() {
+    std::size_t offset = 0;
+    bool ok = true;
+    
     while (true) {
         WebSocketHeader wsh;
+        
+        std::size_t avail = rbuf_len_ - offset;
 
-        if (rbuf_.size() < 2) {
-            return true;
+        if (avail < 2) {
+            break;
         }
 
-        const uint8_t *data = static_cast<const uint8_t *>(&rbuf_[0]);
+        uint8_t *data = reinterpret_cast<uint8_t *>(rbuf_.Data()) + offset;
         
         wsh.len = 0;
         wsh.fin = (data[0] & 0x80) == 0x80;
@@ -180,8 +189,8 @@ bool WebSocket::Parse() {
             wsh.header_size += sizeof(wsh.masking_key);
         }
         
-        if (rbuf_.size() < wsh.header_size) {
-            return true;
+        if (avail < wsh.header_size) {
+            break;
         }
 
         if (wsh.len0 < 126) {
@@ -207,21 +216,25 @@ bool WebSocket::Parse() {
             wsh.masking_key[3] = data[wsh.header_size - 1];
         }
         
-        if (rbuf_.size() < wsh.header_size + wsh.len) {
-            return true;
+        //Checked before the payload arrives so an oversized frame is never buffered
+        if (cache_str_.length() + wsh.len > max_buffer_size_) {
+            ok = false;
+            break;
         }
         
-        if (cache_str_.length() + wsh.len > max_buffer_size_) {
-            return false;
+        if (avail < wsh.header_size + wsh.len) {
+            break;
         }
         
+        uint8_t *payload = data + wsh.header_size;
+        
         if (wsh.mask && wsh.len > 0) {
             for (uint64_t i = 0; i != wsh.len; i++) {
-                rbuf_[i + wsh.header_size] ^= wsh.masking_key[i & 0x3];
+                payload[i] ^= wsh.masking_key[i & 0x3];
             }
         }
         
-        cache_str_.insert(cache_str_.end(), rbuf_.begin() + wsh.header_size, rbuf_.begin() + wsh.header_size + wsh.len);
+        cache_str_.append(reinterpret_cast<const char *>(payload), wsh.len);
         
         if (wsh.opcode == WebSocketOpcodeType::BINARY_FRAME
             || wsh.opcode == WebSocketOpcodeType::TEXT_FRAME
@@ -244,10 +257,15 @@ bool WebSocket::Parse() {
             conn_->WebSocketTaskPush(WebSocketOpcodeType::CLOSE, cache_str_);
         }
         
-        rbuf_.erase(rbuf_.begin(), rbuf_.begin() + wsh.header_size + wsh.len);
+        offset += wsh.header_size + wsh.len;
     }
     
-    return true;
+    if (offset > 0) {
+        rbuf_.Erase(rbuf_len_, 0, offset);
+        rbuf_len_ -= offset;
+    }
+    
+    return ok;
 }
     
 void WebSocket::SendPong(const std::string &str) {
@@ -262,68 +280,53 @@ void WebSocket::SendPing(const std::string &str) {
     conn_->WriteData(frame_data);
 }
     
-void WebSocket::WriteString(const std::string &str) {
+bool WebSocket::WriteString(const std::string &str) {
     std::vector<uint8_t> frame_data;
     MakeFrame(frame_data, str, WebSocketOpcodeType::TEXT_FRAME);
-    conn_->WriteData(frame_data);
-}
-    
-bool WebSocket::SendPongSafe(const std::string &str) {
-    LockGuard lock_guard(conn_->mtx_);
-    
-    std::vector<uint8_t> frame_data;
-    MakeFrame(frame_data, str, WebSocketOpcodeType::PONG);
-    conn_->WriteData(frame_data);
     
-    ConnStatus status = conn_->Flush();
-    if (status == ConnStatus::ERROR && status == ConnStatus::CLOSE) {
+    std::string data(frame_data.begin(), frame_data.end());
+    if (!conn_->AdmitWrite(data)) {
         return false;
     }
     
+    conn_->WriteString(std::move(data));
+    
     return true;
 }
     
-bool WebSocket::SendPingSafe(const std::string &str) {
-    LockGuard lock_guard(conn_->mtx_);
-    
+//The *Safe() calls only build the frame on the calling thread. Writing it is
+//left to the connection's event loop, so the caller never waits for the
+//connection lock or a slow socket.
+//Only data frames count against the write watermarks
+bool WebSocket::PostFrame(const std::string &str, uint8_t opcode) {
     std::vector<uint8_t> frame_data;
-    MakeFrame(frame_data, str, WebSocketOpcodeType::PING);
-    conn_->WriteData(frame_data);
-    
-    ConnStatus status = conn_->Flush();
-    if (status == ConnStatus::ERROR && status == ConnStatus::CLOSE) {
-        return false;
-    }
+    MakeFrame(frame_data, str, opcode);
     
-    return true;
+    return conn_->PostWrite(std::string(frame_data.begin(), frame_data.end()), opcode == WebSocketOpcodeType::TEXT_FRAME);
 }
     
-bool WebSocket::WriteStringSafe(const std::string &str) {
-    LockGuard lock_guard(conn_->mtx_);
-    
-    std::vector<uint8_t> frame_data;
-    MakeFrame(frame_data, str, WebSocketOpcodeType::TEXT_FRAME);
-    conn_->WriteData(frame_data);
+bool WebSocket::SendPongSafe(const std::string &str) {
+    return PostFrame(str, WebSocketOpcodeType::PONG);
+}
     
-    ConnStatus status = conn_->Flush();
-    if (status == ConnStatus::ERROR && status == ConnStatus::CLOSE) {
-        return false;
-    }
+bool WebSocket::SendPingSafe(const std::string &str) {
+    return PostFrame(str, WebSocketOpcodeType::PING);
+}
     
-    return true;
+bool WebSocket::WriteStringSafe(const std::string &str) {
+    return PostFrame(str, WebSocketOpcodeType::TEXT_FRAME);
 }
     
 bool WebSocket::WriteRawDataSafe(const std::vector<uint8_t> &data) {
-    LockGuard lock_guard(conn_->mtx_);
-    
-    conn_->WriteData(data);
+    return conn_->PostWrite(std::string(data.begin(), data.end()), true);
+}
     
-    ConnStatus status = conn_->Flush();
-    if (status == ConnStatus::ERROR && status == ConnStatus::CLOSE) {
+bool WebSocket::CloseSafe() {
+    if (!PostFrame(std::string(), WebSocketOpcodeType::CLOSE)) {
         return false;
     }
     
-    return true;
+    return conn_->PostClose();
 }
     
 Connection *WebSocket::Conn() {
@@ -350,4 +353,16 @@ void WebSocket::SetMaxBufferSize(std::size_t size) {
     max_buffer_size_ = size;
 }
 
+void WebSocket::SetWriteWatermarks(std::size_t low, std::size_t high, WriteOverflowPolicy policy) {
+    conn_->SetWriteWatermarks(low, high, policy);
+}
+
+void WebSocket::SetOnWriteFullHandler(WebSocketWriteHandlerFunc func) {
+    on_write_full_func_ = func;
+}
+
+void WebSocket::SetOnWriteDrainHandler(WebSocketWriteHandlerFunc func) {
+    on_write_drain_func_ = func;
+}
+
 }//namespace mevent
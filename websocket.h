@@ -3,6 +3,7 @@
 
 #include "request.h"
 #include "conn_status.h"
+#include "buffer_pool.h"
 
 #include <stdint.h>
 
@@ -53,6 +54,7 @@ struct WebSocketTaskItem {
     
 typedef std::function<void(WebSocket *, const std::string &)> WebSocketHandlerFunc;
 typedef std::function<void(WebSocket *)> WebSocketCloseHandlerFunc;
+typedef std::function<void(WebSocket *)> WebSocketWriteHandlerFunc;
 
 class WebSocket
 {
@@ -67,7 +69,8 @@ public:
     void SendPong(const std::string &str);
     void SendPing(const std::string &str);
     
-    void WriteString(const std::string &str);
+    //False if the message was not queued, see HTTPServer::SetWriteWatermarks()
+    bool WriteString(const std::string &str);
     
     Connection *Conn();
     
@@ -78,18 +81,37 @@ public:
     
     void SetMaxBufferSize(std::size_t size);
     
-    //Thread Safe
+    //Overrides the server's write watermarks for this connection. Like the
+    //handlers below, set it in the upgrade handler, before other threads
+    //write to the WebSocket
+    void SetWriteWatermarks(std::size_t low, std::size_t high, WriteOverflowPolicy policy);
+    
+    //Called once when a message finds the write queue above the high
+    //watermark, on the writing thread, and once it drained below the low
+    //watermark again, on the thread that flushed it with the connection
+    //locked. Producers can pause in between instead of losing messages.
+    void SetOnWriteFullHandler(WebSocketWriteHandlerFunc func);
+    void SetOnWriteDrainHandler(WebSocketWriteHandlerFunc func);
+    
+    //Thread Safe, queued to the connection's event loop. Returns false if
+    //the connection was never accepted or the write watermarks turned the
+    //message away; data posted after it closed is dropped.
     bool SendPongSafe(const std::string &str);
     bool SendPingSafe(const std::string &str);
     bool WriteStringSafe(const std::string &str);
     bool WriteRawDataSafe(const std::vector<uint8_t> &data);
     
+    //Sends a close frame, then closes once everything queued before it is written
+    bool CloseSafe();
+    
 private:
     friend class EventLoop;
     friend class Connection;
     
     void Reset();
     
+    bool PostFrame(const std::string &str, uint8_t opcode);
+    
     void Handshake(std::string &data, const std::string &sec_websocket_key);
 
     bool Parse();
@@ -100,13 +122,16 @@ private:
     
     std::size_t                 max_buffer_size_;
     
-    std::vector<uint8_t>        rbuf_;
+    ReadBuffer                  rbuf_;
+    std::size_t                 rbuf_len_;
     std::string                 cache_str_;
     
     WebSocketHandlerFunc        on_message_func_;
     WebSocketHandlerFunc        ping_func_;
     WebSocketHandlerFunc        pong_func_;
     WebSocketCloseHandlerFunc   on_close_func_;
+    WebSocketWriteHandlerFunc   on_write_full_func_;
+    WebSocketWriteHandlerFunc   on_write_drain_func_;
 };
 
 }//namespace mevent